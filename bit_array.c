@@ -42,20 +42,21 @@
 #define TEST_BIT(A, p)      ((A)[((p) / 8)] & ((uint8_t)(1 << ((p) % 8))))
 #define SET_BIT(A, p)       ((A)[((p) / 8)] |= ((uint8_t)(1 << ((p) % 8))))
 
-// Create a new bit array to track the status of 'num' of bits.
-// The contents of the data is uninitialized.
-bit_array* bit_array_new(size_t num_of_bits)
+// Allocate a bit array of 'num' bits, the struct and data are counted
+// under 'hdr_cat' and 'data_cat'. The contents of the data is uninitialized.
+static bit_array* bit_array_alloc(size_t num_of_bits, emalloc_cat_t hdr_cat,
+                                  emalloc_cat_t data_cat)
 {
     if (num_of_bits == 0) return NULL;
 
     if (ROUND_TO((num_of_bits), 8) < num_of_bits) return NULL;
 
     size_t n_bytes = NUM_OF_BYTES(num_of_bits);
-    bit_array* ba = (bit_array*)emalloc(sizeof(bit_array));
+    bit_array* ba = (bit_array*)emalloc(sizeof(bit_array), hdr_cat);
     if (!ba) return NULL;
     ba->n_bytes = n_bytes;
     ba->n_bits = num_of_bits;
-    ba->data = (uint8_t*)emalloc(n_bytes);
+    ba->data = (uint8_t*)emalloc(n_bytes, data_cat);
     if (!ba->data)
     {
         efree(ba);
@@ -64,6 +65,14 @@ bit_array* bit_array_new(size_t num_of_bits)
     return ba;
 }
 
+// Create a new bit array to track the status of 'num' of bits.
+// The contents of the data is uninitialized.
+bit_array* bit_array_new(size_t num_of_bits)
+{
+    return bit_array_alloc(num_of_bits, EMALLOC_CAT_BITMAP_HDR,
+                           EMALLOC_CAT_BITMAP_DATA);
+}
+
 // Create a new bit array to track the status of 'num' of bits.
 // All the tracked bits are set (value 1).
 bit_array* bit_array_new_set(size_t num_of_bits)
@@ -86,6 +95,19 @@ bit_array* bit_array_new_reset(size_t num_of_bits)
     return ba;
 }
 
+// Create a new bit array to track the status of 'num' of bits.
+// All the tracked bits are reset (value 0). Counted as other EMM metadata
+// rather than as an EMA bit map.
+bit_array* bit_array_new_reset_other(size_t num_of_bits)
+{
+    bit_array* ba =
+        bit_array_alloc(num_of_bits, EMALLOC_CAT_OTHER, EMALLOC_CAT_OTHER);
+    if (!ba) return NULL;
+
+    memset(ba->data, 0, ba->n_bytes);
+    return ba;
+}
+
 // Delete the bit_array 'ba' and the data it owns
 void bit_array_delete(bit_array* ba)
 {
@@ -194,6 +216,34 @@ bool bit_array_test_range_any(bit_array* ba, size_t pos, size_t len)
     return false;
 }
 
+// Return the position of the first bit in [pos, end) equal to 'value', or
+// 'end' if none. Whole bytes without such a bit are skipped at once.
+static size_t bit_array_find(bit_array* ba, size_t pos, size_t end, bool value)
+{
+    uint8_t skip = value ? 0x00 : 0xFF;
+    while (pos < end)
+    {
+        if ((pos % 8) == 0 && pos + 8 <= end && ba->data[pos / 8] == skip)
+        {
+            pos += 8;
+            continue;
+        }
+        if ((TEST_BIT(ba->data, pos) != 0) == value) return pos;
+        pos++;
+    }
+    return end;
+}
+
+size_t bit_array_next_set(bit_array* ba, size_t pos, size_t end)
+{
+    return bit_array_find(ba, pos, end, true);
+}
+
+size_t bit_array_next_clear(bit_array* ba, size_t pos, size_t end)
+{
+    return bit_array_find(ba, pos, end, false);
+}
+
 // Set the bit at 'pos'
 void bit_array_set(bit_array* ba, size_t pos)
 {
@@ -296,6 +346,34 @@ void bit_array_reattach(bit_array* ba, size_t num_of_bits, uint8_t* data)
     ba->data = data;
 }
 
+// Change the number of bits tracked by 'ba' to 'num', new bits are reset.
+// The data is reallocated only if it has no room for the new bits.
+int bit_array_resize(bit_array* ba, size_t num_of_bits)
+{
+    if (num_of_bits == 0) return EINVAL;
+    if (ROUND_TO((num_of_bits), 8) < num_of_bits) return EINVAL;
+
+    size_t old_bits = ba->n_bits;
+    size_t n_bytes = NUM_OF_BYTES(num_of_bits);
+    if (n_bytes > emalloc_usable_size(ba->data))
+    {
+        uint8_t* data =
+            (uint8_t*)emalloc(n_bytes, emalloc_block_cat(ba->data));
+        if (!data) return ENOMEM;
+        memcpy(data, ba->data, ba->n_bytes);
+        efree(ba->data);
+        ba->data = data;
+    }
+    if (n_bytes > ba->n_bytes)
+        memset(ba->data + ba->n_bytes, 0, n_bytes - ba->n_bytes);
+    ba->n_bytes = n_bytes;
+    ba->n_bits = num_of_bits;
+    // clear the unused bits of the last old byte
+    if (num_of_bits > old_bits)
+        bit_array_reset_range(ba, old_bits, num_of_bits - old_bits);
+    return 0;
+}
+
 // Split the bit array at 'pos'
 int bit_array_split(bit_array* ba, size_t pos, bit_array** new_lower,
                     bit_array** new_higher)
@@ -324,7 +402,8 @@ int bit_array_split(bit_array* ba, size_t pos, bit_array** new_lower,
     size_t r_bits = ba->n_bits - l_bits;
 
     // new data for bit_array of lower pages
-    uint8_t* data = (uint8_t*)emalloc(l_bytes);
+    emalloc_cat_t data_cat = emalloc_block_cat(ba->data);
+    uint8_t* data = (uint8_t*)emalloc(l_bytes, data_cat);
     if (!data) return ENOMEM;
     size_t i;
     for (i = 0; i < byte_index; ++i)
@@ -339,7 +418,7 @@ int bit_array_split(bit_array* ba, size_t pos, bit_array** new_lower,
     }
 
     // new bit_array for higher pages
-    bit_array* ba2 = bit_array_new(r_bits);
+    bit_array* ba2 = bit_array_alloc(r_bits, emalloc_block_cat(ba), data_cat);
     if (!ba2)
     {
         efree(data);
@@ -378,3 +457,13 @@ int bit_array_split(bit_array* ba, size_t pos, bit_array** new_lower,
     *new_higher = ba2;
     return 0;
 }
+
+// Relocate the bit_array 'ba' and its data for metadata compaction
+// Returns the possibly moved bit_array
+bit_array* bit_array_compact(bit_array* ba)
+{
+    uint8_t* data = (uint8_t*)emalloc_compact_block(ba->data);
+    if (data) ba->data = data;
+    bit_array* moved = (bit_array*)emalloc_compact_block(ba);
+    return moved ? moved : ba;
+}
@@ -39,6 +39,7 @@
 #include "bit_array.h"
 #include "ema_imp.h"
 #include "emalloc.h"
+#include "lz.h"
 #include "sgx_mm.h"
 #include "sgx_mm_primitives.h"
 #include "sgx_mm_rt_abstraction.h"
@@ -52,6 +53,10 @@
 struct ema_root_
 {
     ema_t* guard;
+    size_t compact_cursor;  // where the next metadata compaction resumes
+    int placement;          // default SGX_EMA_PLACE_*, 0 for first fit
+    size_t rover;           // where the next SGX_EMA_PLACE_NEXT_FIT search
+                            // starts
 };
 
 extern size_t mm_user_base;
@@ -75,6 +80,40 @@ ema_root_t g_rts_ema_root = {.guard = &rts_ema_guard};
 ema_t user_ema_guard = {.next = &user_ema_guard, .prev = &user_ema_guard};
 ema_root_t g_user_ema_root = {.guard = &user_ema_guard};
 
+// Committed pages and quota in pages of each region tag, 0 for no quota.
+// The counts change with every bit set or cleared in an eaccept_map.
+static size_t tag_committed[SGX_EMA_NUM_TAGS];
+static size_t tag_quota[SGX_EMA_NUM_TAGS];
+static size_t num_quotas;  // tags with a quota, skip checks if none
+static sgx_mm_reclaim_handler_t reclaim_handler;
+static void* reclaim_priv;
+static bool in_reclaim;
+static bool quota_exempt;  // set while emalloc adds a reserve
+
+// Committed pages of all regions and their budget in pages, see
+// sgx_mm_set_budget. A limit of 0 means no budget.
+static size_t committed_pages;
+static size_t budget_limit;
+static size_t budget_high;
+static size_t budget_low;
+static bool under_pressure;  // crossed the high watermark, not yet back
+                             // below the low one
+
+#define MAX_PRESSURE_HANDLERS 8
+static struct
+{
+    sgx_mm_pressure_handler_t handler;
+    void* priv;
+} pressure_handlers[MAX_PRESSURE_HANDLERS];
+
+// Uncommit cached pages of the EMM users until at most 'target' pages are
+// committed, see sgx_mm.c
+extern void mm_reclaim_internal(size_t target);
+
+static int ema_sampler_restore_range(size_t start, size_t end);
+static int ema_backing_release_range(size_t start, size_t end, bool restore);
+static bool ema_is_internal(size_t addr);
+
 #ifdef TEST
 static void dump_ema_node(ema_t* node, size_t index)
 {
@@ -136,6 +175,11 @@ uint32_t get_ema_alloc_flags(ema_t* node)
     return node->alloc_flags;
 }
 
+int get_ema_tag(ema_t* node)
+{
+    return node->tag;
+}
+
 uint64_t get_ema_si_flags(ema_t* node)
 {
     return node->si_flags;
@@ -169,33 +213,61 @@ static bool ema_overlap_addr(const ema_t* ema, size_t addr)
     return false;
 }
 
+static void ema_account_commit(ema_t* node, size_t num_pages)
+{
+    tag_committed[node->tag] += num_pages;
+    committed_pages += num_pages;
+}
+
+static void ema_account_uncommit(ema_t* node, size_t num_pages)
+{
+    tag_committed[node->tag] -= num_pages;
+    committed_pages -= num_pages;
+}
+
+// Number of committed pages in [pos, end) of the eaccept_map of 'node'
+static size_t ema_count_committed(ema_t* node, size_t pos, size_t end)
+{
+    size_t count = 0;
+    while ((pos = bit_array_next_set(node->eaccept_map, pos, end)) < end)
+    {
+        size_t clear = bit_array_next_clear(node->eaccept_map, pos, end);
+        count += clear - pos;
+        pos = clear;
+    }
+    return count;
+}
+
 int ema_set_eaccept_full(ema_t* node)
 {
+    size_t num_pages = node->size >> SGX_PAGE_SHIFT;
     if (!node->eaccept_map)
     {
-        node->eaccept_map = bit_array_new_set((node->size) >> SGX_PAGE_SHIFT);
+        node->eaccept_map = bit_array_new_set(num_pages);
         if (!node->eaccept_map)
             return ENOMEM;
-        else
-            return 0;
+        ema_account_commit(node, num_pages);
+        return 0;
     }
-    else
-        bit_array_set_all(node->eaccept_map);
+    ema_account_commit(node,
+                       num_pages - ema_count_committed(node, 0, num_pages));
+    bit_array_set_all(node->eaccept_map);
     return 0;
 }
 
 int ema_clear_eaccept_full(ema_t* node)
 {
+    size_t num_pages = node->size >> SGX_PAGE_SHIFT;
     if (!node->eaccept_map)
     {
-        node->eaccept_map = bit_array_new_reset((node->size) >> SGX_PAGE_SHIFT);
+        node->eaccept_map = bit_array_new_reset(num_pages);
         if (!node->eaccept_map)
             return ENOMEM;
         else
             return 0;
     }
-    else
-        bit_array_reset_all(node->eaccept_map);
+    ema_account_uncommit(node, ema_count_committed(node, 0, num_pages));
+    bit_array_reset_all(node->eaccept_map);
     return 0;
 }
 
@@ -217,10 +289,192 @@ int ema_set_eaccept(ema_t* node, size_t start, size_t end)
         node->eaccept_map = bit_array_new_reset((node->size) >> SGX_PAGE_SHIFT);
         if (!node->eaccept_map) return ENOMEM;
     }
+    // callers only accept pages that were not committed
+    assert(!bit_array_test_range_any(node->eaccept_map, pos_begin,
+                                     pos_end - pos_begin));
     bit_array_set_range(node->eaccept_map, pos_begin, pos_end - pos_begin);
+    ema_account_commit(node, pos_end - pos_begin);
+    return 0;
+}
+
+void ema_set_tag(ema_t* node, int tag)
+{
+    // the tag is set before any page is committed
+    assert(!node->eaccept_map);
+    assert(tag >= 0 && tag < SGX_EMA_NUM_TAGS);
+    node->tag = (uint8_t)tag;
+}
+
+static int ema_tag_check(int tag, size_t num_pages)
+{
+    size_t quota = tag_quota[tag];
+    if (!quota || tag_committed[tag] + num_pages <= quota) return 0;
+    if (!reclaim_handler || in_reclaim || num_pages > quota) return ENOMEM;
+
+    // the handler may only uncommit, so EMAs held by the caller stay valid
+    in_reclaim = true;
+    reclaim_handler(tag,
+                    (tag_committed[tag] + num_pages - quota) << SGX_PAGE_SHIFT,
+                    reclaim_priv);
+    in_reclaim = false;
+    if (tag_committed[tag] + num_pages <= quota) return 0;
+    return ENOMEM;
+}
+
+// Bring the committed pages down to the low watermark less 'num_pages',
+// first from the caches of the EMM, then from those of the runtime
+static void ema_relieve_pressure(size_t num_pages)
+{
+    size_t target = budget_low > num_pages ? budget_low - num_pages : 0;
+
+    in_reclaim = true;
+    mm_reclaim_internal(target);
+    for (int i = 0; i < MAX_PRESSURE_HANDLERS; i++)
+    {
+        if (committed_pages <= target) break;
+        if (pressure_handlers[i].handler)
+            pressure_handlers[i].handler(
+                (committed_pages - target) << SGX_PAGE_SHIFT,
+                pressure_handlers[i].priv);
+    }
+    in_reclaim = false;
+}
+
+// Check the budget for committing 'num_pages' more pages. Faults are never
+// failed, there is nothing the faulting code could do about it, and never
+// reclaim, the handlers must not run in the #PF handler. The pages they
+// commit are counted, the next commit outside a fault relieves the pressure.
+static int ema_budget_check(size_t num_pages, bool fault)
+{
+    if (!budget_limit || in_reclaim || fault) return 0;
+    if (under_pressure && committed_pages < budget_low) under_pressure = false;
+    if (!under_pressure && committed_pages + num_pages > budget_high)
+    {
+        under_pressure = true;
+        ema_relieve_pressure(num_pages);
+    }
+    if (committed_pages + num_pages <= budget_limit) return 0;
+
+    // throttle commits at the limit, each one tries to reclaim first
+    ema_relieve_pressure(num_pages);
+    if (committed_pages + num_pages <= budget_limit) return 0;
+    return ENOMEM;
+}
+
+// Check that committing 'num_pages' more pages to 'tag' stays within its
+// quota and the global budget, reclaiming pages if it doesn't.
+int ema_quota_check(int tag, size_t num_pages)
+{
+    if (quota_exempt) return 0;
+    int ret = ema_tag_check(tag, num_pages);
+    if (ret) return ret;
+    return ema_budget_check(num_pages, false);
+}
+
+// Check the quotas for committing the uncommitted pages in [start, end) of
+// the EMAs [first, last). Done before the caller looks at the commit state
+// of the pages, which the reclaim handler may change.
+static int ema_quota_check_range(ema_t* first, ema_t* last, size_t start,
+                                 size_t end, bool fault)
+{
+    size_t needed[SGX_EMA_NUM_TAGS] = {0};
+    size_t total = 0;
+
+    if (quota_exempt || (!num_quotas && !budget_limit)) return 0;
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        if (!curr->eaccept_map) continue;
+        if (!tag_quota[curr->tag] && !budget_limit) continue;
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        size_t pos = (real_start - curr->start_addr) >> SGX_PAGE_SHIFT;
+        size_t pos_end = (real_end - curr->start_addr) >> SGX_PAGE_SHIFT;
+        size_t n = pos_end - pos - ema_count_committed(curr, pos, pos_end);
+        needed[curr->tag] += n;
+        total += n;
+    }
+    if (!total) return 0;
+    for (int tag = 0; tag < SGX_EMA_NUM_TAGS; tag++)
+    {
+        if (!needed[tag]) continue;
+        int ret = ema_tag_check(tag, needed[tag]);
+        if (ret) return ret;
+    }
+    return ema_budget_check(total, fault);
+}
+
+int ema_set_quota(int tag, size_t num_pages)
+{
+    // tag 0 includes the EMM metadata, which must not be throttled
+    if (tag <= 0 || tag >= SGX_EMA_NUM_TAGS) return EINVAL;
+    if (tag_quota[tag]) num_quotas--;
+    if (num_pages) num_quotas++;
+    tag_quota[tag] = num_pages;
+    return 0;
+}
+
+void ema_set_reclaim_handler(sgx_mm_reclaim_handler_t handler, void* priv)
+{
+    reclaim_handler = handler;
+    reclaim_priv = priv;
+}
+
+size_t ema_tag_committed(int tag)
+{
+    return tag_committed[tag];
+}
+
+void ema_set_quota_exempt(bool exempt)
+{
+    quota_exempt = exempt;
+}
+
+size_t ema_committed(void)
+{
+    return committed_pages;
+}
+
+int ema_set_budget(size_t limit, size_t high, size_t low)
+{
+    if (limit && (high > limit || low > high)) return EINVAL;
+    budget_limit = limit;
+    budget_high = high;
+    budget_low = low;
+    under_pressure = false;
+    return 0;
+}
+
+int ema_add_pressure_handler(sgx_mm_pressure_handler_t handler, void* priv)
+{
+    int free_slot = -1;
+    for (int i = 0; i < MAX_PRESSURE_HANDLERS; i++)
+    {
+        if (pressure_handlers[i].handler == handler &&
+            pressure_handlers[i].priv == priv)
+            return EEXIST;
+        if (!pressure_handlers[i].handler && free_slot < 0) free_slot = i;
+    }
+    if (free_slot < 0) return ENOMEM;
+    pressure_handlers[free_slot].handler = handler;
+    pressure_handlers[free_slot].priv = priv;
     return 0;
 }
 
+int ema_remove_pressure_handler(sgx_mm_pressure_handler_t handler, void* priv)
+{
+    for (int i = 0; i < MAX_PRESSURE_HANDLERS; i++)
+    {
+        if (pressure_handlers[i].handler == handler &&
+            pressure_handlers[i].priv == priv)
+        {
+            pressure_handlers[i].handler = NULL;
+            pressure_handlers[i].priv = NULL;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
 bool ema_page_committed(ema_t* ema, size_t addr)
 {
     assert(!(addr % SGX_PAGE_SIZE));
@@ -233,6 +487,24 @@ bool ema_page_committed(ema_t* ema, size_t addr)
                           (addr - ema->start_addr) >> SGX_PAGE_SHIFT);
 }
 
+// Find the first run of committed pages in [start, end) of 'ema'. Returns
+// false if none, otherwise the run is returned in [*run_start, *run_end).
+static bool ema_next_committed(ema_t* ema, size_t start, size_t end,
+                               size_t* run_start, size_t* run_end)
+{
+    if (!ema->eaccept_map) return false;
+
+    size_t pos_end = (end - ema->start_addr) >> SGX_PAGE_SHIFT;
+    size_t pos = bit_array_next_set(
+        ema->eaccept_map, (start - ema->start_addr) >> SGX_PAGE_SHIFT, pos_end);
+    if (pos == pos_end) return false;
+
+    *run_start = ema->start_addr + (pos << SGX_PAGE_SHIFT);
+    pos = bit_array_next_clear(ema->eaccept_map, pos, pos_end);
+    *run_end = ema->start_addr + (pos << SGX_PAGE_SHIFT);
+    return true;
+}
+
 // search for a node whose address range contains 'addr'
 ema_t* search_ema(ema_root_t* root, size_t addr)
 {
@@ -293,7 +565,19 @@ void push_back_ema(ema_root_t* root, ema_t* node)
 int search_ema_range(ema_root_t* root, size_t start, size_t end,
                      ema_t** ema_begin, ema_t** ema_end)
 {
-    ema_t* node = root->guard->next;
+    ema_t* hint = NULL;
+    return search_ema_range_hint(root, &hint, start, end, ema_begin, ema_end);
+}
+
+// Same as search_ema_range but start the search after '*hint' if it is not
+// NULL. The caller must ensure '*hint' is still on the list and ends at or
+// below 'start'. On success '*hint' is set to the node preceding 'ema_begin',
+// or NULL if 'ema_begin' is the first node. Nodes in [ema_begin, ema_end) may
+// be split or destroyed, '*hint' stays valid for a search at a higher start.
+int search_ema_range_hint(ema_root_t* root, ema_t** hint, size_t start,
+                          size_t end, ema_t** ema_begin, ema_t** ema_end)
+{
+    ema_t* node = *hint ? (*hint)->next : root->guard->next;
 
     // find the first node that has addr >= 'start'
     while ((node != root->guard) && ema_lower_than_addr(node, start))
@@ -310,6 +594,7 @@ int search_ema_range(ema_root_t* root, size_t start, size_t end,
     }
 
     *ema_begin = node;
+    *hint = (node->prev == root->guard) ? NULL : node->prev;
 
     // find the last node that has addr <= 'end'
     while ((node != root->guard) && (!ema_higher_than_addr(node, end)))
@@ -321,6 +606,298 @@ int search_ema_range(ema_root_t* root, size_t start, size_t end,
     return 0;
 }
 
+/*
+ * Region handles.
+ * A handle holds the index of a slot in the low 32 bits and the generation of
+ * the slot in the high 32 bits. A slot tracks the lowest EMA still belonging
+ * to the region, and the end of the region as allocated. EMAs of a region
+ * carry the slot index, which is copied to both halves on split.
+ */
+typedef struct handle_slot_
+{
+    ema_t* ema;  // lowest EMA of the region, NULL if the slot is free
+    size_t end;
+    uint32_t gen;
+    uint32_t next_free;
+} handle_slot_t;
+
+static handle_slot_t* handle_slots = NULL;
+static uint32_t num_handle_slots = 0;
+static uint32_t free_handle_slot = 0;  // 0 if none, slot 0 is never used
+
+static bool grow_handle_slots(void)
+{
+    uint32_t n = num_handle_slots ? num_handle_slots * 2 : 64;
+    if (n < num_handle_slots) return false;
+    // this may add an emalloc reserve and split EMAs, which read the slots,
+    // so copy the old slots only after it returns.
+    handle_slot_t* slots = (handle_slot_t*)emalloc(
+        n * sizeof(handle_slot_t), EMALLOC_CAT_OTHER);
+    if (!slots) return false;
+
+    uint32_t first_new = 1;
+    if (handle_slots)
+    {
+        memcpy(slots, handle_slots, num_handle_slots * sizeof(handle_slot_t));
+        efree(handle_slots);
+        first_new = num_handle_slots;
+    }
+    for (uint32_t i = first_new; i < n; i++)
+    {
+        slots[i].ema = NULL;
+        slots[i].gen = 0;
+        slots[i].next_free = (i + 1 < n) ? i + 1 : 0;
+    }
+    handle_slots = slots;
+    num_handle_slots = n;
+    free_handle_slot = first_new;
+    return true;
+}
+
+sgx_mm_handle_t ema_handle_new(ema_t* node)
+{
+    if (!free_handle_slot && !grow_handle_slots()) return 0;
+
+    uint32_t i = free_handle_slot;
+    handle_slot_t* slot = &handle_slots[i];
+    free_handle_slot = slot->next_free;
+    slot->ema = node;
+    slot->end = node->start_addr + node->size;
+    node->handle = i;
+    return ((uint64_t)slot->gen << 32) | i;
+}
+
+static handle_slot_t* handle_to_slot(sgx_mm_handle_t handle)
+{
+    uint32_t i = (uint32_t)handle;
+    if (i == 0 || i >= num_handle_slots) return NULL;
+    handle_slot_t* slot = &handle_slots[i];
+    if (!slot->ema || slot->gen != (uint32_t)(handle >> 32)) return NULL;
+    return slot;
+}
+
+// Keep the slot pointing to the lowest EMA of the region when 'ema' is
+// going away, or release the slot if it was the last one. The end of the
+// region is lowered when its tail goes away, e.g., when it shrinks.
+static void handle_ema_destroyed(ema_t* ema)
+{
+    handle_slot_t* slot = &handle_slots[ema->handle];
+    size_t ema_end = ema->start_addr + ema->size;
+    if (slot->ema != ema)
+    {
+        if (ema_end != slot->end) return;
+        // the guard node has no handle
+        ema_t* prev = ema->prev;
+        slot->end = (prev->handle == ema->handle)
+                        ? prev->start_addr + prev->size
+                        : ema->start_addr;
+        return;
+    }
+
+    // the guard node (start_addr 0) ends the walk
+    for (ema_t* n = ema->next;
+         n->start_addr >= ema_end && n->start_addr < slot->end; n = n->next)
+    {
+        if (n->handle == ema->handle)
+        {
+            slot->ema = n;
+            return;
+        }
+    }
+    slot->ema = NULL;
+    slot->gen++;
+    slot->next_free = free_handle_slot;
+    free_handle_slot = ema->handle;
+}
+
+// Same as search_ema_range, except starting from the region referenced by
+// 'handle'. All EMAs overlapping [start, end) must belong to the region.
+int ema_handle_range(ema_root_t* root, sgx_mm_handle_t handle, size_t start,
+                     size_t end, ema_t** ema_begin, ema_t** ema_end)
+{
+    handle_slot_t* slot = handle_to_slot(handle);
+    if (!slot) return EINVAL;
+    ema_t* node = slot->ema;
+    if (start < node->start_addr || end > slot->end || start >= end)
+        return EINVAL;
+
+    while ((node != root->guard) && ema_lower_than_addr(node, start))
+        node = node->next;
+    if ((node == root->guard) || ema_higher_than_addr(node, end))
+        return EINVAL;
+
+    *ema_begin = node;
+    while ((node != root->guard) && !ema_higher_than_addr(node, end))
+    {
+        if (node->handle != (uint32_t)handle) return EINVAL;
+        node = node->next;
+    }
+    *ema_end = node;
+    return 0;
+}
+
+/*
+ * Permission runs.
+ * Pages whose permissions or type differ from the si_flags of their EMA are
+ * tracked in a small sorted array of runs hanging off the EMA, so changing
+ * them does not split the EMA. Pages not covered by any run have the si_flags
+ * of the EMA. The EMA is split only when a change needs more than
+ * EMA_MAX_RUNS runs.
+ */
+#define EMA_MAX_RUNS 8
+
+typedef struct ema_run_
+{
+    size_t start;
+    size_t end;
+    uint16_t si_flags;
+} ema_run_t;
+
+typedef struct ema_runs_
+{
+    size_t num;
+    ema_run_t run[EMA_MAX_RUNS];
+} ema_runs_t;
+
+// Return the si_flags of the page at 'addr' and set '*seg_end' to the end of
+// the pages from 'addr' up to 'end' that have the same si_flags.
+static uint16_t ema_flags_segment(ema_t* node, size_t addr, size_t end,
+                                  size_t* seg_end)
+{
+    ema_runs_t* runs = node->runs;
+
+    *seg_end = end;
+    if (!runs) return node->si_flags;
+
+    for (size_t i = 0; i < runs->num; i++)
+    {
+        ema_run_t* r = &runs->run[i];
+        if (r->end <= addr) continue;
+        if (r->start <= addr)
+        {
+            *seg_end = MIN(r->end, end);
+            return r->si_flags;
+        }
+        *seg_end = MIN(r->start, end);
+        break;
+    }
+    return node->si_flags;
+}
+
+uint64_t get_ema_page_si_flags(ema_t* node, size_t addr)
+{
+    size_t seg_end = 0;
+    return ema_flags_segment(node, addr, addr + SGX_PAGE_SIZE, &seg_end);
+}
+
+// Whether every page in [start, end) of 'node' has 'flag' set
+static bool ema_range_has_flag(ema_t* node, size_t start, size_t end,
+                               uint64_t flag)
+{
+    size_t seg_end = end;
+    for (size_t addr = start; addr < end; addr = seg_end)
+    {
+        if (!(ema_flags_segment(node, addr, end, &seg_end) & flag))
+            return false;
+    }
+    return true;
+}
+
+// Install the 'num' runs in 'tmp' as the run map of 'node'. A single run
+// covering the whole EMA becomes the si_flags of the EMA.
+static int ema_runs_install(ema_t* node, ema_run_t* tmp, size_t num)
+{
+    if (num == 1 && tmp[0].start == node->start_addr &&
+        tmp[0].end == node->start_addr + node->size)
+    {
+        node->si_flags = tmp[0].si_flags;
+        num = 0;
+    }
+    if (num == 0)
+    {
+        if (node->runs) efree(node->runs);
+        node->runs = NULL;
+        return 0;
+    }
+    if (!node->runs)
+    {
+        node->runs = (ema_runs_t*)emalloc(sizeof(ema_runs_t),
+                                          EMALLOC_CAT_OTHER);
+        if (!node->runs) return ENOMEM;
+    }
+    memcpy(node->runs->run, tmp, num * sizeof(ema_run_t));
+    node->runs->num = num;
+    return 0;
+}
+
+// Record that the pages in [start, end) of 'node' have 'si_flags'.
+// Returns ENOSPC if that needs more than EMA_MAX_RUNS runs, or ENOMEM if no
+// memory for the run map. 'node' is unchanged on failure.
+static int ema_runs_set(ema_t* node, size_t start, size_t end,
+                        uint16_t si_flags)
+{
+    ema_run_t tmp[EMA_MAX_RUNS + 2];
+    ema_runs_t* runs = node->runs;
+    size_t num = runs ? runs->num : 0;
+    size_t n = 0, i = 0;
+
+    // parts of the existing runs below 'start'
+    for (i = 0; i < num && runs->run[i].start < start; i++)
+    {
+        tmp[n] = runs->run[i];
+        tmp[n].end = MIN(tmp[n].end, start);
+        n++;
+    }
+    if (si_flags != node->si_flags)
+    {
+        if (n && tmp[n - 1].end == start && tmp[n - 1].si_flags == si_flags)
+            tmp[n - 1].end = end;
+        else
+        {
+            tmp[n].start = start;
+            tmp[n].end = end;
+            tmp[n].si_flags = si_flags;
+            n++;
+        }
+    }
+    // parts of the existing runs above 'end'
+    for (i = 0; i < num; i++)
+    {
+        if (runs->run[i].end <= end) continue;
+        size_t run_start = MAX(runs->run[i].start, end);
+        if (n && tmp[n - 1].end == run_start &&
+            tmp[n - 1].si_flags == runs->run[i].si_flags)
+            tmp[n - 1].end = runs->run[i].end;
+        else
+        {
+            tmp[n] = runs->run[i];
+            tmp[n].start = run_start;
+            n++;
+        }
+        if (n > EMA_MAX_RUNS) return ENOSPC;
+    }
+    if (n > EMA_MAX_RUNS) return ENOSPC;
+    return ema_runs_install(node, tmp, n);
+}
+
+// Drop the parts of the runs of 'node' outside the EMA, after a split
+static void ema_runs_clip(ema_t* node)
+{
+    ema_run_t tmp[EMA_MAX_RUNS];
+    size_t end = node->start_addr + node->size;
+    size_t n = 0;
+
+    for (size_t i = 0; i < node->runs->num; i++)
+    {
+        ema_run_t r = node->runs->run[i];
+        r.start = MAX(r.start, node->start_addr);
+        r.end = MIN(r.end, end);
+        if (r.start < r.end) tmp[n++] = r;
+    }
+    // no allocation as the run map exists already
+    ema_runs_install(node, tmp, n);
+}
+
 // We just split and emalloc_free will merge unused and reuse blocks
 int ema_split(ema_t* ema, size_t addr, bool new_lower, ema_t** ret_node)
 {
@@ -336,12 +913,24 @@ int ema_split(ema_t* ema, size_t addr, bool new_lower, ema_t** ret_node)
     assert(ret_node);
 #endif
 
-    ema_t* new_node = (ema_t*)emalloc(sizeof(ema_t));
+    ema_t* new_node = (ema_t*)emalloc(sizeof(ema_t), EMALLOC_CAT_EMA);
     if (!new_node)
     {
         return ENOMEM;
     }
 
+    ema_runs_t* runs = NULL;
+    if (ema->runs)
+    {
+        runs = (ema_runs_t*)emalloc(sizeof(ema_runs_t), EMALLOC_CAT_OTHER);
+        if (!runs)
+        {
+            efree(new_node);
+            return ENOMEM;
+        }
+        memcpy(runs, ema->runs, sizeof(ema_runs_t));
+    }
+
     bit_array *low = NULL, *high = NULL;
     if (ema->eaccept_map)
     {
@@ -349,6 +938,7 @@ int ema_split(ema_t* ema, size_t addr, bool new_lower, ema_t** ret_node)
         int ret = bit_array_split(ema->eaccept_map, pos, &low, &high);
         if (ret)
         {
+            if (runs) efree(runs);
             efree(new_node);
             return ret;
         }
@@ -372,6 +962,8 @@ int ema_split(ema_t* ema, size_t addr, bool new_lower, ema_t** ret_node)
         hi_ema = new_node;
         insert_ema(new_node, ema->next);
     }
+    if (new_lower && ema->handle && handle_slots[ema->handle].ema == ema)
+        handle_slots[ema->handle].ema = new_node;
 
     size_t start = ema->start_addr;
     size_t size = ema->size;
@@ -386,6 +978,12 @@ int ema_split(ema_t* ema, size_t addr, bool new_lower, ema_t** ret_node)
         lo_ema->eaccept_map = low;
         hi_ema->eaccept_map = high;
     }
+    if (runs)
+    {
+        new_node->runs = runs;
+        ema_runs_clip(lo_ema);
+        ema_runs_clip(hi_ema);
+    }
     *ret_node = new_node;
     return 0;
 }
@@ -411,6 +1009,23 @@ int ema_split_ex(ema_t* ema, size_t start, size_t end, ema_t** new_node)
     return 0;
 }
 
+// Set the si_flags of the pages in [start, end) of '*node', splitting the EMA
+// if the run map can't hold the change. '*node' is set to the EMA holding
+// the range if it is split.
+static int ema_set_flags(ema_t** node, size_t start, size_t end,
+                         uint16_t si_flags)
+{
+    ema_t* mid = NULL;
+    int ret = ema_runs_set(*node, start, end, si_flags);
+    if (ret != ENOSPC && ret != ENOMEM) return ret;
+
+    ret = ema_split_ex(*node, start, end, &mid);
+    if (ret) return ret;
+    *node = mid;
+    // covers the whole EMA now, no allocation
+    return ema_runs_set(mid, start, end, si_flags);
+}
+
 static size_t ema_aligned_end(ema_t* ema, size_t align)
 {
     size_t curr_end = ema->start_addr + ema->size;
@@ -418,12 +1033,108 @@ static size_t ema_aligned_end(ema_t* ema, size_t align)
     return curr_end;
 }
 
+/*
+ * Placement policies other than the default first fit, for the user root.
+ * Free holes between EMAs and at the ends of the user range are visited from
+ * low to high addresses and the policy picks one.
+ */
+// Segregated placement puts regions of at least this size top-down
+#define PLACE_LARGE_SIZE 0x200000ULL
+
+// Place 'size' bytes aligned to 'align' in the hole [lo, hi), at its
+// lowest or, for 'top_down', highest possible address
+static bool hole_fit(size_t lo, size_t hi, size_t size, uint64_t align,
+                     bool top_down, size_t* addr)
+{
+    size_t tmp = 0;
+    if (hi - lo < size) return false;
+    if (top_down)
+    {
+        tmp = TRIM_TO(hi - size, align);
+        if (tmp < lo) return false;
+    }
+    else
+    {
+        tmp = ROUND_TO(lo, align);
+        if (tmp < lo || tmp > hi - size) return false;
+    }
+    if (!sgx_mm_is_within_enclave((void*)tmp, size)) return false;
+    *addr = tmp;
+    return true;
+}
+
+static bool find_free_region_placed(ema_root_t* root, size_t size,
+                                    uint64_t align, int placement,
+                                    size_t* addr, ema_t** next_ema)
+{
+    bool top_down = false, found = false;
+    size_t best = SIZE_MAX, lo = mm_user_base, tmp = 0;
+    size_t rover = (placement == SGX_EMA_PLACE_NEXT_FIT) ? root->rover : 0;
+    ema_t* node = root->guard->next;
+
+    if (placement == SGX_EMA_PLACE_SEGREGATED)
+        placement = (size >= PLACE_LARGE_SIZE) ? SGX_EMA_PLACE_TOP_DOWN
+                                               : SGX_EMA_PLACE_FIRST_FIT;
+    top_down = (placement == SGX_EMA_PLACE_TOP_DOWN);
+
+    // the guard ends the list, the hole before it ends at the user end
+    for (int pass = 0; pass < 2 && !found; pass++)
+    {
+        lo = mm_user_base;
+        for (node = root->guard->next;; node = node->next)
+        {
+            size_t hi = (node == root->guard) ? mm_user_end : node->start_addr;
+            size_t from = MAX(lo, rover);
+            if (from < hi && hole_fit(from, hi, size, align, top_down, &tmp))
+            {
+                if (placement != SGX_EMA_PLACE_BEST_FIT || hi - lo < best)
+                {
+                    best = hi - lo;
+                    *addr = tmp;
+                    *next_ema = node;
+                    found = true;
+                    // the first fit is taken, except for best fit and
+                    // top-down which look for the smallest and the highest
+                    if (placement != SGX_EMA_PLACE_BEST_FIT && !top_down)
+                        break;
+                }
+            }
+            if (node == root->guard) break;
+            lo = MAX(lo, node->start_addr + node->size);
+        }
+        // next fit wraps around to the start of the range once
+        if (!rover) break;
+        rover = 0;
+    }
+    if (found && placement == SGX_EMA_PLACE_NEXT_FIT)
+        root->rover = *addr + size;
+    return found;
+}
+
+int ema_root_set_placement(ema_root_t* root, int placement)
+{
+    if (placement < 0 || placement > SGX_EMA_PLACE_SEGREGATED) return EINVAL;
+    root->placement = placement;
+    root->rover = 0;
+    return 0;
+}
+
 // Find a free space of size at least 'size' bytes on the given root, does not
-// matter where the start is
+// matter where the start is. 'placement' is one of SGX_EMA_PLACE_*, 0 for
+// the default of the root.
 bool find_free_region(ema_root_t* root, size_t size, uint64_t align,
-                      size_t* addr, ema_t** next_ema)
+                      int placement, size_t* addr, ema_t** next_ema)
 {
     bool is_rts = (root == &g_rts_ema_root);
+    if (!placement) placement = root->placement;
+    // the system range is split around the user range, only first fit
+    if (!is_rts && placement && placement != SGX_EMA_PLACE_FIRST_FIT)
+    {
+        *next_ema = NULL;
+        *addr = 0;
+        return find_free_region_placed(root, size, align, placement, addr,
+                                       next_ema);
+    }
     ema_t* ema_begin = root->guard->next;
     ema_t* ema_end = root->guard;
 
@@ -583,18 +1294,19 @@ ema_t* ema_new(size_t addr, size_t size, uint32_t alloc_flags,
     ema_t tmp = {
         .start_addr = addr,
         .size = size,
-        .alloc_flags = alloc_flags,
-        .si_flags = si_flags,
+        .alloc_flags = (uint8_t)alloc_flags,
+        .si_flags = (uint16_t)si_flags,
         .eaccept_map = NULL,
         .handler = handler,
         .priv = private_data,
+        .runs = NULL,
         .next = NULL,
         .prev = NULL,
     };
 
     // ensure region [start, start+size) is in the list so emalloc won't use it.
     insert_ema(&tmp, next_ema);
-    ema_t* node = (ema_t*)emalloc(sizeof(ema_t));
+    ema_t* node = (ema_t*)emalloc(sizeof(ema_t), EMALLOC_CAT_EMA);
     if (node)
     {
         *node = tmp;
@@ -610,11 +1322,15 @@ ema_t* ema_new(size_t addr, size_t size, uint32_t alloc_flags,
 
 void ema_destroy(ema_t* ema)
 {
+    if (ema->handle) handle_ema_destroyed(ema);
     remove_ema(ema);
     if (ema->eaccept_map)
     {
+        ema_account_uncommit(
+            ema, ema_count_committed(ema, 0, ema->size >> SGX_PAGE_SHIFT));
         bit_array_delete(ema->eaccept_map);
     }
+    if (ema->runs) efree(ema->runs);
     efree(ema);
 }
 
@@ -657,16 +1373,90 @@ int do_commit(size_t start, size_t size, uint64_t si_flags, bool grow_up)
     return ret;
 }
 
-int ema_do_commit(ema_t* node, size_t start, size_t end)
+/*
+ * Operation plans.
+ * The validation walk of a *_loop operation records, for each EMA in the
+ * range, the part of the range the EMA covers and, where the operation needs
+ * it, whether those pages are committed. Execution then consumes the plan
+ * instead of clipping the range and testing the bitmap page by page again.
+ * Plans live on the stack and hold a bounded number of steps; EMAs beyond
+ * that are executed without precomputed state.
+ */
+#define EMA_PLAN_STEPS 16
+
+typedef enum
 {
-    // Only RESERVE region has no bit map allocated.
-    assert(node->eaccept_map);
-    size_t real_start = MAX(start, node->start_addr);
-    size_t real_end = MIN(end, node->start_addr + node->size);
+    PLAN_UNKNOWN = 0,
+    PLAN_NONE_COMMITTED,
+    PLAN_ALL_COMMITTED,
+    PLAN_MIXED,
+} plan_state_t;
 
-    sec_info_t si SGX_SECINFO_ALIGN = {
-        SGX_EMA_PAGE_TYPE_REG | SGX_EMA_PROT_READ_WRITE | SGX_EMA_STATE_PENDING,
-        0};
+typedef struct ema_plan_step_
+{
+    ema_t* node;
+    size_t start;  // part of the requested range covered by 'node'
+    size_t end;
+    plan_state_t state;
+} ema_plan_step_t;
+
+typedef struct ema_plan_
+{
+    size_t num;
+    ema_plan_step_t steps[EMA_PLAN_STEPS];
+} ema_plan_t;
+
+static plan_state_t ema_range_state(ema_t* node, size_t start, size_t end)
+{
+    if (!node->eaccept_map) return PLAN_NONE_COMMITTED;
+
+    size_t pos = (start - node->start_addr) >> SGX_PAGE_SHIFT;
+    size_t len = (end - start) >> SGX_PAGE_SHIFT;
+    if (!bit_array_test_range_any(node->eaccept_map, pos, len))
+        return PLAN_NONE_COMMITTED;
+    if (bit_array_test_range(node->eaccept_map, pos, len))
+        return PLAN_ALL_COMMITTED;
+    return PLAN_MIXED;
+}
+
+static void plan_add(ema_plan_t* plan, ema_t* node, size_t start, size_t end,
+                     plan_state_t state)
+{
+    if (plan->num == EMA_PLAN_STEPS) return;
+
+    ema_plan_step_t* step = &plan->steps[plan->num++];
+    step->node = node;
+    step->start = start;
+    step->end = end;
+    step->state = state;
+}
+
+// Get step 'i' of 'plan' for 'node', or build one for the EMAs not recorded
+static void plan_step(const ema_plan_t* plan, size_t i, ema_t* node,
+                      size_t start, size_t end, ema_plan_step_t* step)
+{
+    if (i < plan->num)
+    {
+        assert(plan->steps[i].node == node);
+        *step = plan->steps[i];
+        return;
+    }
+    step->node = node;
+    step->start = MAX(start, node->start_addr);
+    step->end = MIN(end, node->start_addr + node->size);
+    step->state = PLAN_UNKNOWN;
+}
+
+static int ema_do_commit_pages(ema_t* node, size_t start, size_t end)
+{
+    // Only RESERVE region has no bit map allocated.
+    assert(node->eaccept_map);
+    size_t real_start = MAX(start, node->start_addr);
+    size_t real_end = MIN(end, node->start_addr + node->size);
+
+    sec_info_t si SGX_SECINFO_ALIGN = {
+        SGX_EMA_PAGE_TYPE_REG | SGX_EMA_PROT_READ_WRITE | SGX_EMA_STATE_PENDING,
+        0};
 
     for (size_t addr = real_start; addr < real_end; addr += SGX_PAGE_SIZE)
     {
@@ -680,13 +1470,48 @@ int ema_do_commit(ema_t* node, size_t start, size_t end)
                 return ret;
             }
             bit_array_set(node->eaccept_map, pos);
+            ema_account_commit(node, 1);
         }
     }
 
     return 0;
 }
 
-static int ema_can_commit(ema_t* first, ema_t* last, size_t start, size_t end)
+int ema_do_commit(ema_t* node, size_t start, size_t end)
+{
+    int ret = ema_quota_check_range(node, node->next, start, end, true);
+    if (ret) return ret;
+    return ema_do_commit_pages(node, start, end);
+}
+
+// Commit the pages of a step, using its precomputed state when known
+static int ema_do_commit_step(const ema_plan_step_t* step)
+{
+    if (step->state == PLAN_ALL_COMMITTED) return 0;
+    if (step->state != PLAN_NONE_COMMITTED)
+        return ema_do_commit_pages(step->node, step->start, step->end);
+
+    sec_info_t si SGX_SECINFO_ALIGN = {
+        SGX_EMA_PAGE_TYPE_REG | SGX_EMA_PROT_READ_WRITE | SGX_EMA_STATE_PENDING,
+        0};
+    size_t addr = step->start;
+    int ret = 0;
+
+    for (; addr < step->end; addr += SGX_PAGE_SIZE)
+    {
+        ret = do_eaccept(&si, addr);
+        if (ret != 0) break;
+    }
+    if (addr > step->start)
+    {
+        int r = ema_set_eaccept(step->node, step->start, addr);
+        if (r) return r;
+    }
+    return ret;
+}
+
+static int ema_can_commit(ema_t* first, ema_t* last, size_t start, size_t end,
+                          ema_plan_t* plan)
 {
     ema_t* curr = first;
     size_t prev_end = first->start_addr;
@@ -695,12 +1520,23 @@ static int ema_can_commit(ema_t* first, ema_t* last, size_t start, size_t end)
         if (prev_end != curr->start_addr)  // there is a gap
             return EINVAL;
 
-        if (!(curr->si_flags & (SGX_EMA_PROT_WRITE))) return EACCES;
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+
+        if (!ema_range_has_flag(curr, real_start, real_end,
+                                SGX_EMA_PROT_WRITE))
+            return EACCES;
 
-        if (!(curr->si_flags & (SGX_EMA_PAGE_TYPE_REG))) return EACCES;
+        if (!ema_range_has_flag(curr, real_start, real_end,
+                                SGX_EMA_PAGE_TYPE_REG))
+            return EACCES;
 
         if ((curr->alloc_flags & (SGX_EMA_RESERVE))) return EACCES;
 
+        if (plan->num < EMA_PLAN_STEPS)
+            plan_add(plan, curr, real_start, real_end,
+                     ema_range_state(curr, real_start, real_end));
+
         prev_end = curr->start_addr + curr->size;
         curr = curr->next;
     }
@@ -710,15 +1546,29 @@ static int ema_can_commit(ema_t* first, ema_t* last, size_t start, size_t end)
 
 int ema_do_commit_loop(ema_t* first, ema_t* last, size_t start, size_t end)
 {
-    int ret = ema_can_commit(first, last, start, end);
+    ema_plan_t plan;
+    plan.num = 0;
+    int ret = ema_quota_check_range(first, last, start, end, false);
+    if (ret) return ret;
+    ret = ema_can_commit(first, last, start, end, &plan);
+    if (ret) return ret;
+    // pages held compressed or paged out keep their contents, restoring
+    // them commits pages, so plan again afterwards. Provided pages are
+    // fetched by the caller beforehand, see ema_provider_prepare.
+    ret = ema_backing_release_range(start, end, true);
+    if (ret) return ret;
+    plan.num = 0;
+    ret = ema_can_commit(first, last, start, end, &plan);
     if (ret) return ret;
 
     ema_t *curr = first, *next = NULL;
+    ema_plan_step_t step;
 
-    while (curr != last)
+    for (size_t i = 0; curr != last; i++)
     {
         next = curr->next;
-        ret = ema_do_commit(curr, start, end);
+        plan_step(&plan, i, curr, start, end, &step);
+        ret = ema_do_commit_step(&step);
         if (ret != 0)
         {
             return ret;
@@ -728,10 +1578,57 @@ int ema_do_commit_loop(ema_t* first, ema_t* last, size_t start, size_t end)
     return ret;
 }
 
+// Trim [block_start, block_end) of 'node', all pages must be committed,
+// have the page type 'type' and the permissions 'prot'. PROT_NONE pages are
+// converted with sgx_mm_trim_ocall, which makes them accessible again, so
+// they are trimmed without restoring their permissions first. Pages being
+// deallocated are reported as PROT_NONE to the untrusted side.
+static int ema_uncommit_block(ema_t* node, size_t block_start,
+                              size_t block_end, int prot, int type,
+                              bool dealloc)
+{
+    size_t block_length = block_end - block_start;
+    sec_info_t si SGX_SECINFO_ALIGN = {
+        SGX_EMA_PAGE_TYPE_TRIM | SGX_EMA_STATE_MODIFIED, 0};
+    int ret = 0;
+
+    // TCS pages, recorded as PROT_NONE, keep the TCS to TRIM change
+    if (prot == SGX_EMA_PROT_NONE && type == SGX_EMA_PAGE_TYPE_REG)
+        ret = sgx_mm_trim_ocall(block_start, block_length, type);
+    else
+    {
+        if (dealloc) prot = SGX_EMA_PROT_NONE;
+        ret = sgx_mm_modify_ocall(block_start, block_length, prot | type,
+                                  prot | SGX_EMA_PAGE_TYPE_TRIM);
+    }
+    if (ret != 0)
+    {
+        return EFAULT;
+    }
+
+    ret = eaccept_range_forward(&si, block_start, block_end);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    bit_array_reset_range(node->eaccept_map,
+                          (block_start - node->start_addr) >> SGX_PAGE_SHIFT,
+                          block_length >> SGX_PAGE_SHIFT);
+    ema_account_uncommit(node, block_length >> SGX_PAGE_SHIFT);
+    // eaccept trim notify
+    ret = sgx_mm_modify_ocall(block_start, block_length,
+                              prot | SGX_EMA_PAGE_TYPE_TRIM,
+                              prot | SGX_EMA_PAGE_TYPE_TRIM);
+    if (ret) return EFAULT;
+    return 0;
+}
+
+// Trim the committed pages in [real_start, real_end) of 'node'. The current
+// permissions of the pages are reported to the untrusted side, or PROT_NONE
+// if the pages are being deallocated.
 static int ema_do_uncommit_real(ema_t* node, size_t real_start, size_t real_end,
-                                int prot)
+                                bool dealloc)
 {
-    int type = node->si_flags & SGX_EMA_PAGE_TYPE_MASK;
     uint32_t alloc_flags = node->alloc_flags & SGX_EMA_ALLOC_FLAGS_MASK;
 
     // ignore if ema is in reserved state
@@ -743,63 +1640,22 @@ static int ema_do_uncommit_real(ema_t* node, size_t real_start, size_t real_end,
     // Only RESERVE region has no bit map allocated.
     assert(node->eaccept_map);
 
-    sec_info_t si SGX_SECINFO_ALIGN = {
-        SGX_EMA_PAGE_TYPE_TRIM | SGX_EMA_STATE_MODIFIED, 0};
-
-    while (real_start < real_end)
+    size_t seg_end = real_end;
+    for (size_t addr = real_start; addr < real_end; addr = seg_end)
     {
-        size_t block_start = real_start;
-        while (block_start < real_end)
-        {
-            size_t pos = (block_start - node->start_addr) >> SGX_PAGE_SHIFT;
-            if (bit_array_test(node->eaccept_map, pos))
-            {
-                break;
-            }
-            else
-            {
-                block_start += SGX_PAGE_SIZE;
-            }
-        }
-        if (block_start == real_end) break;
+        uint16_t flags = ema_flags_segment(node, addr, real_end, &seg_end);
+        int prot = flags & SGX_EMA_PROT_MASK;
+        int type = flags & SGX_EMA_PAGE_TYPE_MASK;
 
-        size_t block_end = block_start + SGX_PAGE_SIZE;
-        while (block_end < real_end)
-        {
-            size_t pos = (block_end - node->start_addr) >> SGX_PAGE_SHIFT;
-            if (bit_array_test(node->eaccept_map, pos))
-            {
-                block_end += SGX_PAGE_SIZE;
-            }
-            else
-                break;
-        }
-        assert(block_end > block_start);
         // only for committed page
-        size_t block_length = block_end - block_start;
-        int ret = sgx_mm_modify_ocall(block_start, block_length, prot | type,
-                                      prot | SGX_EMA_PAGE_TYPE_TRIM);
-        if (ret != 0)
-        {
-            return EFAULT;
-        }
-
-        ret = eaccept_range_forward(&si, block_start, block_end);
-        if (ret != 0)
+        size_t block_start = 0, block_end = addr;
+        while (ema_next_committed(node, block_end, seg_end, &block_start,
+                                  &block_end))
         {
-            return ret;
+            int ret = ema_uncommit_block(node, block_start, block_end, prot,
+                                         type, dealloc);
+            if (ret) return ret;
         }
-        bit_array_reset_range(
-            node->eaccept_map,
-            (block_start - node->start_addr) >> SGX_PAGE_SHIFT,
-            block_length >> SGX_PAGE_SHIFT);
-        // eaccept trim notify
-        ret = sgx_mm_modify_ocall(block_start, block_length,
-                                  prot | SGX_EMA_PAGE_TYPE_TRIM,
-                                  prot | SGX_EMA_PAGE_TYPE_TRIM);
-        if (ret) return EFAULT;
-
-        real_start = block_end;
     }
     return 0;
 }
@@ -808,12 +1664,25 @@ int ema_do_uncommit(ema_t* node, size_t start, size_t end)
 {
     size_t real_start = MAX(start, node->start_addr);
     size_t real_end = MIN(end, node->start_addr + node->size);
-    int prot = node->si_flags & SGX_EMA_PROT_MASK;
-    if (prot == SGX_EMA_PROT_NONE)  // need READ for trimming
-        ema_modify_permissions(node, start, end, SGX_EMA_PROT_READ);
-    return ema_do_uncommit_real(node, real_start, real_end, prot);
+    return ema_do_uncommit_real(node, real_start, real_end, false);
+}
+
+// Uncommit the pages of a step, using its precomputed state when known
+static int ema_do_uncommit_step(const ema_plan_step_t* step)
+{
+    ema_t* node = step->node;
+
+    if (step->state == PLAN_NONE_COMMITTED) return 0;
+    if (step->state == PLAN_ALL_COMMITTED && !node->runs)
+        return ema_uncommit_block(node, step->start, step->end,
+                                  node->si_flags & SGX_EMA_PROT_MASK,
+                                  node->si_flags & SGX_EMA_PAGE_TYPE_MASK,
+                                  false);
+    return ema_do_uncommit(node, step->start, step->end);
 }
-static int ema_can_uncommit(ema_t* first, ema_t* last, size_t start, size_t end)
+
+static int ema_can_uncommit(ema_t* first, ema_t* last, size_t start, size_t end,
+                            ema_plan_t* plan)
 {
     ema_t* curr = first;
     size_t prev_end = first->start_addr;
@@ -824,6 +1693,12 @@ static int ema_can_uncommit(ema_t* first, ema_t* last, size_t start, size_t end)
 
         if ((curr->alloc_flags & (SGX_EMA_RESERVE))) return EACCES;
 
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        if (plan->num < EMA_PLAN_STEPS)
+            plan_add(plan, curr, real_start, real_end,
+                     ema_range_state(curr, real_start, real_end));
+
         prev_end = curr->start_addr + curr->size;
         curr = curr->next;
     }
@@ -833,14 +1708,22 @@ static int ema_can_uncommit(ema_t* first, ema_t* last, size_t start, size_t end)
 
 int ema_do_uncommit_loop(ema_t* first, ema_t* last, size_t start, size_t end)
 {
-    int ret = ema_can_uncommit(first, last, start, end);
+    ema_plan_t plan;
+    plan.num = 0;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    ret = ema_can_uncommit(first, last, start, end, &plan);
+    if (ret) return ret;
+    ret = ema_backing_release_range(start, end, false);
     if (ret) return ret;
 
     ema_t *curr = first, *next = NULL;
-    while (curr != last)
+    ema_plan_step_t step;
+    for (size_t i = 0; curr != last; i++)
     {
         next = curr->next;
-        ret = ema_do_uncommit(curr, start, end);
+        plan_step(&plan, i, curr, start, end, &step);
+        ret = ema_do_uncommit_step(&step);
         if (ret != 0)
         {
             return ret;
@@ -855,7 +1738,6 @@ int ema_do_dealloc(ema_t* node, size_t start, size_t end)
     int alloc_flag = node->alloc_flags & SGX_EMA_ALLOC_FLAGS_MASK;
     size_t real_start = MAX(start, node->start_addr);
     size_t real_end = MIN(end, node->start_addr + node->size);
-    int prot = node->si_flags & SGX_EMA_PROT_MASK;
     ema_t* tmp_node = NULL;
     int ret = EFAULT;
 
@@ -866,10 +1748,8 @@ int ema_do_dealloc(ema_t* node, size_t start, size_t end)
 
     // Only RESERVE region has no bit map allocated.
     assert(node->eaccept_map);
-    if (prot == SGX_EMA_PROT_NONE)  // need READ for trimming
-        ema_modify_permissions(node, start, end, SGX_EMA_PROT_READ);
     // clear protections flag for dealloc
-    ret = ema_do_uncommit_real(node, real_start, real_end, SGX_EMA_PROT_NONE);
+    ret = ema_do_uncommit_real(node, real_start, real_end, true);
     if (ret != 0) return ret;
 
 split_and_destroy:
@@ -897,7 +1777,10 @@ split_and_destroy:
 
 int ema_do_dealloc_loop(ema_t* first, ema_t* last, size_t start, size_t end)
 {
-    int ret = 0;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    ret = ema_backing_release_range(start, end, false);
+    if (ret) return ret;
     ema_t *curr = first, *next = NULL;
 
     while (curr != last)
@@ -913,28 +1796,13 @@ int ema_do_dealloc_loop(ema_t* first, ema_t* last, size_t start, size_t end)
     return ret;
 }
 
-// change the type of the page to TCS
-int ema_change_to_tcs(ema_t* node, size_t addr)
+// Change the type of the committed pages [start, end) from RW regular pages
+// to TCS, one ocall for all of them
+static int change_to_tcs_run(size_t start, size_t end)
 {
-    int prot = node->si_flags & SGX_EMA_PROT_MASK;
-    int type = node->si_flags & SGX_EMA_PAGE_TYPE_MASK;
-
-    // page need to be already committed
-    if (!ema_page_committed(node, addr))
-    {
-        return EACCES;
-    }
-
-    if (type == SGX_EMA_PAGE_TYPE_TCS)
-    {
-        return 0;  // already committed to TCS type
-    }
-
-    if (prot != SGX_EMA_PROT_READ_WRITE) return EACCES;
-    if (type != SGX_EMA_PAGE_TYPE_REG) return EACCES;
-
-    int ret = sgx_mm_modify_ocall(addr, SGX_PAGE_SIZE, prot | type,
-                                  prot | SGX_EMA_PAGE_TYPE_TCS);
+    int ret = sgx_mm_modify_ocall(
+        start, end - start, SGX_EMA_PROT_READ_WRITE | SGX_EMA_PAGE_TYPE_REG,
+        SGX_EMA_PROT_READ_WRITE | SGX_EMA_PAGE_TYPE_TCS);
     if (ret != 0)
     {
         return EFAULT;
@@ -942,34 +1810,106 @@ int ema_change_to_tcs(ema_t* node, size_t addr)
 
     sec_info_t si SGX_SECINFO_ALIGN = {
         SGX_EMA_PAGE_TYPE_TCS | SGX_EMA_STATE_MODIFIED, 0};
-    if (do_eaccept(&si, addr) != 0)
+    for (size_t page = start; page < end; page += SGX_PAGE_SIZE)
     {
-        abort();
+        if (do_eaccept(&si, page) != 0)
+        {
+            abort();
+        }
     }
+    return 0;
+}
 
-    // operation succeeded, update ema node: state update, split
-    ema_t* tcs = NULL;
-    ret = ema_split_ex(node, addr, addr + SGX_PAGE_SIZE, &tcs);
-    if (ret) return ret;
-    assert(tcs);  // ema_split_ex should not return NULL if node!=NULL
+static int ema_can_change_to_tcs(ema_t* first, ema_t* last, size_t start,
+                                 size_t end)
+{
+    ema_t* curr = first;
+    size_t prev_end = first->start_addr;
+    while (curr != last)
+    {
+        if (prev_end != curr->start_addr)  // there is a gap
+            return EINVAL;
 
-    tcs->si_flags = (tcs->si_flags & (uint64_t)(~SGX_EMA_PAGE_TYPE_MASK) &
-                     (uint64_t)(~SGX_EMA_PROT_MASK)) |
-                    SGX_EMA_PAGE_TYPE_TCS | SGX_EMA_PROT_NONE;
-    return ret;
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+
+        // pages need to be already committed
+        size_t pos_begin = (real_start - curr->start_addr) >> SGX_PAGE_SHIFT;
+        size_t pos_end = (real_end - curr->start_addr) >> SGX_PAGE_SHIFT;
+        if (!curr->eaccept_map ||
+            !bit_array_test_range(curr->eaccept_map, pos_begin,
+                                  pos_end - pos_begin))
+        {
+            return EACCES;
+        }
+
+        size_t seg_end = real_end;
+        for (size_t addr = real_start; addr < real_end; addr = seg_end)
+        {
+            uint16_t flags = ema_flags_segment(curr, addr, real_end, &seg_end);
+            int prot = flags & SGX_EMA_PROT_MASK;
+            int type = flags & SGX_EMA_PAGE_TYPE_MASK;
+
+            if (type == SGX_EMA_PAGE_TYPE_TCS) continue;
+            if (prot != SGX_EMA_PROT_READ_WRITE) return EACCES;
+            if (type != SGX_EMA_PAGE_TYPE_REG) return EACCES;
+        }
+
+        prev_end = curr->start_addr + curr->size;
+        curr = curr->next;
+    }
+    if (prev_end < end) return EINVAL;
+    return 0;
 }
 
-int ema_modify_permissions(ema_t* node, size_t start, size_t end, int new_prot)
+// change the type of the pages in [start, end) to TCS, pages that are TCS
+// already are left alone
+int ema_change_to_tcs_loop(ema_t* first, ema_t* last, size_t start,
+                           size_t end)
 {
-    int prot = node->si_flags & SGX_EMA_PROT_MASK;
-    int type = node->si_flags & SGX_EMA_PAGE_TYPE_MASK;
-    if (prot == new_prot) return 0;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    ret = ema_backing_release_range(start, end, true);
+    if (ret) return ret;
+    ret = ema_can_change_to_tcs(first, last, start, end);
+    if (ret) return ret;
 
-    size_t real_start = MAX(start, node->start_addr);
-    size_t real_end = MIN(end, node->start_addr + node->size);
+    ema_t *curr = first, *next = NULL;
+    while (curr != last)
+    {
+        next = curr->next;
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        size_t seg_end = real_end;
+
+        // convert each stretch of pages that are not TCS yet, recording it
+        // as soon as it is converted so a later failure leaves the EMA
+        // matching the pages
+        for (size_t addr = real_start; addr < real_end; addr = seg_end)
+        {
+            uint16_t flags = ema_flags_segment(curr, addr, real_end, &seg_end);
+            if ((flags & SGX_EMA_PAGE_TYPE_MASK) == SGX_EMA_PAGE_TYPE_TCS)
+                continue;
+            ret = change_to_tcs_run(addr, seg_end);
+            if (ret) return ret;
+            ret = ema_set_flags(&curr, addr, seg_end,
+                                SGX_EMA_PAGE_TYPE_TCS | SGX_EMA_PROT_NONE);
+            if (ret) return ret;
+            // a split leaves the rest of the range in the following EMA
+            if (seg_end == curr->start_addr + curr->size) curr = curr->next;
+        }
+        curr = next;
+    }
+    return 0;
+}
 
-    int ret = sgx_mm_modify_ocall(real_start, real_end - real_start,
-                                  prot | type, new_prot | type);
+// Change the permissions of the committed pages [start, end) from 'prot' to
+// 'new_prot'
+static int modify_permissions_run(size_t start, size_t end, int prot, int type,
+                                  int new_prot)
+{
+    int ret = sgx_mm_modify_ocall(start, end - start, prot | type,
+                                  new_prot | type);
     if (ret != 0)
     {
         return EFAULT;
@@ -978,7 +1918,7 @@ int ema_modify_permissions(ema_t* node, size_t start, size_t end, int new_prot)
     sec_info_t si SGX_SECINFO_ALIGN = {
         (uint64_t)new_prot | SGX_EMA_PAGE_TYPE_REG | SGX_EMA_STATE_PR, 0};
 
-    for (size_t page = real_start; page < real_end; page += SGX_PAGE_SIZE)
+    for (size_t page = start; page < end; page += SGX_PAGE_SIZE)
     {
         if ((new_prot | prot) != prot) do_emodpe(&si, page);
 
@@ -992,41 +1932,67 @@ int ema_modify_permissions(ema_t* node, size_t start, size_t end, int new_prot)
         }
     }
 
-    // all involved pages complete permission change, deal with potential
-    // ema node split and  update permission state
-    if (real_start > node->start_addr)
-    {
-        ema_t* tmp_node = NULL;
-        ret = ema_split(node, real_start, false, &tmp_node);
-        if (ret) return ret;
-        assert(tmp_node);
-        node = tmp_node;
+    if (new_prot == SGX_EMA_PROT_NONE)
+    {  // do mprotect if target is PROT_NONE
+        ret = sgx_mm_modify_ocall(start, end - start, type | SGX_EMA_PROT_NONE,
+                                  type | SGX_EMA_PROT_NONE);
+        if (ret) return EFAULT;
     }
+    return 0;
+}
 
-    if (real_end < (node->start_addr + node->size))
+int ema_modify_permissions(ema_t* node, size_t start, size_t end, int new_prot)
+{
+    size_t real_start = MAX(start, node->start_addr);
+    size_t real_end = MIN(end, node->start_addr + node->size);
+    size_t seg_end = real_end;
+    // range with the same new si_flags not yet recorded in the EMA
+    size_t pend_start = real_start;
+    uint16_t pend_flags = 0;
+    int ret = 0;
+
+    // pages in the range may differ in permissions and type, change each
+    // stretch of pages with the same si_flags at a time
+    for (size_t addr = real_start; addr < real_end; addr = seg_end)
     {
-        ema_t* tmp_node = NULL;
-        ret = ema_split(node, real_end, true, &tmp_node);
-        if (ret) return ret;
-        assert(tmp_node);
-        node = tmp_node;
-    }
+        uint16_t flags = ema_flags_segment(node, addr, real_end, &seg_end);
+        int prot = flags & SGX_EMA_PROT_MASK;
+        int type = flags & SGX_EMA_PAGE_TYPE_MASK;
+        uint16_t new_flags =
+            (uint16_t)((flags & ~SGX_EMA_PROT_MASK) | new_prot);
 
-    // 'node' is the ema node to update permission for
-    node->si_flags =
-        (node->si_flags & (uint64_t)(~SGX_EMA_PROT_MASK)) | (uint64_t)new_prot;
-    if (new_prot == SGX_EMA_PROT_NONE)
-    {  // do mprotect if target is PROT_NONE
-        ret = sgx_mm_modify_ocall(real_start, real_end - real_start,
-                                  type | SGX_EMA_PROT_NONE,
-                                  type | SGX_EMA_PROT_NONE);
-        if (ret) ret = EFAULT;
+        if (addr > pend_start && new_flags != pend_flags)
+        {
+            ret = ema_set_flags(&node, pend_start, addr, pend_flags);
+            if (ret) return ret;
+            // the pending range was split off into its own EMA
+            if (ema_lower_than_addr(node, addr)) node = node->next;
+            pend_start = addr;
+        }
+        pend_flags = new_flags;
+        if (prot == new_prot) continue;
+
+        // only committed pages need the hardware and the untrusted side to
+        // be involved, uncommitted ones just get the new flags recorded
+        size_t run_start = 0, run_end = addr;
+        while (ema_next_committed(node, run_end, seg_end, &run_start,
+                                  &run_end))
+        {
+            ret = modify_permissions_run(run_start, run_end, prot, type,
+                                         new_prot);
+            if (ret) return ret;
+        }
     }
+
+    // all involved pages complete permission change, update permission
+    // state, in the run map of the EMA if it can hold it
+    if (real_end > pend_start)
+        ret = ema_set_flags(&node, pend_start, real_end, pend_flags);
     return ret;
 }
 
 static int ema_can_modify_permissions(ema_t* first, ema_t* last, size_t start,
-                                      size_t end)
+                                      size_t end, ema_plan_t* plan)
 {
     ema_t* curr = first;
     size_t prev_end = first->start_addr;
@@ -1035,13 +2001,15 @@ static int ema_can_modify_permissions(ema_t* first, ema_t* last, size_t start,
         if (prev_end != curr->start_addr)  // there is a gap
             return EINVAL;
 
-        if (!(curr->si_flags & (SGX_EMA_PAGE_TYPE_REG))) return EACCES;
-
-        if ((curr->alloc_flags & (SGX_EMA_RESERVE))) return EACCES;
-
         size_t real_start = MAX(start, curr->start_addr);
         size_t real_end = MIN(end, curr->start_addr + curr->size);
 
+        if (!ema_range_has_flag(curr, real_start, real_end,
+                                SGX_EMA_PAGE_TYPE_REG))
+            return EACCES;
+
+        if ((curr->alloc_flags & (SGX_EMA_RESERVE))) return EACCES;
+
         size_t pos_begin = (real_start - curr->start_addr) >> SGX_PAGE_SHIFT;
         size_t pos_end = (real_end - curr->start_addr) >> SGX_PAGE_SHIFT;
         if (!curr->eaccept_map ||
@@ -1050,6 +2018,7 @@ static int ema_can_modify_permissions(ema_t* first, ema_t* last, size_t start,
         {
             return EINVAL;
         }
+        plan_add(plan, curr, real_start, real_end, PLAN_ALL_COMMITTED);
 
         prev_end = curr->start_addr + curr->size;
         curr = curr->next;
@@ -1060,14 +2029,16 @@ static int ema_can_modify_permissions(ema_t* first, ema_t* last, size_t start,
 
 static int ema_modify_permissions_loop_nocheck(ema_t* first, ema_t* last,
                                                size_t start, size_t end,
-                                               int prot)
+                                               int prot, const ema_plan_t* plan)
 {
     int ret = 0;
     ema_t *curr = first, *next = NULL;
-    while (curr != last)
+    ema_plan_step_t step;
+    for (size_t i = 0; curr != last; i++)
     {
         next = curr->next;
-        ret = ema_modify_permissions(curr, start, end, prot);
+        plan_step(plan, i, curr, start, end, &step);
+        ret = ema_modify_permissions(curr, step.start, step.end, prot);
         if (ret != 0)
         {
             return ret;
@@ -1080,14 +2051,19 @@ static int ema_modify_permissions_loop_nocheck(ema_t* first, ema_t* last,
 int ema_modify_permissions_loop(ema_t* first, ema_t* last, size_t start,
                                 size_t end, int prot)
 {
-    int ret = ema_can_modify_permissions(first, last, start, end);
+    ema_plan_t plan;
+    plan.num = 0;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    ret = ema_can_modify_permissions(first, last, start, end, &plan);
     if (ret) return ret;
 
-    return ema_modify_permissions_loop_nocheck(first, last, start, end, prot);
+    return ema_modify_permissions_loop_nocheck(first, last, start, end, prot,
+                                               &plan);
 }
 
 static int ema_can_commit_data(ema_t* first, ema_t* last, size_t start,
-                               size_t end)
+                               size_t end, ema_plan_t* plan)
 {
     ema_t* curr = first;
     size_t prev_end = first->start_addr;
@@ -1096,9 +2072,16 @@ static int ema_can_commit_data(ema_t* first, ema_t* last, size_t start,
         if (prev_end != curr->start_addr)  // there is a gap
             return EINVAL;
 
-        if (!(curr->si_flags & (SGX_EMA_PROT_WRITE))) return EACCES;
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
 
-        if (!(curr->si_flags & (SGX_EMA_PAGE_TYPE_REG))) return EACCES;
+        if (!ema_range_has_flag(curr, real_start, real_end,
+                                SGX_EMA_PROT_WRITE))
+            return EACCES;
+
+        if (!ema_range_has_flag(curr, real_start, real_end,
+                                SGX_EMA_PAGE_TYPE_REG))
+            return EACCES;
 
         if ((curr->alloc_flags & (SGX_EMA_RESERVE))) return EACCES;
 
@@ -1106,8 +2089,6 @@ static int ema_can_commit_data(ema_t* first, ema_t* last, size_t start,
 
         if (curr->eaccept_map)
         {
-            size_t real_start = MAX(start, curr->start_addr);
-            size_t real_end = MIN(end, curr->start_addr + curr->size);
             size_t pos_begin =
                 (real_start - curr->start_addr) >> SGX_PAGE_SHIFT;
             size_t pos_end = (real_end - curr->start_addr) >> SGX_PAGE_SHIFT;
@@ -1116,6 +2097,7 @@ static int ema_can_commit_data(ema_t* first, ema_t* last, size_t start,
                                          pos_end - pos_begin))
                 return EACCES;
         }
+        plan_add(plan, curr, real_start, real_end, PLAN_NONE_COMMITTED);
         prev_end = curr->start_addr + curr->size;
         curr = curr->next;
     }
@@ -1144,20 +2126,46 @@ int ema_do_commit_data(ema_t* node, size_t start, size_t end, uint8_t* data,
     return ema_set_eaccept(node, start, end);
 }
 
+// Commit the page at 'addr' of 'node' with a copy of the page at 'src',
+// with the permissions recorded for it
+static int ema_do_commit_page_copy(ema_t* node, size_t addr, const void* src)
+{
+    int prot = (int)(get_ema_page_si_flags(node, addr) & SGX_EMA_PROT_MASK);
+    sec_info_t si SGX_SECINFO_ALIGN = {(uint64_t)prot | SGX_EMA_PAGE_TYPE_REG,
+                                       0};
+
+    if (do_eacceptcopy(&si, addr, (size_t)src)) return EFAULT;
+    int ret = ema_set_eaccept(node, addr, addr + SGX_PAGE_SIZE);
+    if (ret) return ret;
+    // the page is mapped read-write when added
+    if (prot != SGX_EMA_PROT_READ_WRITE &&
+        sgx_mm_modify_ocall(addr, SGX_PAGE_SIZE, prot | SGX_EMA_PAGE_TYPE_REG,
+                            prot | SGX_EMA_PAGE_TYPE_REG))
+        return EFAULT;
+    return 0;
+}
+
 int ema_do_commit_data_loop(ema_t* first, ema_t* last, size_t start, size_t end,
                             uint8_t* data, int prot)
 {
     int ret = 0;
-    ret = ema_can_commit_data(first, last, start, end);
+    ema_plan_t plan;
+    plan.num = 0;
+    ret = ema_quota_check_range(first, last, start, end, false);
+    if (ret) return ret;
+    ret = ema_can_commit_data(first, last, start, end, &plan);
+    if (ret) return ret;
+    // the data replaces pages held compressed or paged out
+    ret = ema_backing_release_range(start, end, false);
     if (ret) return ret;
 
     ema_t* curr = first;
-    while (curr != last)
+    ema_plan_step_t step;
+    for (size_t i = 0; curr != last; i++)
     {  // there is no split in this loop
-        size_t real_start = MAX(start, curr->start_addr);
-        size_t real_end = MIN(end, curr->start_addr + curr->size);
-        uint8_t* real_data = data + real_start - start;
-        ret = ema_do_commit_data(curr, real_start, real_end, real_data, prot);
+        plan_step(&plan, i, curr, start, end, &step);
+        uint8_t* real_data = data + step.start - start;
+        ret = ema_do_commit_data(curr, step.start, step.end, real_data, prot);
         if (ret != 0)
         {
             return ret;
@@ -1165,26 +2173,74 @@ int ema_do_commit_data_loop(ema_t* first, ema_t* last, size_t start, size_t end,
         curr = curr->next;
     }
 
-    ret = ema_modify_permissions_loop_nocheck(first, last, start, end, prot);
+    // nodes are unchanged, the plan is still valid for the permission pass
+    ret = ema_modify_permissions_loop_nocheck(first, last, start, end, prot,
+                                              &plan);
     return ret;
 }
 
-ema_t* ema_realloc_from_reserve_range(ema_t* first, ema_t* last, size_t start,
-                                      size_t end, uint32_t alloc_flags,
-                                      uint64_t si_flags,
-                                      sgx_enclave_fault_handler_t handler,
-                                      void* private_data)
+// Check that [start, end) can be committed with data, the quotas and budget
+// included, before data is produced for it with ema_do_commit_stream_chunk
+int ema_can_commit_stream(ema_t* first, ema_t* last, size_t start,
+                          size_t end)
 {
-    assert(first != NULL);
-    assert(last != NULL);
-    ema_t* curr = first;
-    assert(first->start_addr < end);
-    assert(last->prev->start_addr + last->prev->size > start);
-    // fail on any nodes not reserve or any gaps
-    size_t prev_end = first->start_addr;
-    while (curr != last)
-    {
-        // do not touch internal reserve.
+    ema_plan_t plan;
+    plan.num = 0;
+    int ret = ema_quota_check_range(first, last, start, end, false);
+    if (ret) return ret;
+    return ema_can_commit_data(first, last, start, end, &plan);
+}
+
+// Commit the chunk [start, end) with the data produced into the staging
+// pages at 'ring'. The chunk is checked again as the EMM lock was released
+// while producing it. Pages of the chunk held compressed or paged out are
+// dropped, the data replaces them.
+int ema_do_commit_stream_chunk(ema_t* first, ema_t* last, size_t start,
+                               size_t end, size_t ring, int prot)
+{
+    int ret = ema_can_commit_stream(first, last, start, end);
+    if (ret) return ret;
+    ret = ema_backing_release_range(start, end, false);
+    if (ret) return ret;
+
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        ret = ema_do_commit_data(curr, real_start, real_end,
+                                 (uint8_t*)(ring + real_start - start), prot);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// Give the pages of [start, end), committed chunk by chunk with
+// ema_do_commit_stream_chunk, their permissions 'prot'
+int ema_do_commit_stream_finish(ema_t* first, ema_t* last, size_t start,
+                                size_t end, int prot)
+{
+    ema_plan_t plan;
+    plan.num = 0;
+    return ema_modify_permissions_loop_nocheck(first, last, start, end, prot,
+                                               &plan);
+}
+
+ema_t* ema_realloc_from_reserve_range(ema_t* first, ema_t* last, size_t start,
+                                      size_t end, uint32_t alloc_flags,
+                                      uint64_t si_flags,
+                                      sgx_enclave_fault_handler_t handler,
+                                      void* private_data)
+{
+    assert(first != NULL);
+    assert(last != NULL);
+    ema_t* curr = first;
+    assert(first->start_addr < end);
+    assert(last->prev->start_addr + last->prev->size > start);
+    // fail on any nodes not reserve or any gaps
+    size_t prev_end = first->start_addr;
+    while (curr != last)
+    {
+        // do not touch internal reserve.
         if (!can_erealloc(curr)) return NULL;
         if (prev_end != curr->start_addr)  // there is a gap
             return NULL;
@@ -1237,6 +2293,53 @@ ema_t* ema_realloc_from_reserve_range(ema_t* first, ema_t* last, size_t start,
     return new_node;
 }
 
+// Relocate EMA nodes and bit maps starting from the node at or above the
+// cursor saved from last call, visiting at most '*budget' nodes.
+// Returns true if the end of the list is reached.
+bool ema_compact_root(ema_root_t* root, size_t* budget)
+{
+    ema_t* node = root->guard->next;
+    while (node != root->guard && node->start_addr < root->compact_cursor)
+        node = node->next;
+
+    while (node != root->guard)
+    {
+        if (*budget == 0)
+        {
+            root->compact_cursor = node->start_addr;
+            return false;
+        }
+        (*budget)--;
+
+        if (node->eaccept_map)
+            node->eaccept_map = bit_array_compact(node->eaccept_map);
+        if (node->runs)
+        {
+            ema_runs_t* runs = (ema_runs_t*)emalloc_compact_block(node->runs);
+            if (runs) node->runs = runs;
+        }
+        ema_t* moved = (ema_t*)emalloc_compact_block(node);
+        if (moved)
+        {
+            moved->prev->next = moved;
+            moved->next->prev = moved;
+            if (moved->handle && handle_slots[moved->handle].ema == node)
+                handle_slots[moved->handle].ema = moved;
+            node = moved;
+        }
+        node = node->next;
+    }
+    root->compact_cursor = 0;
+    return true;
+}
+
+// The flags of 'node' for sgx_mm_alloc_ocall, without idle trimming, which
+// is enclave policy the untrusted side doesn't know
+static int ema_ocall_alloc_flags(ema_t* node)
+{
+    return (int)(node->alloc_flags & (uint32_t)(~SGX_EMA_IDLE_TRIM));
+}
+
 int ema_do_alloc(ema_t* node)
 {
     uint32_t alloc_flags = node->alloc_flags;
@@ -1249,7 +2352,7 @@ int ema_do_alloc(ema_t* node)
     size_t size = node->size;
     int ret = sgx_mm_alloc_ocall(tmp_addr, size,
                                  (int)(node->si_flags & SGX_EMA_PAGE_TYPE_MASK),
-                                 (int)alloc_flags);
+                                 ema_ocall_alloc_flags(node));
     if (ret)
     {
         ret = EFAULT;
@@ -1273,3 +2376,1562 @@ int ema_do_alloc(ema_t* node)
 
     return ret;
 }
+
+// Populate a newly allocated COMMIT_ON_DEMAND node with 'data' using
+// EACCEPTCOPY, which sets the final permissions 'prot' directly. Unlike
+// ema_do_commit_data_loop followed by a permission change, no EMODPR or
+// EACCEPT is needed. The untrusted side is only told to update its mapping.
+int ema_do_alloc_data(ema_t* node, uint8_t* data, int prot)
+{
+    int type = node->si_flags & SGX_EMA_PAGE_TYPE_MASK;
+    int old_prot = node->si_flags & SGX_EMA_PROT_MASK;
+    size_t start = node->start_addr;
+    size_t end = start + node->size;
+    size_t addr = start;
+    size_t src = (size_t)data;
+    int ret = 0;
+
+    assert(node->eaccept_map);
+    assert(type == SGX_EMA_PAGE_TYPE_REG);
+    sec_info_t si SGX_SECINFO_ALIGN = {(uint64_t)prot | SGX_EMA_PAGE_TYPE_REG,
+                                       0};
+
+    while (addr < end)
+    {
+        if (do_eacceptcopy(&si, addr, src) != 0)
+        {
+            ret = EFAULT;
+            break;
+        }
+        addr += SGX_PAGE_SIZE;
+        src += SGX_PAGE_SIZE;
+    }
+    // record what was accepted so that a failure can be cleaned up by
+    // deallocating the node
+    if (addr > start)
+    {
+        int r = ema_set_eaccept(node, start, addr);
+        if (r) return r;
+    }
+    node->si_flags =
+        (uint16_t)((node->si_flags & (uint64_t)(~SGX_EMA_PROT_MASK)) |
+                   (uint64_t)prot);
+    if (ret) return ret;
+
+    if (prot != old_prot)
+    {
+        // EPCM permissions are final, same old and new permissions to
+        // only update the page table
+        ret = sgx_mm_modify_ocall(start, end - start, prot | type, prot | type);
+        if (ret) ret = EFAULT;
+    }
+    return ret;
+}
+
+// Make the first 'guard' bytes of each of the 'count' slots of 'stride'
+// bytes starting at 'start' inaccessible. The pages must not be committed.
+// Faults on them are not handled and they can't be committed, so they
+// separate the slots, e.g., stacks carved out of one allocation. The guards
+// are recorded in the run map of 'node' while it has room, and split it
+// into EMAs beyond that.
+int ema_set_guards(ema_t* node, size_t start, size_t stride, size_t guard,
+                   size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t addr = start + i * stride;
+        while (ema_lower_than_addr(node, addr + 1))
+            node = node->next;
+        assert(addr >= node->start_addr &&
+               addr + guard <= node->start_addr + node->size);
+        assert(!node->eaccept_map ||
+               !bit_array_test_range_any(
+                   node->eaccept_map,
+                   (addr - node->start_addr) >> SGX_PAGE_SHIFT,
+                   guard >> SGX_PAGE_SHIFT));
+
+        uint16_t flags = (uint16_t)get_ema_page_si_flags(node, addr);
+        int ret = ema_set_flags(
+            &node, addr, addr + guard,
+            (uint16_t)((flags & ~SGX_EMA_PROT_MASK) | SGX_EMA_PROT_NONE));
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// Grow 'node', the last EMA of a region, in place to end at 'new_end'. The
+// space up to 'new_end' must be free or held by reserved EMAs that belong to
+// no region handle; those are removed. New pages are regular and readable
+// and writable, as in a new allocation, and committed if the EMA was
+// allocated with SGX_EMA_COMMIT_NOW.
+int ema_extend(ema_root_t* root, ema_t* node, size_t new_end)
+{
+    size_t start = node->start_addr;
+    size_t old_end = start + node->size;
+    uint16_t new_flags = SGX_EMA_PROT_READ_WRITE | SGX_EMA_PAGE_TYPE_REG;
+    ema_t *curr = NULL, *last = NULL;
+    int ret = 0;
+
+    assert(new_end > old_end);
+    if (!sgx_mm_is_within_enclave((void*)old_end, new_end - old_end))
+        return ENOMEM;
+    if (root == &g_rts_ema_root
+            ? !is_within_rts_range(old_end, new_end - old_end)
+            : !is_within_user_range(old_end, new_end - old_end))
+        return ENOMEM;
+    if (node->alloc_flags & SGX_EMA_COMMIT_NOW)
+    {
+        ret = ema_quota_check(node->tag, (new_end - old_end) >> SGX_PAGE_SHIFT);
+        if (ret) return ret;
+    }
+
+    if (node->eaccept_map)
+    {
+        ret = bit_array_resize(node->eaccept_map,
+                               (new_end - start) >> SGX_PAGE_SHIFT);
+        if (ret) return ret;
+    }
+
+    // keep the part of a reserved EMA above the new end
+    curr = node->next;
+    for (last = curr; last != root->guard && last->start_addr < new_end;
+         last = last->next)
+        ;
+    if (last != curr && last->prev->start_addr + last->prev->size > new_end &&
+        (last->prev->alloc_flags & SGX_EMA_RESERVE))
+    {
+        ret = ema_split(last->prev, new_end, false, &last);
+        if (ret) goto fail;
+    }
+
+    // anything in the way must be reserved and free for the taking, checked
+    // after the allocations above which may have added EMAs for emalloc
+    curr = node->next;
+    for (last = curr; last != root->guard && last->start_addr < new_end;
+         last = last->next)
+    {
+        if (!(last->alloc_flags & SGX_EMA_RESERVE) || last->handle ||
+            !can_erealloc(last) ||
+            last->start_addr + last->size > new_end)
+        {
+            ret = ENOMEM;
+            goto fail;
+        }
+    }
+    // the reserved EMAs are only taken once the pages can be added
+    if (!(node->alloc_flags & SGX_EMA_RESERVE))
+    {
+        if (sgx_mm_alloc_ocall(old_end, new_end - old_end,
+                               SGX_EMA_PAGE_TYPE_REG,
+                               ema_ocall_alloc_flags(node)))
+        {
+            ret = EFAULT;
+            goto fail;
+        }
+    }
+    while (curr != last)
+    {
+        ema_t* next = curr->next;
+        ema_destroy(curr);
+        curr = next;
+    }
+    node->size = new_end - start;
+    if (node->handle && handle_slots[node->handle].end == old_end)
+        handle_slots[node->handle].end = new_end;
+
+    if (node->alloc_flags & SGX_EMA_RESERVE) return 0;
+    if (node->si_flags != new_flags)
+    {
+        ret = ema_set_flags(&node, old_end, new_end, new_flags);
+        if (ret) return ret;
+    }
+    if (node->alloc_flags & SGX_EMA_COMMIT_NOW)
+    {
+        bool grow_up = !(node->alloc_flags & SGX_EMA_GROWSDOWN);
+        ret = do_commit(old_end, new_end - old_end, new_flags, grow_up);
+        if (ret) return ret;
+        ret = ema_set_eaccept(node, old_end, new_end);
+    }
+    return ret;
+fail:
+    if (node->eaccept_map)
+        bit_array_resize(node->eaccept_map, node->size >> SGX_PAGE_SHIFT);
+    return ret;
+}
+
+// Copy the committed pages of [start, end) with their permissions to the
+// same offsets in [dst, dst + end - start), a new region allocated with the
+// same flags. Only readable regular pages can be copied.
+int ema_copy_range(ema_root_t* root, ema_t* first, ema_t* last, size_t start,
+                   size_t end, size_t dst)
+{
+    ema_t *dst_first = NULL, *dst_last = NULL;
+    size_t prev_end = first->start_addr;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    ret = ema_backing_release_range(start, end, true);
+    if (ret) return ret;
+
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        if (prev_end != curr->start_addr)  // there is a gap
+            return EINVAL;
+        prev_end = curr->start_addr + curr->size;
+    }
+    if (prev_end < end) return EINVAL;
+
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        size_t real_start = MAX(start, curr->start_addr);
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        size_t seg_end = real_end;
+
+        for (size_t addr = real_start; addr < real_end; addr = seg_end)
+        {
+            uint16_t flags = ema_flags_segment(curr, addr, real_end, &seg_end);
+            int prot = flags & SGX_EMA_PROT_MASK;
+            size_t run_start = 0, run_end = addr;
+
+            while (ema_next_committed(curr, run_end, seg_end, &run_start,
+                                      &run_end))
+            {
+                size_t to = dst + (run_start - start);
+                size_t to_end = to + (run_end - run_start);
+
+                if ((flags & SGX_EMA_PAGE_TYPE_MASK) != SGX_EMA_PAGE_TYPE_REG)
+                    return EACCES;
+                if (!(prot & SGX_EMA_PROT_READ)) return EACCES;
+                if (search_ema_range(root, to, to_end, &dst_first, &dst_last) <
+                    0)
+                    return EINVAL;
+
+                if (dst_first->alloc_flags & SGX_EMA_COMMIT_ON_DEMAND)
+                {
+                    ret = ema_do_commit_data_loop(dst_first, dst_last, to,
+                                                  to_end, (uint8_t*)run_start,
+                                                  prot);
+                    if (ret) return ret;
+                    continue;
+                }
+                memcpy((void*)to, (void*)run_start, run_end - run_start);
+                if (prot != SGX_EMA_PROT_READ_WRITE)
+                {
+                    ret = ema_modify_permissions_loop(dst_first, dst_last, to,
+                                                      to_end, prot);
+                    if (ret) return ret;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pages are made read-only before a compressed store or pager copies them
+ * out, so that a write by another thread after the copy faults, and waits
+ * for the EMM lock, instead of being lost when the page is trimmed.
+ */
+// Restrict the pages [start, end) with permissions 'prot' to read-only
+static int evict_restrict(size_t start, size_t end, int prot)
+{
+    if (prot == SGX_EMA_PROT_READ) return 0;
+    return modify_permissions_run(start, end, prot, SGX_EMA_PAGE_TYPE_REG,
+                                  SGX_EMA_PROT_READ);
+}
+
+// Give the pages of [start, end) of 'node' still committed after an
+// eviction their permissions 'prot' back
+static int evict_unrestrict(ema_t* node, size_t start, size_t end, int prot)
+{
+    size_t run_start = 0, run_end = start;
+    if (prot == SGX_EMA_PROT_READ) return 0;
+    while (ema_next_committed(node, run_end, end, &run_start, &run_end))
+    {
+        int ret = modify_permissions_run(run_start, run_end,
+                                         SGX_EMA_PROT_READ,
+                                         SGX_EMA_PAGE_TYPE_REG, prot);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/*
+ * Compressed page store, see sgx_mm_zstore_create. The pool starts with a
+ * staging page, the rest is divided in granules. A stored page takes the
+ * granules of a 16 bit length and its compressed contents.
+ */
+#define ZSTORE_GRANULE_SHIFT 6
+#define ZSTORE_GRANULES_PER_PAGE \
+    ((size_t)SGX_PAGE_SIZE >> ZSTORE_GRANULE_SHIFT)
+#define ZSTORE_HEADER sizeof(uint16_t)
+#define ZSTORE_ZERO   UINT32_MAX  // slot of a page of zeros, no granules
+
+struct _sgx_mm_zstore
+{
+    ema_root_t* root;
+    size_t base;
+    size_t size;
+    size_t pool;           // staging page, then the granules
+    size_t max_size;       // largest compressed size kept
+    bit_array* stored;     // pages of the range held in the store
+    uint32_t* slots;       // first granule + 1 of each stored page
+    bit_array* used;       // granules in use
+    uint16_t* page_used;   // granules in use in each page of the pool
+    size_t num_granules;
+    size_t cursor;         // where the next granule search starts
+    size_t num_stored;
+    size_t granules_used;
+    struct _sgx_mm_zstore* next;
+};
+
+static sgx_mm_zstore* zstores;
+
+static uint8_t* zstore_granule(sgx_mm_zstore* store, size_t granule)
+{
+    return (uint8_t*)(store->pool + SGX_PAGE_SIZE +
+                      (granule << ZSTORE_GRANULE_SHIFT));
+}
+
+static ema_t* zstore_pool_node(sgx_mm_zstore* store)
+{
+    return search_ema(&g_user_ema_root, store->pool);
+}
+
+// Find 'n' free granules, next fit, and commit the pool pages they are in.
+// Returns the first one or SIZE_MAX if the pool is full.
+static size_t zstore_alloc(sgx_mm_zstore* store, size_t n)
+{
+    size_t found = SIZE_MAX;
+    for (int pass = 0; pass < 2 && found == SIZE_MAX; pass++)
+    {
+        size_t pos = pass ? 0 : store->cursor;
+        size_t end = store->num_granules;
+        while ((pos = bit_array_next_clear(store->used, pos, end)) + n <= end)
+        {
+            size_t run_end = bit_array_next_set(store->used, pos, pos + n);
+            if (run_end == pos + n)
+            {
+                found = pos;
+                break;
+            }
+            pos = run_end;
+        }
+    }
+    if (found == SIZE_MAX) return found;
+
+    size_t first_page = found / ZSTORE_GRANULES_PER_PAGE;
+    size_t last_page = (found + n - 1) / ZSTORE_GRANULES_PER_PAGE;
+    size_t start = store->pool + ((first_page + 1) << SGX_PAGE_SHIFT);
+    size_t end = store->pool + ((last_page + 2) << SGX_PAGE_SHIFT);
+    // pool pages are part of reclaiming memory, not subject to quotas
+    if (ema_do_commit_pages(zstore_pool_node(store), start, end))
+        return SIZE_MAX;
+    for (size_t g = found; g < found + n; g++)
+        store->page_used[g / ZSTORE_GRANULES_PER_PAGE]++;
+    bit_array_set_range(store->used, found, n);
+    store->granules_used += n;
+    store->cursor = found + n;
+    return found;
+}
+
+// Free 'n' granules from 'granule', trimming pool pages left empty
+static int zstore_free(sgx_mm_zstore* store, size_t granule, size_t n)
+{
+    ema_t* pool_node = zstore_pool_node(store);
+
+    bit_array_reset_range(store->used, granule, n);
+    store->granules_used -= n;
+    for (size_t g = granule; g < granule + n; g++)
+    {
+        size_t page = g / ZSTORE_GRANULES_PER_PAGE;
+        if (--store->page_used[page]) continue;
+        size_t addr = store->pool + ((page + 1) << SGX_PAGE_SHIFT);
+        int ret = ema_uncommit_block(pool_node, addr, addr + SGX_PAGE_SIZE,
+                                     SGX_EMA_PROT_READ_WRITE,
+                                     SGX_EMA_PAGE_TYPE_REG, false);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static size_t zstore_blob_granules(size_t len)
+{
+    return (ZSTORE_HEADER + len + (1 << ZSTORE_GRANULE_SHIFT) - 1) >>
+           ZSTORE_GRANULE_SHIFT;
+}
+
+// Drop the stored copy of page 'pos'
+static int zstore_release(sgx_mm_zstore* store, size_t pos)
+{
+    uint32_t slot = store->slots[pos];
+    int ret = 0;
+
+    if (slot != ZSTORE_ZERO)
+    {
+        uint16_t len;
+        memcpy(&len, zstore_granule(store, slot - 1), sizeof(len));
+        ret = zstore_free(store, slot - 1, zstore_blob_granules(len));
+    }
+    store->slots[pos] = 0;
+    bit_array_reset_range(store->stored, pos, 1);
+    store->num_stored--;
+    return ret;
+}
+
+static bool zstore_page_is_zero(const uint8_t* page)
+{
+    const uint64_t* p = (const uint64_t*)page;
+    for (size_t i = 0; i < SGX_PAGE_SIZE / sizeof(uint64_t); i++)
+        if (p[i]) return false;
+    return true;
+}
+
+// Compress the committed page at 'addr' into the store. Returns ENOSPC if
+// it does not compress to max_size bytes, ENOMEM if the pool is full.
+static int zstore_put(sgx_mm_zstore* store, size_t addr)
+{
+    size_t pos = (addr - store->base) >> SGX_PAGE_SHIFT;
+    uint8_t* staging = (uint8_t*)store->pool;
+    uint32_t slot = ZSTORE_ZERO;
+
+    if (!zstore_page_is_zero((const uint8_t*)addr))
+    {
+        size_t len = lz_compress((const uint8_t*)addr, SGX_PAGE_SIZE, staging,
+                                 store->max_size);
+        if (!len) return ENOSPC;
+        size_t n = zstore_blob_granules(len);
+        size_t granule = zstore_alloc(store, n);
+        if (granule == SIZE_MAX) return ENOMEM;
+        uint16_t len16 = (uint16_t)len;
+        uint8_t* blob = zstore_granule(store, granule);
+        memcpy(blob, &len16, sizeof(len16));
+        memcpy(blob + ZSTORE_HEADER, staging, len);
+        slot = (uint32_t)(granule + 1);
+    }
+    store->slots[pos] = slot;
+    bit_array_set(store->stored, pos);
+    store->num_stored++;
+    return 0;
+}
+
+// Decompress the stored page at 'addr' of 'node' back into it
+static int zstore_load(sgx_mm_zstore* store, ema_t* node, size_t addr)
+{
+    size_t pos = (addr - store->base) >> SGX_PAGE_SHIFT;
+    uint32_t slot = store->slots[pos];
+    uint8_t* staging = (uint8_t*)store->pool;
+
+    if (slot == ZSTORE_ZERO)
+        memset(staging, 0, SGX_PAGE_SIZE);
+    else
+    {
+        uint8_t* blob = zstore_granule(store, slot - 1);
+        uint16_t len;
+        memcpy(&len, blob, sizeof(len));
+        if (!lz_decompress(blob + ZSTORE_HEADER, len, staging, SGX_PAGE_SIZE))
+            return EFAULT;
+    }
+    int ret = ema_do_commit_page_copy(node, addr, staging);
+    if (ret) return ret;
+    return zstore_release(store, pos);
+}
+
+// Trim the pages [start, end) of 'node', just stored and read-only. Drops
+// them from the store if that fails.
+static int zstore_trim(sgx_mm_zstore* store, ema_t* node, size_t start,
+                       size_t end)
+{
+    if (start == end) return 0;
+    int ret = ema_uncommit_block(node, start, end, SGX_EMA_PROT_READ,
+                                 SGX_EMA_PAGE_TYPE_REG, false);
+    if (!ret) return 0;
+    for (size_t addr = start; addr < end; addr += SGX_PAGE_SIZE)
+        zstore_release(store, (addr - store->base) >> SGX_PAGE_SHIFT);
+    return ret;
+}
+
+static sgx_mm_zstore* zstore_find(size_t start, size_t end)
+{
+    for (sgx_mm_zstore* s = zstores; s; s = s->next)
+        if (start >= s->base && end <= s->base + s->size) return s;
+    return NULL;
+}
+
+// Compress the readable committed regular pages of COMMIT_ON_DEMAND
+// regions without a fault handler and not used by the EMM itself in
+// [start, end), within one store, and trim them in runs. Pages that don't
+// compress well enough stay committed. 'readonly' if the pages are
+// read-only already, e.g., made readable by a sampler. The number of pages
+// stored is added to '*count'.
+static int zstore_evict(sgx_mm_zstore* store, size_t start, size_t end,
+                        bool readonly, size_t* count)
+{
+    ema_t *first = NULL, *last = NULL;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    if (search_ema_range(store->root, start, end, &first, &last) < 0)
+        return 0;
+
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        // the pool of a store may lie in the range, as may EMM metadata
+        if (!(curr->alloc_flags & SGX_EMA_COMMIT_ON_DEMAND) || curr->handler ||
+            ema_is_internal(curr->start_addr))
+            continue;
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        size_t run_start = 0, run_end = MAX(start, curr->start_addr);
+        while (ema_next_committed(curr, run_end, real_end, &run_start,
+                                  &run_end))
+        {
+            size_t seg_end = run_end;
+            for (size_t addr = run_start; addr < run_end; addr = seg_end)
+            {
+                uint16_t flags =
+                    ema_flags_segment(curr, addr, run_end, &seg_end);
+                int prot = flags & SGX_EMA_PROT_MASK;
+                if ((flags & SGX_EMA_PAGE_TYPE_MASK) != SGX_EMA_PAGE_TYPE_REG ||
+                    !(prot & SGX_EMA_PROT_READ))
+                    continue;
+                if (!readonly)
+                {
+                    ret = evict_restrict(addr, seg_end, prot);
+                    if (ret) return ret;
+                }
+                size_t trim_start = addr;
+                int r = 0;
+                for (size_t page = addr; page < seg_end; page += SGX_PAGE_SIZE)
+                {
+                    ret = zstore_put(store, page);
+                    if (!ret)
+                    {
+                        (*count)++;
+                        continue;
+                    }
+                    r = zstore_trim(store, curr, trim_start, page);
+                    if (r || ret != ENOSPC) break;
+                    trim_start = page + SGX_PAGE_SIZE;
+                    ret = 0;
+                }
+                if (!ret) r = zstore_trim(store, curr, trim_start, seg_end);
+                int u = evict_unrestrict(curr, addr, seg_end, prot);
+                if (r) return r;
+                if (ret) return ret;
+                if (u) return u;
+            }
+        }
+    }
+    return 0;
+}
+
+// Stored pages in [start, end) are committed again if 'restore', dropped
+// otherwise
+static int zstore_release_range(size_t start, size_t end, bool restore)
+{
+    for (sgx_mm_zstore* s = zstores; s; s = s->next)
+    {
+        if (start >= s->base + s->size || end <= s->base) continue;
+        size_t pos = (MAX(start, s->base) - s->base) >> SGX_PAGE_SHIFT;
+        size_t pos_end =
+            (MIN(end, s->base + s->size) - s->base) >> SGX_PAGE_SHIFT;
+        ema_t* node = NULL;
+        while ((pos = bit_array_next_set(s->stored, pos, pos_end)) < pos_end)
+        {
+            size_t addr = s->base + (pos << SGX_PAGE_SHIFT);
+            int ret = 0;
+            if (restore)
+            {
+                if (!node || ema_lower_than_addr(node, addr + 1))
+                    node = search_ema(s->root, addr);
+                ret = zstore_load(s, node, addr);
+            }
+            else
+                ret = zstore_release(s, pos);
+            if (ret) return ret;
+            pos++;
+        }
+    }
+    return 0;
+}
+
+int ema_zstore_create(size_t addr, size_t size, size_t pool,
+                      const sgx_mm_zstore_config* config,
+                      sgx_mm_zstore** out_store)
+{
+    ema_root_t* root = is_within_user_range(addr, size) ? &g_user_ema_root
+                                                        : &g_rts_ema_root;
+    if (root == &g_rts_ema_root && !is_within_rts_range(addr, size))
+        return EINVAL;
+    for (sgx_mm_zstore* s = zstores; s; s = s->next)
+        if (addr < s->base + s->size && addr + size > s->base) return EINVAL;
+
+    size_t pool_pages = (config->pool_size >> SGX_PAGE_SHIFT) - 1;
+    sgx_mm_zstore* store =
+        (sgx_mm_zstore*)emalloc(sizeof(sgx_mm_zstore), EMALLOC_CAT_OTHER);
+    if (!store) return ENOMEM;
+    memset(store, 0, sizeof(*store));
+    store->num_granules = pool_pages * ZSTORE_GRANULES_PER_PAGE;
+    store->stored = bit_array_new_reset_other(size >> SGX_PAGE_SHIFT);
+    store->used = bit_array_new_reset_other(store->num_granules);
+    store->slots = (uint32_t*)emalloc(
+        (size >> SGX_PAGE_SHIFT) * sizeof(uint32_t), EMALLOC_CAT_OTHER);
+    store->page_used = (uint16_t*)emalloc(pool_pages * sizeof(uint16_t),
+                                          EMALLOC_CAT_OTHER);
+    int ret = ENOMEM;
+    if (!store->stored || !store->used || !store->slots || !store->page_used)
+        goto fail;
+    memset(store->page_used, 0, pool_pages * sizeof(uint16_t));
+    // the staging page stays committed
+    ret = ema_do_commit_pages(search_ema(&g_user_ema_root, pool), pool,
+                              pool + SGX_PAGE_SIZE);
+    if (ret) goto fail;
+
+    store->root = root;
+    store->base = addr;
+    store->size = size;
+    store->pool = pool;
+    store->max_size =
+        config->max_size ? config->max_size : SGX_PAGE_SIZE / 2;
+    store->next = zstores;
+    zstores = store;
+    *out_store = store;
+    return 0;
+fail:
+    if (store->stored) bit_array_delete(store->stored);
+    if (store->used) bit_array_delete(store->used);
+    if (store->slots) efree(store->slots);
+    if (store->page_used) efree(store->page_used);
+    efree(store);
+    return ret;
+}
+
+int ema_zstore_evict(sgx_mm_zstore* store, size_t start, size_t end)
+{
+    size_t count = 0;
+    return zstore_evict(store, start, end, false, &count);
+}
+
+// Handle a #PF at 'addr' of 'node' by restoring the page from a store.
+// Returns ENOENT if it is not stored.
+static int zstore_fault(ema_t* node, size_t addr)
+{
+    sgx_mm_zstore* store = zstore_find(addr, addr + SGX_PAGE_SIZE);
+    if (!store ||
+        !bit_array_test(store->stored, (addr - store->base) >> SGX_PAGE_SHIFT))
+        return ENOENT;
+    int ret = ema_quota_check_range(node, node->next, addr,
+                                    addr + SGX_PAGE_SIZE, true);
+    if (ret) return ret;
+    return zstore_load(store, node, addr);
+}
+
+void ema_zstore_query(sgx_mm_zstore* store, sgx_mm_zstore_info* info)
+{
+    ema_t* pool_node = zstore_pool_node(store);
+    size_t pool_pages = pool_node->size >> SGX_PAGE_SHIFT;
+
+    info->stored = store->num_stored << SGX_PAGE_SHIFT;
+    info->compressed = store->granules_used << ZSTORE_GRANULE_SHIFT;
+    info->committed = ema_count_committed(pool_node, 0, pool_pages)
+                      << SGX_PAGE_SHIFT;
+}
+
+// Restore all stored pages and release the store, the pool is returned in
+// '*out_pool' and '*out_pool_size' for the caller to deallocate
+int ema_zstore_destroy(sgx_mm_zstore* store, size_t* out_pool,
+                       size_t* out_pool_size)
+{
+    int ret = zstore_release_range(store->base, store->base + store->size,
+                                   true);
+    if (ret) return ret;
+    sgx_mm_zstore** link = &zstores;
+    while (*link != store)
+        link = &(*link)->next;
+    *link = store->next;
+    *out_pool = store->pool;
+    *out_pool_size = zstore_pool_node(store)->size;
+    bit_array_delete(store->stored);
+    bit_array_delete(store->used);
+    efree(store->slots);
+    efree(store->page_used);
+    efree(store);
+    return 0;
+}
+
+/*
+ * Encrypted paging, see sgx_mm_pager_create. The region starts with two
+ * staging pages for plaintext and ciphertext, so that the runtime only
+ * seals and unseals enclave memory and untrusted memory is read once.
+ */
+#define PAGER_STAGING_PAGES 2
+
+typedef struct
+{
+    uint64_t nonce;  // unique per seal, 0 if not paged out
+    uint8_t mac[SGX_MM_MAC_SIZE];
+} pager_page_t;
+
+struct _sgx_mm_pager
+{
+    size_t region;      // staging pages, then the pages paged
+    size_t base;
+    size_t size;
+    uint8_t* backing;   // untrusted copy of the region
+    pager_page_t* pages;
+    bit_array* evicted;
+    size_t prefetch;
+    size_t num_evicted;
+    size_t num_restored;
+    size_t num_prefetched;
+    struct _sgx_mm_pager* next;
+};
+
+static sgx_mm_pager* pagers;
+static uint64_t pager_nonce;
+
+static sgx_mm_pager* pager_find(size_t start, size_t end)
+{
+    for (sgx_mm_pager* p = pagers; p; p = p->next)
+        if (start >= p->base && end <= p->base + p->size) return p;
+    return NULL;
+}
+
+// Seal the committed page at 'addr' into the backing store
+static int pager_put(sgx_mm_pager* pager, size_t addr)
+{
+    size_t pos = (addr - pager->base) >> SGX_PAGE_SHIFT;
+    pager_page_t* page = &pager->pages[pos];
+    void* cipher = (void*)(pager->region + SGX_PAGE_SIZE);
+
+    page->nonce = ++pager_nonce;
+    if (sgx_mm_seal_page(page->nonce, addr, (const void*)addr, cipher,
+                         page->mac))
+    {
+        page->nonce = 0;
+        return EFAULT;
+    }
+    memcpy(pager->backing + (pos << SGX_PAGE_SHIFT), cipher, SGX_PAGE_SIZE);
+    bit_array_set(pager->evicted, pos);
+    pager->num_evicted++;
+    return 0;
+}
+
+static void pager_release(sgx_mm_pager* pager, size_t pos)
+{
+    pager->pages[pos].nonce = 0;
+    bit_array_reset_range(pager->evicted, pos, 1);
+    pager->num_evicted--;
+}
+
+// Unseal the paged out page at 'addr' of 'node' back into it. The copy in
+// untrusted memory must be the last one sealed for the address.
+static int pager_load(sgx_mm_pager* pager, ema_t* node, size_t addr)
+{
+    size_t pos = (addr - pager->base) >> SGX_PAGE_SHIFT;
+    pager_page_t* page = &pager->pages[pos];
+    void* plain = (void*)pager->region;
+    void* cipher = (void*)(pager->region + SGX_PAGE_SIZE);
+
+    memcpy(cipher, pager->backing + (pos << SGX_PAGE_SHIFT), SGX_PAGE_SIZE);
+    if (sgx_mm_unseal_page(page->nonce, addr, cipher, plain, page->mac))
+        return EFAULT;
+    int ret = ema_do_commit_page_copy(node, addr, plain);
+    if (ret) return ret;
+    pager_release(pager, pos);
+    return 0;
+}
+
+// Page out the readable committed regular pages of [start, end), within
+// one pager, and trim them in runs. 'readonly' if the pages are read-only
+// already, e.g., made readable by a sampler. The number of pages paged out
+// is added to '*count'.
+static int pager_evict(sgx_mm_pager* pager, size_t start, size_t end,
+                       bool readonly, size_t* count)
+{
+    ema_t *first = NULL, *last = NULL;
+    int ret = ema_sampler_restore_range(start, end);
+    if (ret) return ret;
+    if (search_ema_range(&g_user_ema_root, start, end, &first, &last) < 0)
+        return 0;
+
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        if (curr->handler) continue;
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        size_t run_start = 0, run_end = MAX(start, curr->start_addr);
+        while (ema_next_committed(curr, run_end, real_end, &run_start,
+                                  &run_end))
+        {
+            size_t seg_end = run_end;
+            for (size_t addr = run_start; addr < run_end; addr = seg_end)
+            {
+                uint16_t flags =
+                    ema_flags_segment(curr, addr, run_end, &seg_end);
+                int prot = flags & SGX_EMA_PROT_MASK;
+                if ((flags & SGX_EMA_PAGE_TYPE_MASK) != SGX_EMA_PAGE_TYPE_REG ||
+                    !(prot & SGX_EMA_PROT_READ))
+                    continue;
+                if (!readonly)
+                {
+                    ret = evict_restrict(addr, seg_end, prot);
+                    if (ret) return ret;
+                }
+                size_t page = addr;
+                for (; page < seg_end; page += SGX_PAGE_SIZE)
+                {
+                    ret = pager_put(pager, page);
+                    if (ret) break;
+                }
+                // trim what was sealed in one request
+                int r = 0;
+                if (page > addr)
+                    r = ema_uncommit_block(curr, addr, page, SGX_EMA_PROT_READ,
+                                           SGX_EMA_PAGE_TYPE_REG, false);
+                if (r)
+                {
+                    for (size_t a = addr; a < page; a += SGX_PAGE_SIZE)
+                        pager_release(pager,
+                                      (a - pager->base) >> SGX_PAGE_SHIFT);
+                }
+                else
+                    *count += (page - addr) >> SGX_PAGE_SHIFT;
+                int u = evict_unrestrict(curr, addr, seg_end, prot);
+                if (r) return r;
+                if (ret) return ret;
+                if (u) return u;
+            }
+        }
+    }
+    return 0;
+}
+
+static int pager_release_range(size_t start, size_t end, bool restore)
+{
+    for (sgx_mm_pager* p = pagers; p; p = p->next)
+    {
+        if (start >= p->base + p->size || end <= p->base) continue;
+        size_t pos = (MAX(start, p->base) - p->base) >> SGX_PAGE_SHIFT;
+        size_t pos_end =
+            (MIN(end, p->base + p->size) - p->base) >> SGX_PAGE_SHIFT;
+        ema_t* node = NULL;
+        while ((pos = bit_array_next_set(p->evicted, pos, pos_end)) < pos_end)
+        {
+            size_t addr = p->base + (pos << SGX_PAGE_SHIFT);
+            if (restore)
+            {
+                if (!node || ema_lower_than_addr(node, addr + 1))
+                    node = search_ema(&g_user_ema_root, addr);
+                int ret = pager_load(p, node, addr);
+                if (ret) return ret;
+            }
+            else
+                pager_release(p, pos);
+            pos++;
+        }
+    }
+    return 0;
+}
+
+// Handle a #PF at 'addr' of 'node' by paging in the page and up to
+// 'prefetch' paged out pages after it. Returns ENOENT if it is not paged
+// out.
+static int pager_fault(ema_t* node, size_t addr)
+{
+    sgx_mm_pager* pager = pager_find(addr, addr + SGX_PAGE_SIZE);
+    if (!pager ||
+        !bit_array_test(pager->evicted, (addr - pager->base) >> SGX_PAGE_SHIFT))
+        return ENOENT;
+    int ret = ema_quota_check_range(node, node->next, addr,
+                                    addr + SGX_PAGE_SIZE, true);
+    if (ret) return ret;
+    ret = pager_load(pager, node, addr);
+    if (ret) return ret;
+    pager->num_restored++;
+
+    // neighbours only within the quotas and budget
+    size_t end = MIN(addr + ((pager->prefetch + 1) << SGX_PAGE_SHIFT),
+                     node->start_addr + node->size);
+    end = MIN(end, pager->base + pager->size);
+    if (end == addr + SGX_PAGE_SIZE ||
+        ema_quota_check_range(node, node->next, addr + SGX_PAGE_SIZE, end,
+                              false))
+        return 0;
+    size_t pos = (addr - pager->base) >> SGX_PAGE_SHIFT;
+    size_t pos_end = (end - pager->base) >> SGX_PAGE_SHIFT;
+    while ((pos = bit_array_next_set(pager->evicted, pos, pos_end)) < pos_end)
+    {
+        ret = pager_load(pager, node, pager->base + (pos << SGX_PAGE_SHIFT));
+        if (ret) return ret;
+        pager->num_prefetched++;
+        pos++;
+    }
+    return 0;
+}
+
+int ema_pager_create(size_t region, size_t size,
+                     const sgx_mm_pager_config* config, void* backing,
+                     sgx_mm_pager** out_pager)
+{
+    size_t num_pages = (size >> SGX_PAGE_SHIFT) - PAGER_STAGING_PAGES;
+    sgx_mm_pager* pager =
+        (sgx_mm_pager*)emalloc(sizeof(sgx_mm_pager), EMALLOC_CAT_OTHER);
+    if (!pager) return ENOMEM;
+    memset(pager, 0, sizeof(*pager));
+    pager->evicted = bit_array_new_reset_other(num_pages);
+    pager->pages = (pager_page_t*)emalloc(num_pages * sizeof(pager_page_t),
+                                          EMALLOC_CAT_OTHER);
+    int ret = ENOMEM;
+    if (!pager->evicted || !pager->pages) goto fail;
+    // the staging pages stay committed
+    ret = ema_do_commit_pages(search_ema(&g_user_ema_root, region), region,
+                              region + PAGER_STAGING_PAGES * SGX_PAGE_SIZE);
+    if (ret) goto fail;
+
+    pager->region = region;
+    pager->base = region + PAGER_STAGING_PAGES * SGX_PAGE_SIZE;
+    pager->size = num_pages << SGX_PAGE_SHIFT;
+    pager->backing = (uint8_t*)backing;
+    pager->prefetch = config->prefetch;
+    pager->next = pagers;
+    pagers = pager;
+    *out_pager = pager;
+    return 0;
+fail:
+    if (pager->evicted) bit_array_delete(pager->evicted);
+    if (pager->pages) efree(pager->pages);
+    efree(pager);
+    return ret;
+}
+
+int ema_pager_evict(sgx_mm_pager* pager, size_t start, size_t end)
+{
+    size_t count = 0;
+    return pager_evict(pager, start, end, false, &count);
+}
+
+void ema_pager_query(sgx_mm_pager* pager, sgx_mm_pager_info* info)
+{
+    info->evicted = pager->num_evicted << SGX_PAGE_SHIFT;
+    info->restored = pager->num_restored << SGX_PAGE_SHIFT;
+    info->prefetched = pager->num_prefetched << SGX_PAGE_SHIFT;
+}
+
+// Release a pager, its region and backing store are returned for the
+// caller to deallocate
+void ema_pager_destroy(sgx_mm_pager* pager, size_t* out_region,
+                       size_t* out_size, void** out_backing)
+{
+    sgx_mm_pager** link = &pagers;
+    while (*link != pager)
+        link = &(*link)->next;
+    *link = pager->next;
+    *out_region = pager->region;
+    *out_size = pager->size + PAGER_STAGING_PAGES * SGX_PAGE_SIZE;
+    *out_backing = pager->backing;
+    bit_array_delete(pager->evicted);
+    efree(pager->pages);
+    efree(pager);
+}
+
+/*
+ * Regions populated by a page provider, see sgx_mm_provider_create.
+ */
+struct _sgx_mm_provider
+{
+    size_t base;
+    size_t size;
+    size_t staging;  // 'fetch' committed pages the provider fills
+    size_t fetch;
+    sgx_mm_page_provider_t provide;
+    void* priv;
+    size_t num_fetched;
+    size_t num_calls;
+    bool busy;  // in a call, see ema_provider_prepare
+    struct _sgx_mm_provider* next;
+};
+
+static sgx_mm_provider* providers;
+
+// A page of 'node' a provider fills, not committed and with at least the
+// permissions 'prot'
+static bool provider_page_wanted(ema_t* node, size_t addr, int prot)
+{
+    return !ema_page_committed(node, addr) &&
+           ((int)get_ema_page_si_flags(node, addr) & prot) == prot;
+}
+
+// Find the first run of up to 'fetch' pages of [start, end) that are in a
+// provider's region, within one COMMIT_ON_DEMAND EMA, not committed and
+// with at least the permissions 'prot', and reserve its provider for the
+// call. For a #PF, 'fault', the run goes on past 'end'. Returns ENOENT if
+// there is none, EAGAIN if the provider is in a call already.
+int ema_provider_prepare(size_t start, size_t end, int prot, bool fault,
+                         ema_provider_call_t* call)
+{
+    for (sgx_mm_provider* p = providers; p; p = p->next)
+    {
+        size_t real_start = MAX(start, p->base);
+        size_t real_end = MIN(end, p->base + p->size);
+        if (real_start >= real_end) continue;
+        ema_t *first = NULL, *last = NULL;
+        if (search_ema_range(&g_user_ema_root, real_start, real_end, &first,
+                             &last) < 0)
+            continue;
+        for (ema_t* curr = first; curr != last; curr = curr->next)
+        {
+            if (!(curr->alloc_flags & SGX_EMA_COMMIT_ON_DEMAND)) continue;
+            size_t addr = MAX(real_start, curr->start_addr);
+            size_t curr_end = MIN(real_end, curr->start_addr + curr->size);
+            while (addr < curr_end && !provider_page_wanted(curr, addr, prot))
+                addr += SGX_PAGE_SIZE;
+            if (addr == curr_end) continue;
+            if (p->busy) return EAGAIN;
+
+            if (fault)
+                curr_end = MIN(p->base + p->size,
+                               curr->start_addr + curr->size);
+            curr_end = MIN(curr_end, addr + (p->fetch << SGX_PAGE_SHIFT));
+            size_t run_end = addr + SGX_PAGE_SIZE;
+            while (run_end < curr_end &&
+                   provider_page_wanted(curr, run_end, prot))
+                run_end += SGX_PAGE_SIZE;
+            p->busy = true;
+            call->prov = p;
+            call->start = addr;
+            call->end = run_end;
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+// Have the provider fill its staging pages for 'call'. Made without the
+// EMM lock, the staging pages are only used by the provider in a call.
+int ema_provider_call(const ema_provider_call_t* call)
+{
+    sgx_mm_provider* prov = call->prov;
+    return prov->provide(call->start - prov->base, (void*)prov->staging,
+                         call->end - call->start, prov->priv);
+}
+
+// Commit the pages of 'call' the provider filled with 'result' 0, after
+// checking the quotas for them: for the first page as a #PF if 'fault',
+// the rest are only fetched within the quotas and budget. The region may
+// have changed while the EMM lock was released, pages that are gone or
+// committed by then are skipped. Returns EIO if the provider failed.
+int ema_provider_finish(const ema_provider_call_t* call, int result,
+                        bool fault)
+{
+    sgx_mm_provider* prov = call->prov;
+    size_t start = call->start;
+    size_t end = call->end;
+
+    prov->busy = false;
+    if (result) return EIO;
+    prov->num_calls++;
+
+    ema_t* node = search_ema(&g_user_ema_root, start);
+    if (!node || !(node->alloc_flags & SGX_EMA_COMMIT_ON_DEMAND)) return 0;
+    end = MIN(end, node->start_addr + node->size);
+    int ret = ema_quota_check_range(node, node->next, start,
+                                    start + SGX_PAGE_SIZE, fault);
+    if (ret) return ret;
+    if (end > start + SGX_PAGE_SIZE &&
+        ema_quota_check_range(node, node->next, start + SGX_PAGE_SIZE, end,
+                              false))
+    {
+        if (!fault) return ENOMEM;
+        end = start + SGX_PAGE_SIZE;
+    }
+
+    const uint8_t* src = (const uint8_t*)prov->staging;
+    for (size_t addr = start; addr < end; addr += SGX_PAGE_SIZE)
+    {
+        if (!ema_page_committed(node, addr))
+        {
+            ret = ema_do_commit_page_copy(node, addr, src);
+            if (ret) return ret;
+            prov->num_fetched++;
+        }
+        src += SGX_PAGE_SIZE;
+    }
+    return 0;
+}
+
+int ema_provider_create(size_t addr, size_t size, int prot, size_t staging,
+                        const sgx_mm_provider_config* config,
+                        sgx_mm_provider** out_provider)
+{
+    sgx_mm_provider* prov =
+        (sgx_mm_provider*)emalloc(sizeof(sgx_mm_provider), EMALLOC_CAT_OTHER);
+    if (!prov) return ENOMEM;
+    memset(prov, 0, sizeof(*prov));
+
+    // no page is committed yet, pages get their permissions when fetched
+    ema_t* node = search_ema(&g_user_ema_root, addr);
+    node->si_flags =
+        (uint16_t)((node->si_flags & (uint64_t)(~SGX_EMA_PROT_MASK)) |
+                   (uint64_t)prot);
+    prov->base = addr;
+    prov->size = size;
+    prov->staging = staging;
+    prov->fetch = MAX(config->fetch, 1);
+    prov->provide = config->provider;
+    prov->priv = config->priv;
+    prov->next = providers;
+    providers = prov;
+    *out_provider = prov;
+    return 0;
+}
+
+void ema_provider_query(sgx_mm_provider* prov, sgx_mm_provider_info* info)
+{
+    info->fetched = prov->num_fetched << SGX_PAGE_SHIFT;
+    info->calls = prov->num_calls;
+}
+
+// Release a provider, its region and staging pages are returned for the
+// caller to deallocate. Returns EBUSY if the provider is in a call.
+int ema_provider_destroy(sgx_mm_provider* prov, size_t* out_addr,
+                         size_t* out_size, size_t* out_staging,
+                         size_t* out_staging_size)
+{
+    if (prov->busy) return EBUSY;
+    sgx_mm_provider** link = &providers;
+    while (*link != prov)
+        link = &(*link)->next;
+    *link = prov->next;
+    *out_addr = prov->base;
+    *out_size = prov->size;
+    *out_staging = prov->staging;
+    *out_staging_size = prov->fetch << SGX_PAGE_SHIFT;
+    efree(prov);
+    return 0;
+}
+
+// Pages held compressed or paged out in [start, end) are committed again if
+// 'restore', dropped otherwise.
+static int ema_backing_release_range(size_t start, size_t end, bool restore)
+{
+    int ret = zstore_release_range(start, end, restore);
+    if (ret) return ret;
+    return pager_release_range(start, end, restore);
+}
+
+// Evict [start, end) to the compressed store or pager covering it, ENOENT
+// if none. 'readonly' if the pages are read-only already.
+static int ema_backing_evict(size_t start, size_t end, bool readonly,
+                             size_t* count)
+{
+    sgx_mm_zstore* store = zstore_find(start, end);
+    if (store) return zstore_evict(store, start, end, readonly, count);
+    sgx_mm_pager* pager = pager_find(start, end);
+    if (pager) return pager_evict(pager, start, end, readonly, count);
+    return ENOENT;
+}
+
+// Handle a #PF at 'addr' of 'node', a page not committed, by restoring it
+// from a compressed store or pager. Returns ENOENT if neither has it.
+int ema_backing_fault(ema_t* node, size_t addr)
+{
+    int ret = zstore_fault(node, addr);
+    if (ret != ENOENT) return ret;
+    return pager_fault(node, addr);
+}
+
+/*
+ * Working set sampling, see sgx_mm_sampler_create.
+ */
+struct _sgx_mm_sampler
+{
+    ema_root_t* root;
+    size_t base;
+    size_t size;
+    sgx_mm_sampler_config config;
+    bit_array* revoked;   // pages whose access is revoked in this round
+    size_t num_revoked;   // pages revoked at the start of this round
+    size_t num_accessed;  // of those, pages accessed since
+    size_t last_sampled;  // pages sampled and accessed in the last complete
+    size_t last_accessed; // round
+    size_t hot_permille;  // smoothed share of sampled pages accessed
+    size_t rounds;
+    size_t trimmed;       // pages uncommitted as idle
+    uint64_t seed;
+    struct _sgx_mm_sampler* next;
+};
+
+static sgx_mm_sampler* samplers;
+
+static uint64_t sampler_rand(sgx_mm_sampler* sampler)
+{
+    uint64_t x = sampler->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sampler->seed = x;
+    return x;
+}
+
+// Revoke or restore access to the pages [start, end), all committed REG
+// pages, with the permissions recorded in their EMAs
+static int sampler_apply(sgx_mm_sampler* sampler, size_t start, size_t end,
+                         bool revoke)
+{
+    ema_t* node = search_ema(sampler->root, start);
+    size_t seg_end = end;
+    for (size_t addr = start; addr < end; addr = seg_end)
+    {
+        while (ema_lower_than_addr(node, addr + 1))
+            node = node->next;
+        size_t node_end = MIN(end, node->start_addr + node->size);
+        int prot = ema_flags_segment(node, addr, node_end, &seg_end) &
+                   SGX_EMA_PROT_MASK;
+        int ret = revoke ? modify_permissions_run(addr, seg_end, prot,
+                                                  SGX_EMA_PAGE_TYPE_REG,
+                                                  SGX_EMA_PROT_NONE)
+                         : modify_permissions_run(addr, seg_end,
+                                                  SGX_EMA_PROT_NONE,
+                                                  SGX_EMA_PAGE_TYPE_REG, prot);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// Restore access to the revoked pages of 'sampler' in [start, end)
+static int sampler_restore(sgx_mm_sampler* sampler, size_t start, size_t end)
+{
+    size_t pos = (MAX(start, sampler->base) - sampler->base) >> SGX_PAGE_SHIFT;
+    size_t pos_end =
+        (MIN(end, sampler->base + sampler->size) - sampler->base) >>
+        SGX_PAGE_SHIFT;
+
+    while ((pos = bit_array_next_set(sampler->revoked, pos, pos_end)) <
+           pos_end)
+    {
+        size_t run_end = bit_array_next_clear(sampler->revoked, pos, pos_end);
+        int ret = sampler_apply(
+            sampler, sampler->base + (pos << SGX_PAGE_SHIFT),
+            sampler->base + (run_end << SGX_PAGE_SHIFT), false);
+        if (ret) return ret;
+        bit_array_reset_range(sampler->revoked, pos, run_end - pos);
+        pos = run_end;
+    }
+    return 0;
+}
+
+// Sampled pages must have the permissions of their EMAs before an operation
+// on [start, end) looks at them
+static int ema_sampler_restore_range(size_t start, size_t end)
+{
+    for (sgx_mm_sampler* s = samplers; s; s = s->next)
+    {
+        if (start >= s->base + s->size || end <= s->base) continue;
+        // neither accessed nor idle, leave them out of the estimate
+        size_t pos = (MAX(start, s->base) - s->base) >> SGX_PAGE_SHIFT;
+        size_t pos_end =
+            (MIN(end, s->base + s->size) - s->base) >> SGX_PAGE_SHIFT;
+        size_t count = 0;
+        while ((pos = bit_array_next_set(s->revoked, pos, pos_end)) < pos_end)
+        {
+            size_t run_end = bit_array_next_clear(s->revoked, pos, pos_end);
+            count += run_end - pos;
+            pos = run_end;
+        }
+        int ret = sampler_restore(s, start, end);
+        if (ret) return ret;
+        s->num_revoked -= count;
+    }
+    return 0;
+}
+
+// Whether 'addr' is in memory the EMM uses itself, which must stay
+// accessible to it: the emalloc reserves, the pools of compressed stores and
+// the staging pages of pagers and providers
+static bool ema_is_internal(size_t addr)
+{
+    if (emalloc_in_reserve(addr)) return true;
+    for (sgx_mm_zstore* z = zstores; z; z = z->next)
+    {
+        size_t pool_size =
+            (z->num_granules / ZSTORE_GRANULES_PER_PAGE + 1) << SGX_PAGE_SHIFT;
+        if (addr >= z->pool && addr < z->pool + pool_size) return true;
+    }
+    for (sgx_mm_pager* p = pagers; p; p = p->next)
+        if (addr >= p->region && addr < p->base) return true;
+    for (sgx_mm_provider* p = providers; p; p = p->next)
+        if (addr >= p->staging &&
+            addr < p->staging + (p->fetch << SGX_PAGE_SHIFT))
+            return true;
+    return false;
+}
+
+static bool sampler_page_eligible(ema_t* node, size_t addr)
+{
+    uint64_t flags = get_ema_page_si_flags(node, addr);
+    return !node->handler &&
+           (flags & SGX_EMA_PAGE_TYPE_MASK) == SGX_EMA_PAGE_TYPE_REG &&
+           (flags & SGX_EMA_PROT_MASK) != SGX_EMA_PROT_NONE &&
+           !ema_is_internal(addr);
+}
+
+// Count the committed pages in the range of 'sampler', and find the EMAs
+// [first, last) covering it
+static size_t sampler_committed(sgx_mm_sampler* sampler, ema_t** first,
+                                ema_t** last)
+{
+    size_t end = sampler->base + sampler->size;
+    size_t committed = 0;
+
+    if (search_ema_range(sampler->root, sampler->base, end, first, last) < 0)
+        return 0;
+    for (ema_t* curr = *first; curr != *last; curr = curr->next)
+    {
+        if (!curr->eaccept_map) continue;
+        size_t pos =
+            (MAX(sampler->base, curr->start_addr) - curr->start_addr) >>
+            SGX_PAGE_SHIFT;
+        size_t pos_end =
+            (MIN(end, curr->start_addr + curr->size) - curr->start_addr) >>
+            SGX_PAGE_SHIFT;
+        committed += ema_count_committed(curr, pos, pos_end);
+    }
+    return committed;
+}
+
+// Pick about rate per mille of the committed pages in the range, in chunks
+// of config.chunk committed pages spread at random intervals, and revoke
+// access to them
+static int sampler_start_round(sgx_mm_sampler* sampler)
+{
+    size_t end = sampler->base + sampler->size;
+    ema_t *first = NULL, *last = NULL;
+
+    sampler->num_revoked = sampler->num_accessed = 0;
+    size_t committed = sampler_committed(sampler, &first, &last);
+    if (!committed) return 0;
+
+    size_t chunk = MAX(sampler->config.chunk, 1);
+    size_t num = MAX(committed * sampler->config.rate / 1000 / chunk, 1);
+    size_t stride = committed / num;
+    // gaps between chunks average stride - chunk pages
+    size_t gap = stride > chunk ? stride - chunk : 0;
+    size_t skip = sampler_rand(sampler) % stride;
+    size_t left = 0;  // pages still to take in the current chunk
+    for (ema_t* curr = first; curr != last; curr = curr->next)
+    {
+        size_t real_end = MIN(end, curr->start_addr + curr->size);
+        size_t run_start = 0, run_end = MAX(sampler->base, curr->start_addr);
+        while (ema_next_committed(curr, run_end, real_end, &run_start,
+                                  &run_end))
+        {
+            size_t addr = run_start;
+            while (addr < run_end)
+            {
+                if (!left)
+                {
+                    size_t avail = (run_end - addr) >> SGX_PAGE_SHIFT;
+                    if (skip >= avail)
+                    {
+                        skip -= avail;
+                        break;
+                    }
+                    addr += skip << SGX_PAGE_SHIFT;
+                    left = chunk;
+                }
+                if (sampler_page_eligible(curr, addr))
+                {
+                    bit_array_set(sampler->revoked,
+                                  (addr - sampler->base) >> SGX_PAGE_SHIFT);
+                    sampler->num_revoked++;
+                }
+                addr += SGX_PAGE_SIZE;
+                if (!--left)
+                    skip = gap ? sampler_rand(sampler) % (2 * gap + 1) : 0;
+            }
+        }
+    }
+
+    size_t pos = 0, num_pages = sampler->size >> SGX_PAGE_SHIFT;
+    while ((pos = bit_array_next_set(sampler->revoked, pos, num_pages)) <
+           num_pages)
+    {
+        size_t run_end = bit_array_next_clear(sampler->revoked, pos, num_pages);
+        int ret = sampler_apply(
+            sampler, sampler->base + (pos << SGX_PAGE_SHIFT),
+            sampler->base + (run_end << SGX_PAGE_SHIFT), true);
+        if (ret)
+        {
+            // the failed run and the ones after were not revoked
+            bit_array_reset_range(sampler->revoked, pos, num_pages - pos);
+            return ret;
+        }
+        pos = run_end;
+    }
+    return 0;
+}
+
+int ema_sampler_create(size_t addr, size_t size,
+                       const sgx_mm_sampler_config* config,
+                       sgx_mm_sampler** out_sampler)
+{
+    ema_root_t* root = is_within_user_range(addr, size) ? &g_user_ema_root
+                                                        : &g_rts_ema_root;
+    if (root == &g_rts_ema_root && !is_within_rts_range(addr, size))
+        return EINVAL;
+    // a revoked page must belong to exactly one sampler
+    for (sgx_mm_sampler* s = samplers; s; s = s->next)
+        if (addr < s->base + s->size && s->base < addr + size) return EEXIST;
+
+    sgx_mm_sampler* sampler =
+        (sgx_mm_sampler*)emalloc(sizeof(sgx_mm_sampler), EMALLOC_CAT_OTHER);
+    if (!sampler) return ENOMEM;
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->revoked = bit_array_new_reset_other(size >> SGX_PAGE_SHIFT);
+    if (!sampler->revoked)
+    {
+        efree(sampler);
+        return ENOMEM;
+    }
+    sampler->root = root;
+    sampler->base = addr;
+    sampler->size = size;
+    sampler->config = *config;
+    sampler->seed = (uint64_t)addr ^ (uint64_t)(size_t)sampler;
+    if (!sampler->seed) sampler->seed = 1;
+    sampler->next = samplers;
+    samplers = sampler;
+    *out_sampler = sampler;
+    return 0;
+}
+
+// Uncommit the pages of 'sampler' still revoked at the end of a round that
+// belong to SGX_EMA_IDLE_TRIM regions and are read-write, one request per
+// run. They are committed again, zeroed, on their next access. Pages in a
+// compressed store or pager are evicted to it instead.
+static int sampler_trim_idle(sgx_mm_sampler* sampler)
+{
+    size_t pos = 0, num_pages = sampler->size >> SGX_PAGE_SHIFT;
+    ema_t* node = NULL;
+
+    while ((pos = bit_array_next_set(sampler->revoked, pos, num_pages)) <
+           num_pages)
+    {
+        size_t run_end = bit_array_next_clear(sampler->revoked, pos, num_pages);
+        size_t start = sampler->base + (pos << SGX_PAGE_SHIFT);
+        size_t end = sampler->base + (run_end << SGX_PAGE_SHIFT);
+        if (!node || ema_lower_than_addr(node, start + 1))
+            node = search_ema(sampler->root, start);
+        size_t seg_end = end;
+        for (size_t addr = start; addr < end; addr = seg_end)
+        {
+            while (ema_lower_than_addr(node, addr + 1))
+                node = node->next;
+            size_t node_end = MIN(end, node->start_addr + node->size);
+            uint16_t flags = ema_flags_segment(node, addr, node_end, &seg_end);
+            size_t first = (addr - sampler->base) >> SGX_PAGE_SHIFT;
+            size_t count = (seg_end - addr) >> SGX_PAGE_SHIFT;
+            if ((node->alloc_flags & SGX_EMA_COMMIT_ON_DEMAND) &&
+                (flags & SGX_EMA_PROT_READ) &&
+                (zstore_find(addr, seg_end) || pager_find(addr, seg_end)))
+            {
+                // only readable while compressed or sealed, see
+                // evict_restrict
+                int ret = modify_permissions_run(addr, seg_end,
+                                                 SGX_EMA_PROT_NONE,
+                                                 SGX_EMA_PAGE_TYPE_REG,
+                                                 SGX_EMA_PROT_READ);
+                if (ret) return ret;
+                bit_array_reset_range(sampler->revoked, first, count);
+                ret = ema_backing_evict(addr, seg_end, true,
+                                        &sampler->trimmed);
+                if (ret && ret != ENOMEM) return ret;
+                continue;
+            }
+            if (!(node->alloc_flags & SGX_EMA_IDLE_TRIM) ||
+                (flags & SGX_EMA_PROT_MASK) != SGX_EMA_PROT_READ_WRITE)
+                continue;
+            // the pages are PROT_NONE while revoked
+            int ret = ema_uncommit_block(node, addr, seg_end,
+                                         SGX_EMA_PROT_NONE,
+                                         SGX_EMA_PAGE_TYPE_REG, false);
+            if (ret) return ret;
+            bit_array_reset_range(sampler->revoked, first, count);
+            sampler->trimmed += count;
+        }
+        pos = run_end;
+    }
+    return 0;
+}
+
+int ema_sampler_tick(sgx_mm_sampler* sampler)
+{
+    // pages still revoked were not accessed during the round
+    int ret = sampler_trim_idle(sampler);
+    if (ret) return ret;
+    ret = sampler_restore(sampler, sampler->base,
+                          sampler->base + sampler->size);
+    if (ret) return ret;
+    if (sampler->num_revoked)
+    {
+        size_t permille =
+            sampler->num_accessed * 1000 / sampler->num_revoked;
+        sampler->hot_permille =
+            sampler->rounds ? (sampler->hot_permille * 3 + permille) / 4
+                            : permille;
+        sampler->last_sampled = sampler->num_revoked;
+        sampler->last_accessed = sampler->num_accessed;
+        sampler->rounds++;
+    }
+    return sampler_start_round(sampler);
+}
+
+void ema_sampler_query(sgx_mm_sampler* sampler, sgx_mm_ws_info* info)
+{
+    ema_t *first = NULL, *last = NULL;
+    size_t committed = sampler_committed(sampler, &first, &last);
+    size_t hot = committed * sampler->hot_permille / 1000;
+    info->committed = committed << SGX_PAGE_SHIFT;
+    info->hot = hot << SGX_PAGE_SHIFT;
+    info->cold = (committed - hot) << SGX_PAGE_SHIFT;
+    info->sampled = sampler->last_sampled << SGX_PAGE_SHIFT;
+    info->accessed = sampler->last_accessed << SGX_PAGE_SHIFT;
+    info->rounds = sampler->rounds;
+    info->trimmed = sampler->trimmed << SGX_PAGE_SHIFT;
+}
+
+int ema_sampler_destroy(sgx_mm_sampler* sampler)
+{
+    int ret = sampler_restore(sampler, sampler->base,
+                              sampler->base + sampler->size);
+    if (ret) return ret;
+    sgx_mm_sampler** link = &samplers;
+    while (*link != sampler)
+        link = &(*link)->next;
+    *link = sampler->next;
+    bit_array_delete(sampler->revoked);
+    efree(sampler);
+    return 0;
+}
+
+// Handle a #PF at 'addr' caused by sampling, returns false if the page was
+// not revoked by a sampler
+bool ema_sampler_fault(size_t addr)
+{
+    for (sgx_mm_sampler* s = samplers; s; s = s->next)
+    {
+        if (addr < s->base || addr >= s->base + s->size) continue;
+        size_t pos = (addr - s->base) >> SGX_PAGE_SHIFT;
+        if (!bit_array_test(s->revoked, pos)) continue;
+        if (sampler_apply(s, addr, addr + SGX_PAGE_SIZE, false)) abort();
+        bit_array_reset_range(s->revoked, pos, 1);
+        s->num_accessed++;
+        // out of budget, end the round and count the pages left as accessed,
+        // erring on the side of a larger working set
+        if (s->config.max_faults && s->num_accessed >= s->config.max_faults)
+        {
+            if (sampler_restore(s, s->base, s->base + s->size)) abort();
+            s->num_accessed = s->num_revoked;
+        }
+        return true;
+    }
+    return false;
+}
@@ -34,8 +34,9 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "ema.h"     // SGX_PAGE_SIZE
+#include "ema.h"     // SGX_PAGE_SIZE, ema_set_quota_exempt
 #include "sgx_mm.h"  // sgx_mm_alloc
 /*
  * This file implements a Simple allocator for EMM internal memory
@@ -121,6 +122,9 @@ static block_t* exact_block_list[num_exact_list];
 // the least significant bit in block header
 // 1 == allocated/in-use, 0 == free
 static const uint64_t alloc_mask = 1ULL;
+// bits 1-2 of an allocated block header hold the caller category
+#define cat_shift 1
+static const uint64_t cat_mask = 0x6ULL;
 // block size align to 8 bytes
 uint64_t size_mask = ~((uint64_t)(exact_match_increment - 1));
 // We don't expect many large blocks
@@ -147,6 +151,11 @@ uint64_t block_size(const block_t* b)
     return b->header & size_mask;
 }
 
+static emalloc_cat_t block_cat(const block_t* b)
+{
+    return (emalloc_cat_t)((b->header & cat_mask) >> cat_shift);
+}
+
 size_t block_end(const block_t* b)
 {
     return (size_t)(b) + block_size(b);
@@ -154,6 +163,47 @@ size_t block_end(const block_t* b)
 #ifndef NDEBUG
 size_t num_free_blocks = 0;
 #endif
+
+#ifdef EMALLOC_STATS
+static emalloc_stats_t stats;
+
+#define STATS_INC(field) (stats.field++)
+
+static size_t size_class(size_t bsize);
+
+static void stats_on_alloc(size_t bsize, emalloc_cat_t cat)
+{
+    size_t c = size_class(bsize);
+    stats.live_bytes[c] += bsize;
+    stats.peak_bytes[c] = MAX(stats.peak_bytes[c], stats.live_bytes[c]);
+    if (c == EMALLOC_NUM_SIZE_CLASSES - 1)
+    {
+        stats.live_large_blocks++;
+        stats.peak_large_blocks =
+            MAX(stats.peak_large_blocks, stats.live_large_blocks);
+    }
+    stats.total_live_bytes += bsize;
+    stats.total_peak_bytes =
+        MAX(stats.total_peak_bytes, stats.total_live_bytes);
+    stats.cat_live_bytes[cat] += bsize;
+    stats.cat_peak_bytes[cat] =
+        MAX(stats.cat_peak_bytes[cat], stats.cat_live_bytes[cat]);
+    stats.cat_allocs[cat]++;
+}
+
+static void stats_on_free(size_t bsize, emalloc_cat_t cat)
+{
+    size_t c = size_class(bsize);
+    stats.live_bytes[c] -= bsize;
+    if (c == EMALLOC_NUM_SIZE_CLASSES - 1) stats.live_large_blocks--;
+    stats.total_live_bytes -= bsize;
+    stats.cat_live_bytes[cat] -= bsize;
+}
+#else
+#define STATS_INC(field)             ((void)0)
+#define stats_on_alloc(bsize, cat)   ((void)0)
+#define stats_on_free(bsize, cat)    ((void)0)
+#endif
 /*
  * A reserve is a continuous block of
  * memory committed for emalloc purpose.
@@ -163,11 +213,17 @@ typedef struct _mm_reserve
     size_t base;
     size_t size;
     size_t used;
+    size_t live;  // bytes in allocated blocks
     struct _mm_reserve* next;
 } mm_reserve_t;
 
 static mm_reserve_t* reserve_list = NULL;
 
+// Metadata compaction destination and scan position in it, kept on a block
+// boundary by efree, see emalloc_compact_block.
+static mm_reserve_t* compact_dst = NULL;
+static size_t compact_scan = 0;
+
 static mm_reserve_t* find_used_in_reserve(size_t addr, size_t size)
 {
     if (size == 0) return NULL;
@@ -189,6 +245,14 @@ static size_t get_list_idx(size_t size)
     return list;
 }
 
+#ifdef EMALLOC_STATS
+static size_t size_class(size_t bsize)
+{
+    if (bsize > max_exact_size) return num_exact_list;
+    return get_list_idx(bsize);
+}
+#endif
+
 static void remove_from_list(const block_t* b, block_t** list_head)
 {
     size_t bsize = block_size(b);
@@ -269,7 +333,9 @@ static block_t* possibly_merge(block_t* b)
     while (nr && !is_alloced(nr))
     {
         remove_from_lists(nr);
+        if ((size_t)nr == compact_scan) compact_scan = (size_t)b;
         b->header += block_size(nr);
+        STATS_INC(neighbor_merges);
 #ifndef NDEBUG
         num_free_blocks--;
 #endif
@@ -324,7 +390,7 @@ static block_t* get_free_block(size_t bsize)
     block_t* tmp = large_block_list;
     block_t* best = NULL;
 
-    // EMA objects are 80 bytes
+    // EMA objects are 72 bytes
     // Bit_arrays are mostly small except for really large EMAs
     // So number of large objects is likely small.
     // Simply loop over the free list and find the smallest block
@@ -385,6 +451,7 @@ static void merge_large_blocks_to_reserve(mm_reserve_t* r)
 #ifndef NDEBUG
         num_free_blocks--;
 #endif
+        STATS_INC(reserve_merges);
         used_end -= merge->header;
         merge = get_large_block_end_at(used_end);
     }
@@ -398,6 +465,7 @@ static void new_reserve(void* base, size_t rsize)
     size_t head_size = sizeof(mm_reserve_t);
     reserve->base = (size_t)(base) + head_size;
     reserve->used = 0;
+    reserve->live = 0;
     reserve->size = rsize - head_size;
     reserve->next = reserve_list;
     reserve_list = reserve;
@@ -413,6 +481,7 @@ static block_t* alloc_from_reserve(size_t bsize)
         {
             ret = r->base + r->used;
             r->used += bsize;
+            r->live += bsize;
             break;
         }
         r = r->next;
@@ -433,6 +502,8 @@ static int add_reserve(size_t rsize)
     // this will call back to emalloc and efree.
     // set the flag to avoid infinite loop
     adding_reserve = true;
+    // the EMM needs its metadata to release memory, never throttle it
+    ema_set_quota_exempt(true);
     int ret = sgx_mm_alloc(NULL, reserve_size_increment + 2 * guard_size,
                            SGX_EMA_RESERVE, NULL, NULL, &base);
     if (ret) goto out;
@@ -443,20 +514,44 @@ static int add_reserve(size_t rsize)
 
     sgx_mm_commit(base, rsize);
     new_reserve(base, reserve_size_increment);
+#ifdef EMALLOC_STATS
+    stats.reserve_adds++;
+    stats.reserve_bytes += reserve_size_increment;
+#endif
     reserve_size_increment = reserve_size_increment * 2;  // double next time
     if (reserve_size_increment > max_emalloc_size)
         reserve_size_increment = max_emalloc_size;
 out:
+    ema_set_quota_exempt(false);
     adding_reserve = false;
     return ret;
 }
 
+// Blocks of the meta reserve freed while releasing a reserve, reused by the
+// next reserve added so releasing and adding reserves doesn't use it up
+static block_t* meta_free_list = NULL;
+
 static void* alloc_from_meta(size_t bsize)
 {
     assert(adding_reserve);
-    if (meta_used + bsize > META_RESERVE_SIZE) return NULL;
-    block_t* b = (block_t*)(&meta_reserve[meta_used]);
-    meta_used += bsize;
+    block_t** link = &meta_free_list;
+    while (*link && block_size(*link) < bsize)
+        link = &(*link)->next_prev[0];
+    block_t* b = *link;
+    if (b)
+    {
+        *link = b->next_prev[0];
+        bsize = block_size(b);
+    }
+    else
+    {
+        if (meta_used + bsize > META_RESERVE_SIZE) return NULL;
+        b = (block_t*)(&meta_reserve[meta_used]);
+        meta_used += bsize;
+    }
+#ifdef EMALLOC_STATS
+    stats.meta_used_bytes += bsize;
+#endif
     b->header = bsize | alloc_mask;
     return block_to_payload(b);
 }
@@ -470,18 +565,24 @@ int emalloc_init_with_reserved_mem(size_t init_size)
 
 // Single thread only.
 // Caller holds mm_lock
-void* emalloc(size_t size)
+void* emalloc(size_t size, emalloc_cat_t cat)
 {
     size_t bsize = ROUND_TO(size + header_size, exact_match_increment);
     if (bsize < min_block_size) bsize = min_block_size;
     if (adding_reserve)  // called back from add_reserve
         return alloc_from_meta(bsize);
 
+    uint64_t cat_bits = ((uint64_t)cat << cat_shift) & cat_mask;
     block_t* b = get_free_block(bsize);
 
     if (b != NULL)
     {
-        b->header = bsize | alloc_mask;
+        // a large block not split may be 8 bytes larger than requested, keep
+        // its real size so the neighbor header stays reachable.
+        bsize = block_size(b);
+        b->header = bsize | cat_bits | alloc_mask;
+        find_used_in_reserve((size_t)b, bsize)->live += bsize;
+        stats_on_alloc(bsize, cat);
         return block_to_payload(b);
     }
 
@@ -496,7 +597,8 @@ void* emalloc(size_t size)
             return NULL;
     }
 
-    b->header = bsize | alloc_mask;
+    b->header = bsize | cat_bits | alloc_mask;
+    stats_on_alloc(bsize, cat);
     return block_to_payload(b);
 }
 
@@ -523,6 +625,26 @@ int can_erealloc(const void* payload)
         return 1;
 }
 
+// Whether 'addr' is in one of the reserves, header included
+int emalloc_in_reserve(size_t addr)
+{
+    for (mm_reserve_t* r = reserve_list; r; r = r->next)
+        // the reserve header is at the start of its region
+        if (addr >= (size_t)r && addr < r->base + r->size) return 1;
+    return 0;
+}
+
+// Bytes usable in the block at 'payload', at least the size requested
+size_t emalloc_usable_size(const void* payload)
+{
+    return block_size(payload_to_block(payload)) - header_size;
+}
+
+emalloc_cat_t emalloc_block_cat(const void* payload)
+{
+    return block_cat(payload_to_block(payload));
+}
+
 /*
  * This is an internal interface only used
  *  by emm, intentionally crash for any error or
@@ -537,11 +659,15 @@ void efree(void* payload)
         bstart + bsize > (size_t)(&meta_reserve[0]))
     {
         if (adding_reserve)
-        {  // we don't expect a lot of free blocks allocated
-            // in meta reserve. Do nothing now
+        {  // kept for the next reserve added, see alloc_from_meta
             assert(bstart >= (size_t)(&meta_reserve[0]));
             assert(bstart + bsize <=
                    (size_t)(&meta_reserve[META_RESERVE_SIZE]));
+            b->next_prev[0] = meta_free_list;
+            meta_free_list = b;
+#ifdef EMALLOC_STATS
+            stats.meta_used_bytes -= bsize;
+#endif
             return;
         }
         else
@@ -550,15 +676,189 @@ void efree(void* payload)
     // normal blocks
     mm_reserve_t* r = find_used_in_reserve((size_t)b, block_size(b));
     if (!r) abort();
+    r->live -= bsize;
+    stats_on_free(bsize, block_cat(b));
     b = reconfigure_block(b);
     size_t end = block_end(b);
     if ((end - r->base) == r->used)
     {
         r->used -= b->header;
         merge_large_blocks_to_reserve(r);
+        if (r == compact_dst && compact_scan > r->base + r->used)
+            compact_scan = r->base + r->used;
         return;
     }
 
     put_free_block(b);
     return;
 }
+
+/*
+ * Metadata compaction support.
+ * The densest reserve (most live bytes) is the destination; blocks living
+ * in reserves that are less than half utilized are moved there. Once a
+ * reserve holds no live blocks it can be returned to the EMM.
+ */
+static bool reserve_is_sparse(const mm_reserve_t* r)
+{
+    return r->live < r->used / 2;
+}
+
+static mm_reserve_t* densest_reserve(void)
+{
+    mm_reserve_t* best = reserve_list;
+    for (mm_reserve_t* r = reserve_list; r; r = r->next)
+        if (r->live > best->live) best = r;
+    return best;
+}
+
+static bool block_in_reserve(const block_t* b, const mm_reserve_t* r)
+{
+    return (size_t)b >= r->base && block_end(b) <= r->base + r->used;
+}
+
+// Blocks in the destination reserve are scanned in address order for a free
+// one to fill. The scan position persists for a whole compaction pass so
+// each pass walks the destination at most once.
+static block_t* get_free_block_in(size_t bsize, mm_reserve_t* r)
+{
+    if (r != compact_dst || compact_scan < r->base)
+    {
+        compact_dst = r;
+        compact_scan = r->base;
+    }
+    while (compact_scan < r->base + r->used)
+    {
+        block_t* b = (block_t*)compact_scan;
+        size_t size = block_size(b);
+        compact_scan += size;
+        if (is_alloced(b)) continue;
+        if (size != bsize && size < bsize + min_block_size) continue;
+
+        remove_from_lists(b);
+#ifndef NDEBUG
+        num_free_blocks--;
+#endif
+        if (size > bsize)
+        {
+            block_t* tail = split_free_block(b, bsize);
+            put_free_block(tail);
+            compact_scan = (size_t)tail;
+        }
+        return b;
+    }
+    return NULL;
+}
+
+void* emalloc_compact_block(void* payload)
+{
+    if (adding_reserve || !reserve_list) return NULL;
+    block_t* b = payload_to_block(payload);
+    size_t bsize = block_size(b);
+    mm_reserve_t* src = find_used_in_reserve((size_t)b, bsize);
+    // not in any reserve, e.g., allocated from meta reserve
+    if (!src || !reserve_is_sparse(src)) return NULL;
+
+    mm_reserve_t* dst = densest_reserve();
+    if (dst == src) return NULL;
+
+    block_t* nb = get_free_block_in(bsize, dst);
+    if (!nb)
+    {
+        if (dst->size - dst->used < bsize) return NULL;
+        nb = (block_t*)(dst->base + dst->used);
+        dst->used += bsize;
+    }
+    dst->live += bsize;
+    nb->header = bsize | (b->header & ~size_mask);
+#ifdef EMALLOC_STATS
+    stats_on_alloc(bsize, block_cat(b));
+    stats.compact_moves++;
+#endif
+    memcpy(block_to_payload(nb), payload, bsize - header_size);
+    efree(payload);
+    return block_to_payload(nb);
+}
+
+static void purge_free_blocks_in(const mm_reserve_t* r, block_t** head)
+{
+    block_t* b = *head;
+    while (b)
+    {
+        block_t* next = b->next_prev[0];
+        if (block_in_reserve(b, r))
+        {
+            remove_from_list(b, head);
+#ifndef NDEBUG
+            num_free_blocks--;
+#endif
+        }
+        b = next;
+    }
+}
+
+size_t emalloc_release_free_reserves(void)
+{
+    size_t released = 0;
+    mm_reserve_t* spare = NULL;
+    compact_dst = NULL;
+    // keep the largest empty reserve for the next burst of allocations, so
+    // an idle compaction doesn't release what the burst adds again
+    for (mm_reserve_t* r = reserve_list; r; r = r->next)
+        if (!r->live && (!spare || r->size > spare->size)) spare = r;
+
+    mm_reserve_t** pr = &reserve_list;
+    while (*pr)
+    {
+        mm_reserve_t* r = *pr;
+        if (r->live)
+        {
+            pr = &r->next;
+            continue;
+        }
+
+        for (size_t i = 0; i < num_exact_list; i++)
+            purge_free_blocks_in(r, &exact_block_list[i]);
+        purge_free_blocks_in(r, &large_block_list);
+        if (r == spare)
+        {
+            // its free blocks are dropped, the whole reserve is free again
+            r->used = 0;
+            pr = &r->next;
+            continue;
+        }
+        *pr = r->next;
+
+        // The EMAs tracking the reserve were allocated from the meta
+        // reserve, let efree keep them for the next reserve added.
+        size_t rstart = (size_t)r - guard_size;
+        size_t rsize = r->size + sizeof(mm_reserve_t) + 2 * guard_size;
+        adding_reserve = true;
+        int ret = sgx_mm_dealloc((void*)rstart, rsize);
+        adding_reserve = false;
+        if (ret)
+        {
+            // still committed, put it back as an empty reserve
+            new_reserve((void*)((size_t)r), r->size + sizeof(mm_reserve_t));
+            break;
+        }
+#ifdef EMALLOC_STATS
+        stats.reserve_releases++;
+        stats.reserve_bytes -= rsize - 2 * guard_size;
+#endif
+        released++;
+    }
+    return released;
+}
+
+int emalloc_get_stats(emalloc_stats_t* out)
+{
+#ifdef EMALLOC_STATS
+    if (!out) return EINVAL;
+    *out = stats;
+    return 0;
+#else
+    (void)out;
+    return ENOTSUP;
+#endif
+}
@@ -36,9 +36,12 @@
 #include <stddef.h>
 
 #include "ema.h"
+#include "emalloc.h"
 #include "sgx_mm_rt_abstraction.h"
 
 extern ema_root_t g_rts_ema_root;
+extern ema_root_t g_user_ema_root;
+extern sgx_mm_mutex* mm_lock;
 #define LEGAL_INIT_FLAGS                                                       \
     (SGX_EMA_PAGE_TYPE_REG | SGX_EMA_PAGE_TYPE_TCS |                           \
      SGX_EMA_PAGE_TYPE_SS_FIRST | SGX_EMA_PAGE_TYPE_SS_REST | SGX_EMA_SYSTEM | \
@@ -65,12 +68,13 @@ int mm_init_ema(void* addr, size_t size, int flags, int prot,
 
 extern int mm_alloc_internal(void* addr, size_t size, uint32_t flags,
                              sgx_enclave_fault_handler_t handler, void* priv,
-                             void** out_addr, ema_root_t* root);
+                             void** out_addr, sgx_mm_handle_t* out_handle,
+                             ema_root_t* root);
 
 int mm_alloc(void* addr, size_t size, uint32_t flags,
              sgx_enclave_fault_handler_t handler, void* priv, void** out_addr)
 {
-    return mm_alloc_internal(addr, size, flags, handler, priv, out_addr,
+    return mm_alloc_internal(addr, size, flags, handler, priv, out_addr, NULL,
                              &g_rts_ema_root);
 }
 
@@ -118,3 +122,371 @@ int mm_modify_permissions(void* addr, size_t size, int prot)
 {
     return mm_modify_permissions_internal(addr, size, prot, &g_rts_ema_root);
 }
+
+int mm_get_emalloc_stats(emalloc_stats_t* stats)
+{
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    int ret = emalloc_get_stats(stats);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int mm_compact_metadata(size_t budget)
+{
+    // index of the root an interrupted pass resumes from
+    static int compact_root = 0;
+    ema_root_t* roots[] = {&g_rts_ema_root, &g_user_ema_root};
+    bool done = false;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    while (ema_compact_root(roots[compact_root], &budget))
+    {
+        if (++compact_root == 2)
+        {
+            compact_root = 0;
+            done = true;
+            break;
+        }
+    }
+    if (done) emalloc_release_free_reserves();
+    sgx_mm_mutex_unlock(mm_lock);
+    return done ? 0 : EAGAIN;
+}
+
+/*
+ * Thread resource pools, see mm_thread_pool_create.
+ */
+typedef struct thread_slot_
+{
+    mm_thread_bundle_t bundle;  // must be first, bundles are handed out
+    struct thread_slot_* next_free;
+    bool in_use;                // handed out and not yet returned
+} thread_slot_t;
+
+struct _mm_thread_pool
+{
+    mm_thread_pool_config_t config;
+    size_t count;
+    size_t in_use;
+    // regions holding the resources of all threads, 0 if not allocated
+    size_t tcs_area;
+    size_t data_area;
+    size_t stack_area;
+    size_t ss_area;
+    thread_slot_t* free_list;
+    struct _mm_thread_pool* next;  // next in the list of all pools
+    thread_slot_t slot[];
+};
+
+static mm_thread_pool_t* thread_pools;  // all pools, see
+                                        // mm_thread_pool_reclaim
+
+static bool thread_pool_config_valid(const mm_thread_pool_config_t* config)
+{
+    if (config->stack_size == 0) return false;
+    if (config->stack_commit > config->stack_size) return false;
+    if ((config->data_size | config->stack_size | config->stack_commit |
+         config->guard_size | config->ss_size) %
+        SGX_PAGE_SIZE)
+        return false;
+    return true;
+}
+
+static size_t thread_pool_stack_stride(const mm_thread_pool_config_t* config)
+{
+    return config->guard_size + config->stack_size;
+}
+
+static size_t thread_pool_ss_stride(const mm_thread_pool_config_t* config)
+{
+    return config->ss_size ? config->guard_size + config->ss_size : 0;
+}
+
+static int thread_pool_free_areas(mm_thread_pool_t* pool)
+{
+    const mm_thread_pool_config_t* config = &pool->config;
+    size_t n = pool->count;
+    int ret = 0, r = 0;
+
+    if (pool->ss_area)
+    {
+        r = mm_dealloc_internal((void*)pool->ss_area,
+                                n * thread_pool_ss_stride(config),
+                                &g_rts_ema_root);
+        if (r && !ret) ret = r;
+    }
+    if (pool->stack_area)
+    {
+        r = mm_dealloc_internal((void*)pool->stack_area,
+                                n * thread_pool_stack_stride(config),
+                                &g_rts_ema_root);
+        if (r && !ret) ret = r;
+    }
+    if (pool->data_area)
+    {
+        r = mm_dealloc_internal((void*)pool->data_area, n * config->data_size,
+                                &g_rts_ema_root);
+        if (r && !ret) ret = r;
+    }
+    if (pool->tcs_area)
+    {
+        r = mm_dealloc_internal((void*)pool->tcs_area, n * SGX_PAGE_SIZE,
+                                &g_rts_ema_root);
+        if (r && !ret) ret = r;
+    }
+    return ret;
+}
+
+static int thread_pool_alloc(size_t size, int flags, size_t* out_addr)
+{
+    void* addr = (void*)*out_addr;
+    int ret = mm_alloc_internal(addr, size, (uint32_t)(SGX_EMA_SYSTEM | flags),
+                                NULL, NULL, &addr, NULL, &g_rts_ema_root);
+    if (ret == 0) *out_addr = (size_t)addr;
+    return ret;
+}
+
+// Allocate the shadow stacks of all threads in a region reserved for them,
+// leaving the guard pages below each stack reserved
+static int thread_pool_alloc_ss(mm_thread_pool_t* pool)
+{
+    const mm_thread_pool_config_t* config = &pool->config;
+    size_t ss_stride = thread_pool_ss_stride(config);
+    size_t area = 0;
+    int ret = thread_pool_alloc(pool->count * ss_stride, SGX_EMA_RESERVE,
+                                &area);
+    if (ret) return ret;
+    pool->ss_area = area;
+
+    for (size_t i = 0; i < pool->count; i++)
+    {
+        size_t ss = area + i * ss_stride + config->guard_size;
+        size_t first = ss + config->ss_size - SGX_PAGE_SIZE;
+        if (first > ss)
+        {
+            ret = thread_pool_alloc(first - ss,
+                                    SGX_EMA_COMMIT_NOW | SGX_EMA_FIXED |
+                                        SGX_EMA_PAGE_TYPE_SS_REST,
+                                    &ss);
+            if (ret) return ret;
+        }
+        ret = thread_pool_alloc(SGX_PAGE_SIZE,
+                                SGX_EMA_COMMIT_NOW | SGX_EMA_FIXED |
+                                    SGX_EMA_PAGE_TYPE_SS_FIRST,
+                                &first);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// Allocate the stacks of all threads as one region, with the guard pages
+// below each stack left uncommitted and inaccessible inside it, and commit
+// the top of each stack. The guards are kept in the run map of the region
+// while it has room, more guards split it into EMAs.
+static int thread_pool_alloc_stacks(mm_thread_pool_t* pool)
+{
+    const mm_thread_pool_config_t* config = &pool->config;
+    size_t stack_stride = thread_pool_stack_stride(config);
+    size_t area = 0;
+    int ret = thread_pool_alloc(pool->count * stack_stride,
+                                SGX_EMA_COMMIT_ON_DEMAND | SGX_EMA_GROWSDOWN,
+                                &area);
+    if (ret) return ret;
+    pool->stack_area = area;
+
+    if (config->guard_size)
+    {
+        ret = ema_set_guards(search_ema(&g_rts_ema_root, area), area,
+                             stack_stride, config->guard_size, pool->count);
+        if (ret) return ret;
+    }
+    if (!config->stack_commit) return 0;
+    for (size_t i = 1; i <= pool->count; i++)
+    {
+        size_t base = area + i * stack_stride;
+        ret = mm_commit_internal((void*)(base - config->stack_commit),
+                                 config->stack_commit, &g_rts_ema_root);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+int mm_thread_pool_create(const mm_thread_pool_config_t* config,
+                          size_t count, mm_thread_pool_t** out_pool)
+{
+    int ret = EFAULT;
+    mm_thread_pool_t* pool = NULL;
+    size_t i = 0, per_thread = 0;
+
+    if (!config || !out_pool || count == 0) return EINVAL;
+    if (!thread_pool_config_valid(config)) return EINVAL;
+
+    per_thread = SGX_PAGE_SIZE + config->data_size +
+                 thread_pool_stack_stride(config) +
+                 thread_pool_ss_stride(config);
+    if (count > SIZE_MAX / per_thread) return ENOMEM;
+    if (count > (SIZE_MAX - sizeof(mm_thread_pool_t)) / sizeof(thread_slot_t))
+        return ENOMEM;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    pool = (mm_thread_pool_t*)emalloc(
+        sizeof(mm_thread_pool_t) + count * sizeof(thread_slot_t),
+        EMALLOC_CAT_OTHER);
+    if (!pool)
+    {
+        ret = ENOMEM;
+        goto unlock;
+    }
+    pool->config = *config;
+    pool->count = count;
+    pool->in_use = 0;
+    pool->tcs_area = pool->data_area = 0;
+    pool->stack_area = pool->ss_area = 0;
+    pool->free_list = NULL;
+
+    // TCS pages of all threads in one region, allocated and converted with
+    // a single request each
+    ret = thread_pool_alloc(count * SGX_PAGE_SIZE, SGX_EMA_COMMIT_NOW,
+                            &pool->tcs_area);
+    if (ret) goto fail;
+    ret = mm_modify_type_internal((void*)pool->tcs_area, count * SGX_PAGE_SIZE,
+                                  SGX_EMA_PAGE_TYPE_TCS, &g_rts_ema_root);
+    if (ret) goto fail;
+
+    if (config->data_size)
+    {
+        ret = thread_pool_alloc(count * config->data_size, SGX_EMA_COMMIT_NOW,
+                                &pool->data_area);
+        if (ret) goto fail;
+    }
+
+    ret = thread_pool_alloc_stacks(pool);
+    if (ret) goto fail;
+
+    if (config->ss_size)
+    {
+        ret = thread_pool_alloc_ss(pool);
+        if (ret) goto fail;
+    }
+
+    // hand out the lowest bundles first
+    for (i = count; i-- > 0;)
+    {
+        thread_slot_t* slot = &pool->slot[i];
+        size_t stack = pool->stack_area + i * thread_pool_stack_stride(config);
+
+        slot->bundle.tcs = (void*)(pool->tcs_area + i * SGX_PAGE_SIZE);
+        slot->bundle.data =
+            config->data_size
+                ? (void*)(pool->data_area + i * config->data_size)
+                : NULL;
+        slot->bundle.stack_limit = (void*)(stack + config->guard_size);
+        slot->bundle.stack_base =
+            (void*)(stack + thread_pool_stack_stride(config));
+        slot->bundle.ss =
+            config->ss_size ? (void*)(pool->ss_area +
+                                      i * thread_pool_ss_stride(config) +
+                                      config->guard_size)
+                            : NULL;
+        slot->in_use = false;
+        slot->next_free = pool->free_list;
+        pool->free_list = slot;
+    }
+    pool->next = thread_pools;
+    thread_pools = pool;
+    *out_pool = pool;
+    ret = 0;
+    goto unlock;
+fail:
+    thread_pool_free_areas(pool);
+    efree(pool);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int mm_thread_pool_get(mm_thread_pool_t* pool, mm_thread_bundle_t** out_bundle)
+{
+    thread_slot_t* slot = NULL;
+
+    if (!pool || !out_bundle) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    slot = pool->free_list;
+    if (slot)
+    {
+        pool->free_list = slot->next_free;
+        slot->next_free = NULL;
+        slot->in_use = true;
+        pool->in_use++;
+        *out_bundle = &slot->bundle;
+    }
+    sgx_mm_mutex_unlock(mm_lock);
+    return slot ? 0 : EAGAIN;
+}
+
+int mm_thread_pool_put(mm_thread_pool_t* pool, mm_thread_bundle_t* bundle)
+{
+    int ret = EINVAL;
+    thread_slot_t* slot = (thread_slot_t*)bundle;
+
+    if (!pool || !bundle) return EINVAL;
+    if (slot < pool->slot || slot >= pool->slot + pool->count) return EINVAL;
+    if ((size_t)((uint8_t*)slot - (uint8_t*)pool->slot) %
+        sizeof(thread_slot_t))
+        return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    if (slot->in_use)
+    {
+        slot->in_use = false;
+        slot->next_free = pool->free_list;
+        pool->free_list = slot;
+        pool->in_use--;
+        ret = 0;
+    }
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int mm_thread_pool_destroy(mm_thread_pool_t* pool)
+{
+    int ret = EFAULT;
+    mm_thread_pool_t** link = &thread_pools;
+
+    if (!pool) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    if (pool->in_use)
+    {
+        ret = EBUSY;
+        goto unlock;
+    }
+    ret = thread_pool_free_areas(pool);
+    while (*link != pool)
+        link = &(*link)->next;
+    *link = pool->next;
+    efree(pool);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+// Uncommit the stacks of idle bundles below their initial commit, until at
+// most 'target' pages are committed. Called with the lock held under EPC
+// pressure; a thread that gets the bundle later faults the pages back in.
+void mm_thread_pool_reclaim(size_t target)
+{
+    for (mm_thread_pool_t* pool = thread_pools; pool; pool = pool->next)
+    {
+        size_t keep = pool->config.stack_commit;
+        for (thread_slot_t* slot = pool->free_list; slot;
+             slot = slot->next_free)
+        {
+            if (ema_committed() <= target) return;
+            size_t limit = (size_t)slot->bundle.stack_limit;
+            size_t top = (size_t)slot->bundle.stack_base - keep;
+            if (top > limit)
+                mm_uncommit_internal((void*)limit, top - limit,
+                                     &g_rts_ema_root);
+        }
+    }
+}
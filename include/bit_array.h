@@ -55,6 +55,11 @@ extern "C"
     // All the tracked bits are reset (value 0).
     bit_array* bit_array_new_reset(size_t num_of_bits);
 
+    // Create a new bit array to track the status of 'num' of bits.
+    // All the tracked bits are reset (value 0). Counted as other EMM
+    // metadata rather than as an EMA bit map.
+    bit_array* bit_array_new_reset_other(size_t num_of_bits);
+
     // Delete the bit_array 'ba' and the data it owns
     void bit_array_delete(bit_array* ba);
 
@@ -67,6 +72,12 @@ extern "C"
     // Retuen whether any bit in range [pos, pos+len) is set
     bool bit_array_test_range_any(bit_array* ba, size_t pos, size_t len);
 
+    // Return the position of the first set bit in [pos, end), or 'end'
+    size_t bit_array_next_set(bit_array* ba, size_t pos, size_t end);
+
+    // Return the position of the first clear bit in [pos, end), or 'end'
+    size_t bit_array_next_clear(bit_array* ba, size_t pos, size_t end);
+
     // Set the bit at 'pos'
     void bit_array_set(bit_array* ba, size_t pos);
 
@@ -85,10 +96,17 @@ extern "C"
     // Reset the bit_array 'ba' to track the new 'data', which has 'num' of bits
     void bit_array_reattach(bit_array* ba, size_t num_of_bits, uint8_t* data);
 
+    // Change the number of bits tracked to 'num', new bits are reset
+    int bit_array_resize(bit_array* ba, size_t num_of_bits);
+
     // Split the bit array at 'pos'
     // Returns pointers to two new bit arrays
     int bit_array_split(bit_array* ba, size_t pos, bit_array**, bit_array**);
 
+    // Relocate 'ba' and its data into denser emalloc reserves
+    // Returns the possibly moved bit_array
+    bit_array* bit_array_compact(bit_array* ba);
+
 #ifdef __cplusplus
 }
 #endif
@@ -46,6 +46,15 @@
 typedef struct ema_root_ ema_root_t;
 typedef struct ema_t_ ema_t;
 
+// A call to a page provider for the pages [start, end), made without the
+// EMM lock, see ema_provider_prepare
+typedef struct ema_provider_call_
+{
+    sgx_mm_provider* prov;
+    size_t start;
+    size_t end;
+} ema_provider_call_t;
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -66,6 +75,8 @@ extern "C"
 
     uint32_t get_ema_alloc_flags(ema_t* node);
     uint64_t get_ema_si_flags(ema_t* node);
+    int get_ema_tag(ema_t* node);
+    uint64_t get_ema_page_si_flags(ema_t* node, size_t addr);
 
     sgx_enclave_fault_handler_t ema_fault_handler(ema_t* node,
                                                   void** private_data);
@@ -79,12 +90,28 @@ extern "C"
     int ema_set_eaccept(ema_t* node, size_t start, size_t end);
     bool ema_page_committed(ema_t* ema, size_t addr);
 
+    void ema_set_tag(ema_t* node, int tag);
+    int ema_quota_check(int tag, size_t num_pages);
+    int ema_set_quota(int tag, size_t num_pages);
+    void ema_set_reclaim_handler(sgx_mm_reclaim_handler_t handler, void* priv);
+    size_t ema_tag_committed(int tag);
+    void ema_set_quota_exempt(bool exempt);
+    size_t ema_committed(void);
+    int ema_set_budget(size_t limit, size_t high, size_t low);
+    int ema_add_pressure_handler(sgx_mm_pressure_handler_t handler,
+                                 void* priv);
+    int ema_remove_pressure_handler(sgx_mm_pressure_handler_t handler,
+                                    void* priv);
+
     ema_t* search_ema(ema_root_t* root, size_t addr);
     int search_ema_range(ema_root_t* root, size_t start, size_t end,
                          ema_t** ema_begin, ema_t** ema_end);
+    int search_ema_range_hint(ema_root_t* root, ema_t** hint, size_t start,
+                              size_t end, ema_t** ema_begin, ema_t** ema_end);
 
     bool find_free_region(ema_root_t* root, size_t size, size_t align,
-                          size_t* addr, ema_t** next_ema);
+                          int placement, size_t* addr, ema_t** next_ema);
+    int ema_root_set_placement(ema_root_t* root, int placement);
 
     bool find_free_region_at(ema_root_t* root, size_t addr, size_t size,
                              ema_t** next_ema);
@@ -105,14 +132,27 @@ extern "C"
                                int new_prot);
     int ema_modify_permissions_loop(ema_t* first, ema_t* last, size_t start,
                                     size_t end, int prot);
-    int ema_change_to_tcs(ema_t* node, size_t addr);
+    int ema_change_to_tcs_loop(ema_t* first, ema_t* last, size_t start,
+                               size_t end);
 
     int ema_do_commit_data(ema_t* node, size_t start, size_t end, uint8_t* data,
                            int prot);
     int ema_do_commit_data_loop(ema_t* firsr, ema_t* last, size_t start,
                                 size_t end, uint8_t* data, int prot);
+    int ema_can_commit_stream(ema_t* first, ema_t* last, size_t start,
+                              size_t end);
+    int ema_do_commit_stream_chunk(ema_t* first, ema_t* last, size_t start,
+                                   size_t end, size_t ring, int prot);
+    int ema_do_commit_stream_finish(ema_t* first, ema_t* last, size_t start,
+                                    size_t end, int prot);
 
     int ema_do_alloc(ema_t* node);
+    int ema_do_alloc_data(ema_t* node, uint8_t* data, int prot);
+    int ema_extend(ema_root_t* root, ema_t* node, size_t new_end);
+    int ema_copy_range(ema_root_t* root, ema_t* first, ema_t* last,
+                       size_t start, size_t end, size_t dst);
+    int ema_set_guards(ema_t* node, size_t start, size_t stride, size_t guard,
+                       size_t count);
     ema_t* ema_realloc_from_reserve_range(ema_t* first, ema_t* last,
                                           size_t start, size_t end,
                                           uint32_t alloc_flags,
@@ -120,6 +160,50 @@ extern "C"
                                           sgx_enclave_fault_handler_t handler,
                                           void* private_data);
 
+    bool ema_compact_root(ema_root_t* root, size_t* budget);
+
+    int ema_sampler_create(size_t addr, size_t size,
+                           const sgx_mm_sampler_config* config,
+                           sgx_mm_sampler** out_sampler);
+    int ema_sampler_tick(sgx_mm_sampler* sampler);
+    void ema_sampler_query(sgx_mm_sampler* sampler, sgx_mm_ws_info* info);
+    int ema_sampler_destroy(sgx_mm_sampler* sampler);
+    bool ema_sampler_fault(size_t addr);
+    int ema_zstore_create(size_t addr, size_t size, size_t pool,
+                          const sgx_mm_zstore_config* config,
+                          sgx_mm_zstore** out_store);
+    int ema_zstore_evict(sgx_mm_zstore* store, size_t start, size_t end);
+    void ema_zstore_query(sgx_mm_zstore* store, sgx_mm_zstore_info* info);
+    int ema_zstore_destroy(sgx_mm_zstore* store, size_t* out_pool,
+                           size_t* out_pool_size);
+    int ema_pager_create(size_t region, size_t size,
+                         const sgx_mm_pager_config* config, void* backing,
+                         sgx_mm_pager** out_pager);
+    int ema_pager_evict(sgx_mm_pager* pager, size_t start, size_t end);
+    void ema_pager_query(sgx_mm_pager* pager, sgx_mm_pager_info* info);
+    void ema_pager_destroy(sgx_mm_pager* pager, size_t* out_region,
+                           size_t* out_size, void** out_backing);
+    int ema_provider_create(size_t addr, size_t size, int prot,
+                            size_t staging,
+                            const sgx_mm_provider_config* config,
+                            sgx_mm_provider** out_provider);
+    void ema_provider_query(sgx_mm_provider* prov,
+                            sgx_mm_provider_info* info);
+    int ema_provider_destroy(sgx_mm_provider* prov, size_t* out_addr,
+                             size_t* out_size, size_t* out_staging,
+                             size_t* out_staging_size);
+    int ema_provider_prepare(size_t start, size_t end, int prot, bool fault,
+                             ema_provider_call_t* call);
+    int ema_provider_call(const ema_provider_call_t* call);
+    int ema_provider_finish(const ema_provider_call_t* call, int result,
+                            bool fault);
+    int ema_backing_fault(ema_t* node, size_t addr);
+
+    sgx_mm_handle_t ema_handle_new(ema_t* node);
+    int ema_handle_range(ema_root_t* root, sgx_mm_handle_t handle,
+                         size_t start, size_t end, ema_t** ema_begin,
+                         ema_t** ema_end);
+
 #ifdef __cplusplus
 }
 #endif
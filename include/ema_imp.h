@@ -40,22 +40,35 @@
 
 struct ema_t_
 {
+    // Hot fields, the only ones touched when walking the list to look up an
+    // address or a free range. Kept together at the front of the node.
     size_t start_addr;  // starting address, should be on a page boundary
     size_t size;        // bytes
-    uint32_t
-        alloc_flags;    // EMA_RESERVED, EMA_COMMIT_NOW, EMA_COMMIT_ON_DEMAND,
-                        // OR'ed with EMA_SYSTEM, EMA_GROWSDOWN, ENA_GROWSUP
-    uint64_t si_flags;  // one of EMA_PROT_NONE, READ, READ_WRITE, READ_EXEC,
-                        // READ_WRITE_EXEC Or'd with one of EMA_PAGE_TYPE_REG,
-                        // EMA_PAGE_TYPE_TCS, EMA_PAGE_TYPE_TRIM
-    bit_array*
-        eaccept_map;  // bitmap for EACCEPT status, bit 0 in eaccept_map[0] for
-                      // the page at start address bit i in eaccept_map[j] for
-                      // page at start_address+(i+j<<3)<<12
-    sgx_enclave_fault_handler_t
-        handler;  // custom PF handler  (for EACCEPTCOPY use)
-    void* priv;   // private data for handler
-    ema_t* next;  // next in doubly linked list
-    ema_t* prev;  // prev in doubly linked list
+    ema_t* next;        // next in doubly linked list
+    ema_t* prev;        // prev in doubly linked list
+
+    // Cold fields, only accessed once the EMA of interest is found.
+    struct
+    {
+        bit_array* eaccept_map;  // bitmap for EACCEPT status, bit 0 in
+                                 // eaccept_map[0] for the page at start
+                                 // address bit i in eaccept_map[j] for page
+                                 // at start_address+(i+j<<3)<<12
+        sgx_enclave_fault_handler_t
+            handler;  // custom PF handler  (for EACCEPTCOPY use)
+        void* priv;   // private data for handler
+        struct ema_runs_* runs;  // pages whose si_flags differ from the
+                                 // ones below, NULL if none
+        uint16_t si_flags;   // one of EMA_PROT_NONE, READ, READ_WRITE,
+                             // READ_EXEC, READ_WRITE_EXEC Or'd with one of
+                             // EMA_PAGE_TYPE_REG, EMA_PAGE_TYPE_TCS,
+                             // EMA_PAGE_TYPE_TRIM
+        uint8_t alloc_flags;  // EMA_RESERVED, EMA_COMMIT_NOW,
+                              // EMA_COMMIT_ON_DEMAND, OR'ed with EMA_SYSTEM,
+                              // EMA_GROWSDOWN, ENA_GROWSUP
+        uint8_t tag;          // SGX_EMA_TAG the committed pages count to
+        uint32_t handle;  // slot of the region handle this EMA belongs to,
+                          // 0 if none
+    };
 };
 #endif
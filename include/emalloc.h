@@ -38,8 +38,72 @@
 #define MIN(x, y)         (((x) > (y)) ? (y) : (x))
 #define MAX(x, y)         (((x) > (y)) ? (x) : (y))
 
+/*
+ * Categories of emalloc callers, used to attribute allocations when
+ * emalloc is built with EMALLOC_STATS. Stored in spare bits of the block
+ * header so must fit in 2 bits.
+ */
+typedef enum
+{
+    EMALLOC_CAT_OTHER = 0,
+    EMALLOC_CAT_EMA,          // ema_t nodes
+    EMALLOC_CAT_BITMAP_HDR,   // bit_array structs
+    EMALLOC_CAT_BITMAP_DATA,  // bit map data owned by bit_arrays
+    EMALLOC_CAT_NUM
+} emalloc_cat_t;
+
+/* One size class per exact-match free list plus one for all large blocks */
+#define EMALLOC_NUM_SIZE_CLASSES (0x100 + 1)
+
+typedef struct _emalloc_stats
+{
+    // Indexed by size class: class i < 0x100 holds blocks of
+    // (16 + 8 * i) bytes including header, the last class holds large blocks.
+    size_t live_bytes[EMALLOC_NUM_SIZE_CLASSES];
+    size_t peak_bytes[EMALLOC_NUM_SIZE_CLASSES];
+    size_t live_large_blocks;
+    size_t peak_large_blocks;
+    size_t total_live_bytes;
+    size_t total_peak_bytes;
+    // Indexed by emalloc_cat_t
+    size_t cat_live_bytes[EMALLOC_CAT_NUM];
+    size_t cat_peak_bytes[EMALLOC_CAT_NUM];
+    size_t cat_allocs[EMALLOC_CAT_NUM];
+    size_t reserve_adds;      // successful add_reserve calls
+    size_t reserve_bytes;     // total size of all reserves
+    size_t meta_used_bytes;   // in use in the static meta reserve
+    size_t neighbor_merges;   // free blocks merged with right neighbors
+    size_t reserve_merges;    // free large blocks returned to reserve tail
+    size_t reserve_releases;  // empty reserves returned by compaction
+    size_t compact_moves;     // blocks relocated by compaction
+} emalloc_stats_t;
+
 int emalloc_init_with_reserved_mem(size_t);
-void* emalloc(size_t);
+void* emalloc(size_t, emalloc_cat_t);
 void efree(void* ptr);
 int can_erealloc(const void* ptr);
+/* Whether 'addr' is in one of the reserves emalloc allocates from */
+int emalloc_in_reserve(size_t addr);
+size_t emalloc_usable_size(const void* ptr);
+/* Category the block at 'ptr' was allocated under */
+emalloc_cat_t emalloc_block_cat(const void* ptr);
+/*
+ * Copy current statistics into 'stats'.
+ * Returns ENOTSUP if emalloc is not built with EMALLOC_STATS.
+ * Caller holds mm_lock.
+ */
+int emalloc_get_stats(emalloc_stats_t* stats);
+
+/*
+ * Move the block at 'payload' into the densest reserve if it currently lives
+ * in a sparsely used one. Returns the new payload, the old one is freed, or
+ * NULL if the block is left in place. Never adds a reserve.
+ */
+void* emalloc_compact_block(void* payload);
+/*
+ * End a compaction pass: return reserves without any live blocks to the EMM,
+ * but the largest of them, kept for the next allocations. Returns the number
+ * of reserves released.
+ */
+size_t emalloc_release_free_reserves(void);
 #endif
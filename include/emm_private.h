@@ -103,6 +103,118 @@ extern "C"
     int mm_modify_type(void* addr, size_t size, int type);
     int mm_modify_permissions(void* addr, size_t size, int prot);
 
+    struct _emalloc_stats;
+    /*
+     * Query statistics of the EMM internal allocator (emalloc) used for EMA
+     * nodes and bit maps: live/peak bytes per size class and per caller
+     * category, reserve additions and merge counts. Useful for sizing the
+     * initial reserve and spotting metadata growth from EMA splitting.
+     * Available only when the EMM is built with EMALLOC_STATS, see
+     * emalloc_stats_t in emalloc.h for the layout.
+     * @param[out] stats Buffer to receive a snapshot of the statistics.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL stats is NULL.
+     * @retval ENOTSUP The EMM was built without EMALLOC_STATS.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int mm_get_emalloc_stats(struct _emalloc_stats* stats);
+
+    /*
+     * Incrementally compact the EMM metadata. Live EMA nodes and bit maps
+     * found in sparsely used emalloc reserves are relocated into the densest
+     * reserve, and reserves left without live blocks are released, but the
+     * largest, kept for the next allocations. Work is bounded by @budget,
+     * the number of EMA nodes visited in this call; the next call resumes
+     * where this one stopped. Intended to be called by the
+     * runtime from an idle context, e.g., when no other thread is inside the
+     * EMM, as it holds the EMM lock for the duration of the call.
+     * @param[in] budget Maximum number of EMA nodes to visit.
+     * @retval 0 A full pass over all EMAs completed.
+     * @retval EAGAIN Budget exhausted, call again to continue.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int mm_compact_metadata(size_t budget);
+
+    /*
+     * Layout of the per-thread resources in a thread pool.
+     */
+    typedef struct _mm_thread_pool_config
+    {
+        size_t data_size;     // committed RW pages per thread, e.g., SSA
+                              // frames and TLS, may be 0
+        size_t stack_size;    // stack size per thread, not 0
+        size_t stack_commit;  // bytes committed upfront at the stack top
+        size_t guard_size;    // guard pages below each stack and shadow
+                              // stack
+        size_t ss_size;       // shadow stack size per thread, 0 for none
+    } mm_thread_pool_config_t;
+
+    /*
+     * Resources of one thread handed out by a thread pool. All sizes are
+     * those in the pool configuration.
+     */
+    typedef struct _mm_thread_bundle
+    {
+        void* tcs;          // TCS page
+        void* data;         // start of the data pages, NULL if none
+        void* stack_limit;  // lowest stack address, above the guard pages
+        void* stack_base;   // end (exclusive) of the stack
+        void* ss;           // start of the shadow stack, NULL if none; the
+                            // last page is SGX_EMA_PAGE_TYPE_SS_FIRST
+    } mm_thread_bundle_t;
+
+    typedef struct _mm_thread_pool mm_thread_pool_t;
+
+    /*
+     * Provision the resources of @count threads in one pass with the EMM
+     * lock held. TCS pages of all threads form one region and are allocated
+     * and converted with one request each to the untrusted runtime, so are
+     * the data pages and the stacks; only shadow stacks are allocated per
+     * thread as their first page differs in type. All regions are system
+     * regions.
+     * @param[in] config Sizes of the resources, multiples of page size.
+     * @param[in] count Number of threads.
+     * @param[out] out_pool Pointer to store the new pool.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid config or count.
+     * @retval ENOMEM Out of memory or address space, nothing is allocated.
+     * @retval EFAULT All other errors, nothing is allocated.
+     */
+    int mm_thread_pool_create(const mm_thread_pool_config_t* config,
+                              size_t count, mm_thread_pool_t** out_pool);
+
+    /*
+     * Take the resources of one thread from the pool in O(1).
+     * @retval 0 The operation was successful.
+     * @retval EAGAIN All bundles of the pool are in use.
+     * @retval EINVAL pool or out_bundle is NULL.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int mm_thread_pool_get(mm_thread_pool_t* pool,
+                           mm_thread_bundle_t** out_bundle);
+
+    /*
+     * Return a bundle taken with mm_thread_pool_get, e.g., on thread exit, in
+     * O(1). Nothing is uncommitted, the next user of the bundle finds the
+     * pages as they were left, except that stack pages below the
+     * stack_commit bytes at the top are uncommitted under EPC pressure, see
+     * sgx_mm_set_budget.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL pool or bundle is NULL, the bundle is not from pool, or
+     * it was already returned.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int mm_thread_pool_put(mm_thread_pool_t* pool, mm_thread_bundle_t* bundle);
+
+    /*
+     * Deallocate all resources of a pool and the pool itself.
+     * @retval 0 The operation was successful.
+     * @retval EBUSY Some bundles have not been returned to the pool.
+     * @retval EINVAL pool is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int mm_thread_pool_destroy(mm_thread_pool_t* pool);
+
 #ifdef __cplusplus
 }
 #endif
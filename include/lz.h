@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2024 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Largest input lz_compress accepts, offsets are 16 bits
+#define LZ_MAX_INPUT 0xFFFF
+
+    // Compress 'len' bytes of 'src' into at most 'cap' bytes of 'dst' with a
+    // byte oriented LZ77 format of literal runs and back references.
+    // Returns the compressed size, or 0 if it would exceed 'cap' or 'len'
+    // exceeds LZ_MAX_INPUT.
+    size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst,
+                       size_t cap);
+
+    // Decompress 'len' bytes of 'src' produced by lz_compress into 'dst'.
+    // Returns whether the input was well formed and produced exactly
+    // 'dst_len' bytes.
+    bool lz_decompress(const uint8_t* src, size_t len, uint8_t* dst,
+                       size_t dst_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
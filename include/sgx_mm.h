@@ -96,6 +96,12 @@ extern "C"
 /* Reserve an address range and commit physical memory on demand.*/
 #define SGX_EMA_COMMIT_ON_DEMAND SGX_EMA_ALLOC_FLAGS(0x4)
 
+/* With SGX_EMA_COMMIT_ON_DEMAND, let a sampler uncommit pages found idle,
+ * see sgx_mm_sampler_create. The data in them is lost, the next access
+ * commits a zeroed page.
+ */
+#define SGX_EMA_IDLE_TRIM SGX_EMA_ALLOC_FLAGS(0x8)
+
 /* Always commit pages from higher to lower addresses,
  *  no gaps in addresses above the last committed.
  */
@@ -122,6 +128,33 @@ extern "C"
 #define SGX_EMA_PAGE_TYPE_SS_REST \
     SGX_EMA_PAGE_TYPE(0x6) /* the rest pages in shadow stack. */
 
+/* bit 16 - 19 select the placement policy of a region without SGX_EMA_FIXED,
+ * 0 for the default set by sgx_mm_set_placement.
+ */
+#define SGX_EMA_PLACEMENT_SHIFT 16
+#define SGX_EMA_PLACEMENT(n)    ((n) << SGX_EMA_PLACEMENT_SHIFT)
+#define SGX_EMA_PLACEMENT_MASK  SGX_EMA_PLACEMENT(0xF)
+/* Lowest address that fits, the default. */
+#define SGX_EMA_PLACE_FIRST_FIT 1
+/* Smallest free range that fits. */
+#define SGX_EMA_PLACE_BEST_FIT 2
+/* First fit above the end of the previous next fit placement, wrapping
+ * around once. */
+#define SGX_EMA_PLACE_NEXT_FIT 3
+/* Highest address that fits. */
+#define SGX_EMA_PLACE_TOP_DOWN 4
+/* First fit for regions under 2MB, top-down for larger ones, so small
+ * regions don't break up the space large ones need. */
+#define SGX_EMA_PLACE_SEGREGATED 5
+
+/* bit 20 - 23 tag the region for committed page accounting and quotas, see
+ * sgx_mm_set_quota. Regions without a tag have tag 0.
+ */
+#define SGX_EMA_TAG_SHIFT 20
+#define SGX_EMA_TAG(n)    ((n) << SGX_EMA_TAG_SHIFT)
+#define SGX_EMA_TAG_MASK  SGX_EMA_TAG(0xF)
+#define SGX_EMA_NUM_TAGS  16
+
 /* Use bit 24-31 for alignment masks. */
 #define SGX_EMA_ALIGNMENT_SHIFT 24
 /*
@@ -162,14 +195,21 @@ extern "C"
      *            - SGX_EMA_GROWSDOWN: always commit pages from higher to lower
      * addresses, no gaps in addresses above the last committed.
      *            - SGX_EMA_GROWSUP: always commit pages from lower to higher
-     * addresses, no gaps in addresses below the last committed. Optionally ORed
-     * with
+     * addresses, no gaps in addresses below the last committed.
+     *            - SGX_EMA_IDLE_TRIM: pages found idle by a sampler are
+     * uncommitted, losing their data. Optionally ORed with
      *            -  SGX_EMA_FIXED: allocate at fixed address, will return error
      * if the requested address is in use.
      *            -  SGX_EMA_ALIGNED(n):	Align the region on a requested
      * boundary. Fail if a suitable region cannot be found, The argument n
      * specifies the binary logarithm of the desired alignment and must be at
-     * least 12. Optionally ORed with one of following page types:
+     * least 12.
+     *            -  SGX_EMA_PLACEMENT(p): Place the region with policy p, one
+     * of SGX_EMA_PLACE_*, if SGX_EMA_FIXED is not set or the address can't be
+     * used.
+     *            -  SGX_EMA_TAG(t): Account the committed pages of the region
+     * to tag t, less than SGX_EMA_NUM_TAGS, see sgx_mm_set_quota. Optionally
+     * ORed with one of following page types:
      *             - SGX_EMA_PAGE_TYPE_REG: regular page type. This is the
      * default if not specified.
      *             - SGX_EMA_PAGE_TYPE_SS_FIRST: the first page in shadow stack.
@@ -195,6 +235,16 @@ extern "C"
                      sgx_enclave_fault_handler_t handler, void* handler_private,
                      void** out_addr);
 
+    /*
+     * Set the default placement policy for regions allocated by sgx_mm_alloc
+     * and the other APIs that choose an address.
+     * @param[in] placement One of SGX_EMA_PLACE_*.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid policy.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_set_placement(int placement);
+
     /*
      * Uncommit (trim) physical EPC pages in a previously committed range.
      * The pages in the allocation are freed, but the address range is still
@@ -241,6 +291,10 @@ extern "C"
      * @param[in] length Size in bytes of multiples of page size.
      * @param[in] type page type, only SGX_EMA_PAGE_TYPE_TCS is supported.
      *
+     * Every page in the range becomes a separate TCS page. Contiguous pages
+     * are converted with a single request to the untrusted runtime. Pages
+     * already of type TCS are left unchanged.
+     *
      * @retval 0 The operation was successful.
      * @retval EACCES Original page type/permissions do not allow the change.
      * @retval EINVAL The memory region was not allocated or outside enclave
@@ -262,6 +316,7 @@ extern "C"
      * @retval 0 The operation was successful.
      * @retval EINVAL Any requested page is not in any previously allocated
      * regions, or outside the enclave address range.
+     * @retval ENOMEM The commit would exceed the quota of a tag or the budget.
      * @retval EFAULT All other errors.
      */
     int sgx_mm_commit(void* addr, size_t length);
@@ -281,10 +336,788 @@ extern "C"
      * @retval EINVAL Any page in requested address range is not previously
      * allocated, or outside the enclave address range.
      * @retval EACCES Any page in requested range is previously committed.
+     * @retval ENOMEM The commit would exceed the quota of a tag or the budget.
      * @retval EFAULT All other errors.
      */
     int sgx_mm_commit_data(void* addr, size_t length, uint8_t* data, int prot);
 
+    /*
+     * Produce the next chunk of data for sgx_mm_commit_stream. Called
+     * without the EMM lock held, it must not access the range being
+     * committed.
+     * @param[in] offset Offset of the chunk from the start of the range.
+     * @param[out] buf Page aligned staging buffer within the enclave.
+     * @param[in] length Bytes to produce, multiple of page size.
+     * @param[in] priv The private data given to sgx_mm_commit_stream.
+     * @retval 0 The chunk was produced.
+     * @retval Other The data could not be produced.
+     */
+    typedef int (*sgx_mm_data_producer_t)(size_t offset, void* buf,
+                                          size_t length, void* priv);
+
+    /*
+     * Same as sgx_mm_commit_data, but the data is pulled from a producer,
+     * e.g., decrypting or decompressing a module, one chunk at a time into
+     * a staging buffer of @chunk bytes, and each chunk is copied in with
+     * EACCEPTCOPY as soon as it is ready. The whole data never needs to be
+     * in the enclave at once. The producer is called in order of offset.
+     * If it fails, the pages committed so far keep their contents and get
+     * permissions @prot, and the rest of the range is left uncommitted,
+     * pages of it held compressed or paged out are kept.
+     *
+     * @param[in] addr Page aligned target starting addr.
+     * @param[in] length Length of data, in bytes of multiples of page size.
+     * @param[in] chunk Most bytes produced at once, multiple of page size,
+     * 0 for one page.
+     * @param[in] producer Called to produce each chunk.
+     * @param[in] priv Passed to the producer.
+     * @param[in] prot Target permissions.
+     * @retval 0 The operation was successful.
+     * @retval EFAULT The producer failed.
+     * See sgx_mm_commit_data for other return values.
+     */
+    int sgx_mm_commit_stream(void* addr, size_t length, size_t chunk,
+                             sgx_mm_data_producer_t producer, void* priv,
+                             int prot);
+
+    /*
+     * Allocate a new region and populate it with data in one call. This is
+     * equivalent to sgx_mm_alloc with SGX_EMA_COMMIT_ON_DEMAND followed by
+     * sgx_mm_commit_data over the whole region, but the pages are copied in
+     * with their final permissions, so no permission restriction round trip
+     * to the untrusted runtime is needed.
+     *
+     * @param[in] addr Same as sgx_mm_alloc.
+     * @param[in] length Size of the region and of the data in bytes,
+     * multiples of page size.
+     * @param[in] flags Same as sgx_mm_alloc, except that SGX_EMA_RESERVE is
+     * not allowed, the page type must be SGX_EMA_PAGE_TYPE_REG, and the region
+     * is always SGX_EMA_COMMIT_ON_DEMAND.
+     * @param[in] data Page aligned source data within the enclave.
+     * @param[in] prot Permissions of the new pages, SGX_EMA_PROT_NONE is not
+     * allowed.
+     * @param[out] out_addr Pointer to store the start address of the region.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid flags, prot, or data.
+     * @retval EFAULT Failure to copy in the data; nothing is allocated.
+     * See sgx_mm_alloc for other return values.
+     */
+    int sgx_mm_alloc_data(void* addr, size_t length, int flags, uint8_t* data,
+                          int prot, void** out_addr);
+
+/* sgx_mm_resize may move the region if it can't grow in place. */
+#define SGX_MM_RESIZE_MAYMOVE 0x1
+
+    /*
+     * Grow or shrink an allocated region, like mremap. A region shrinks by
+     * deallocating its tail. It grows in place if the address range above
+     * it is free or only reserved with SGX_EMA_RESERVE by sgx_mm_alloc; the
+     * reservation is consumed. New pages are regular and readable and
+     * writable, and committed if the region was allocated with
+     * SGX_EMA_COMMIT_NOW. With SGX_MM_RESIZE_MAYMOVE, a region that can't
+     * grow in place is moved: a new region is allocated with the same flags
+     * and #PF handler, committed pages are copied with their permissions,
+     * and the old region is deallocated. Handles of a moved region become
+     * stale.
+     * @param[in] addr Page aligned start address of the region.
+     * @param[in] old_size Current size in bytes, the region must end at
+     * @addr + @old_size when growing.
+     * @param[in] new_size New size in bytes, multiples of page size, not 0.
+     * @param[in] flags 0 or SGX_MM_RESIZE_MAYMOVE.
+     * @param[out] out_addr Pointer to store the start address of the
+     * region after the call, may be NULL.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters, or the range is not allocated.
+     * @retval ENOMEM No space to grow in place and SGX_MM_RESIZE_MAYMOVE is
+     * not set, or no space to move the region.
+     * @retval EACCES The region has pages that can't be copied, e.g., not
+     * readable, so it can't be moved. The region is left unchanged.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_resize(void* addr, size_t old_size, size_t new_size, int flags,
+                      void** out_addr);
+
+    /*
+     * Opaque reference to a region allocated by sgx_mm_alloc_handle. The
+     * handle stays valid across internal splits of the region and becomes
+     * stale once the whole region is deallocated. 0 is never a valid handle.
+     */
+    typedef uint64_t sgx_mm_handle_t;
+
+    /*
+     * Same as sgx_mm_alloc, and additionally return a handle to the new
+     * region. The handle can be passed to the *_handle variants of the APIs
+     * below to operate on the region without searching for it by address.
+     * @param[out] out_handle Pointer to store the handle of the region.
+     * @retval ENOMEM Also returned if no memory for the handle.
+     * See sgx_mm_alloc for other parameters and return values.
+     */
+    int sgx_mm_alloc_handle(void* addr, size_t length, int flags,
+                            sgx_enclave_fault_handler_t handler,
+                            void* handler_private, void** out_addr,
+                            sgx_mm_handle_t* out_handle);
+
+    /*
+     * Handle variants of sgx_mm_commit, sgx_mm_uncommit,
+     * sgx_mm_modify_permissions and sgx_mm_dealloc. The range [addr,
+     * addr + length) must be within the region referenced by @handle, and
+     * every page in it must still belong to that region.
+     * @param[in] handle Handle returned by sgx_mm_alloc_handle.
+     * @retval EINVAL The handle is stale or invalid, or the range is not
+     * within the region.
+     * See the corresponding address based APIs for other parameters and
+     * return values.
+     */
+    int sgx_mm_commit_handle(sgx_mm_handle_t handle, void* addr,
+                             size_t length);
+    int sgx_mm_uncommit_handle(sgx_mm_handle_t handle, void* addr,
+                               size_t length);
+    int sgx_mm_modify_permissions_handle(sgx_mm_handle_t handle, void* addr,
+                                         size_t length, int prot);
+    int sgx_mm_dealloc_handle(sgx_mm_handle_t handle, void* addr,
+                              size_t length);
+
+/* Operation codes for sgx_mm_batch */
+#define SGX_MM_OP_ALLOC              1
+#define SGX_MM_OP_COMMIT             2
+#define SGX_MM_OP_COMMIT_DATA        3
+#define SGX_MM_OP_UNCOMMIT           4
+#define SGX_MM_OP_DEALLOC            5
+#define SGX_MM_OP_MODIFY_PERMISSIONS 6
+#define SGX_MM_OP_MODIFY_TYPE        7
+
+/* Most operations in one call to sgx_mm_batch */
+#define SGX_MM_BATCH_MAX 64
+
+    /*
+     * One operation in a batch passed to sgx_mm_batch.
+     */
+    typedef struct _sgx_mm_op
+    {
+        int op;           // one of SGX_MM_OP_*
+        int flags;        // flags for ALLOC, prot for MODIFY_PERMISSIONS and
+                          // COMMIT_DATA, type for MODIFY_TYPE
+        void* addr;       // start address, may be NULL for ALLOC
+        size_t length;    // size in bytes, multiple of page size
+        uint8_t* data;    // source data for COMMIT_DATA
+        void** out_addr;  // where ALLOC stores the address, may be NULL
+    } sgx_mm_op;
+
+    /*
+     * Execute a batch of operations with a single acquisition of the EMM
+     * lock. Each operation behaves as the API it corresponds to, e.g.,
+     * SGX_MM_OP_COMMIT as sgx_mm_commit; ALLOC regions have no custom #PF
+     * handler.
+     *
+     * ALLOC operations without an address are executed in the order given
+     * relative to the other operations, so the address they store in
+     * out_addr can be the addr of a later operation in @ops. Between them,
+     * operations are executed in ascending order of their addresses, those
+     * at the same address in the order given. This lets the EMM search its
+     * list once for each such group. Consecutive COMMIT, UNCOMMIT, DEALLOC,
+     * or MODIFY_PERMISSIONS operations with the same prot on contiguous
+     * ranges are merged and performed as a single operation, and share its
+     * result.
+     *
+     * @param[in] ops Array of @n operations.
+     * @param[in] n Number of operations, at most SGX_MM_BATCH_MAX.
+     * @param[out] results Array of @n, each set to the return value of the
+     * corresponding operation.
+     * @retval 0 All operations were successful.
+     * @retval EINVAL ops or results is NULL, or n is 0 or larger than
+     * SGX_MM_BATCH_MAX, none executed.
+     * @retval EFAULT Failure to acquire the EMM lock, none executed.
+     * Otherwise the nonzero result of the first failed operation in @ops.
+     */
+    int sgx_mm_batch(const sgx_mm_op* ops, size_t n, int* results);
+
+    /*
+     * Configuration of a heap arena, sizes in bytes.
+     */
+    typedef struct _sgx_mm_arena_config
+    {
+        size_t max_size;  // address space reserved for the arena, multiple
+                          // of page size
+        size_t grow_min;  // first and smallest growth of the committed space,
+                          // multiple of page size
+        size_t grow_max;  // largest growth, multiple of page size, grow_min
+                          // if 0
+        size_t trim_threshold;  // committed bytes above the break tolerated
+        size_t trim_keep;   // committed bytes kept above the break by a trim,
+                            // multiple of page size
+        size_t trim_delay;  // shrinks in a row over the threshold before
+                            // trimming
+    } sgx_mm_arena_config;
+
+    typedef struct _sgx_mm_arena sgx_mm_arena;
+
+    /*
+     * Create a heap arena for sbrk style allocators. The arena is a
+     * SGX_EMA_COMMIT_ON_DEMAND region of config->max_size bytes. Its
+     * committed space grows in chunks that double from grow_min up to
+     * grow_max, so a heap growing by small steps needs only a few commits.
+     * Committed space above the break is trimmed only after trim_delay
+     * shrinks in a row left more than trim_threshold bytes of it, which
+     * keeps churn around the break from committing and trimming the same
+     * pages repeatedly. A trim keeps trim_keep bytes and halves the next
+     * growth.
+     * @param[in] config Configuration of the arena.
+     * @param[out] out_arena Pointer to store the new arena.
+     * @param[out] out_base Pointer to store the start address, may be NULL.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid configuration.
+     * See sgx_mm_alloc for other return values.
+     */
+    int sgx_mm_arena_create(const sgx_mm_arena_config* config,
+                            sgx_mm_arena** out_arena, void** out_base);
+
+    /*
+     * Move the break of an arena by @increment bytes, committing or
+     * trimming pages as described in sgx_mm_arena_create.
+     * @param[in] arena The arena.
+     * @param[in] increment Bytes to add to the break, may be negative or 0.
+     * @param[out] out_old_brk Pointer to store the break before the call, may
+     * be NULL. It is only stored if the break is moved.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL arena is NULL.
+     * @retval ENOMEM The break would leave the arena, or committing the pages
+     * below the new break would exceed a quota or the budget. The break is
+     * not moved.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     * Otherwise the error of committing pages, see sgx_mm_commit, and the
+     * break is not moved, or the error of trimming pages, see
+     * sgx_mm_uncommit, after the break was moved.
+     */
+    int sgx_mm_arena_sbrk(sgx_mm_arena* arena, intptr_t increment,
+                          void** out_old_brk);
+
+    /*
+     * Trim the committed space above the break of an arena down to
+     * trim_keep bytes right away.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL arena is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_arena_trim(sgx_mm_arena* arena);
+
+    /*
+     * Deallocate an arena and its region.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL arena is NULL, or its region was deallocated already.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_arena_destroy(sgx_mm_arena* arena);
+
+/* Slots of a region pool are committed on first access, not when allocated */
+#define SGX_MM_REGION_POOL_LAZY 0x1
+
+    typedef struct _sgx_mm_region_pool sgx_mm_region_pool;
+
+    /*
+     * Create a pool of @num_slots regions of @slot_size bytes each. The
+     * pool is one SGX_EMA_COMMIT_ON_DEMAND region; allocating and freeing
+     * slots takes O(1) and never adds EMAs. A slot is committed when
+     * allocated, or on first access with SGX_MM_REGION_POOL_LAZY, and its
+     * committed pages are trimmed when it is freed.
+     * @param[in] slot_size Size of a slot in bytes, multiple of page size.
+     * @param[in] num_slots Number of slots.
+     * @param[in] flags 0 or SGX_MM_REGION_POOL_LAZY.
+     * @param[out] out_pool Pointer to store the new pool.
+     * @param[out] out_base Pointer to store the address of the first slot,
+     * may be NULL.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters.
+     * See sgx_mm_alloc for other return values.
+     */
+    int sgx_mm_region_pool_create(size_t slot_size, size_t num_slots,
+                                  int flags, sgx_mm_region_pool** out_pool,
+                                  void** out_base);
+
+    /*
+     * Allocate a slot of a region pool. The pages of the slot are readable
+     * and writable and hold zeros.
+     * @param[out] out_addr Pointer to store the start address of the slot.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL pool or out_addr is NULL.
+     * @retval ENOMEM All slots are allocated.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_region_pool_alloc(sgx_mm_region_pool* pool, void** out_addr);
+
+    /*
+     * Free a slot allocated by sgx_mm_region_pool_alloc.
+     * @param[in] addr Start address of the slot.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL addr is not an allocated slot of the pool.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_region_pool_free(sgx_mm_region_pool* pool, void* addr);
+
+    /*
+     * Deallocate a region pool and all of its slots.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL pool is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_region_pool_destroy(sgx_mm_region_pool* pool);
+
+    typedef struct _sgx_mm_window sgx_mm_window;
+
+    /*
+     * Reserve an address window for the allocations of one thread. Regions
+     * allocated with sgx_mm_window_alloc are placed in the window by a
+     * search of the window's own page bitmap instead of the search of the
+     * whole enclave address space sgx_mm_alloc does. A window is meant to
+     * be kept in thread local storage and must not be used by more than one
+     * thread at a time. When it is full, the window doubles if no region
+     * lies in the address space above it, otherwise allocations fall back
+     * to sgx_mm_alloc.
+     * @param[in] size Initial size of the window in bytes, multiple of page
+     * size.
+     * @param[out] out_window Pointer to store the new window.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters.
+     * See sgx_mm_alloc for other return values.
+     */
+    int sgx_mm_window_create(size_t size, sgx_mm_window** out_window);
+
+    /*
+     * Allocate a region in a window. Same as sgx_mm_alloc with NULL addr,
+     * except that SGX_EMA_FIXED is not allowed. Regions aligned to more than
+     * a page are allocated by sgx_mm_alloc.
+     */
+    int sgx_mm_window_alloc(sgx_mm_window* window, size_t length, int flags,
+                            sgx_enclave_fault_handler_t handler,
+                            void* handler_private, void** out_addr);
+
+    /*
+     * Free a region allocated by sgx_mm_window_alloc, which may have been
+     * allocated outside the window. Space in the window stays reserved for
+     * it. Regions in the window must not be deallocated with
+     * sgx_mm_dealloc.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters, or the range is not allocated.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_window_free(sgx_mm_window* window, void* addr, size_t length);
+
+    /*
+     * Deallocate a window and all regions still allocated in it.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL window is NULL, or part of it was deallocated with
+     * sgx_mm_dealloc.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_window_destroy(sgx_mm_window* window);
+
+    /*
+     * Handler called when committing pages to a region would exceed the quota
+     * of its tag. It is called with the EMM lock held and may only uncommit
+     * pages, e.g., with sgx_mm_uncommit or sgx_mm_arena_trim, it must not
+     * allocate, deallocate or commit.
+     * @param[in] tag The tag over quota.
+     * @param[in] needed Bytes that have to be uncommitted from the tag for
+     * the commit to proceed.
+     * @param[in] priv The private data given to sgx_mm_set_reclaim_handler.
+     */
+    typedef void (*sgx_mm_reclaim_handler_t)(int tag, size_t needed,
+                                             void* priv);
+
+    /*
+     * Limit the EPC committed to regions of a tag. Commits that would exceed
+     * the limit call the reclaim handler if one is set, and fail with ENOMEM
+     * if the tag is still over quota afterwards. Faults on COMMIT_ON_DEMAND
+     * pages over quota are not handled. A limit below the current usage only
+     * affects later commits.
+     * @param[in] tag Tag of the regions, from 1 to SGX_EMA_NUM_TAGS - 1.
+     * @param[in] limit Limit in bytes, multiple of page size, 0 for no limit.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid tag or limit.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_set_quota(int tag, size_t limit);
+
+    /*
+     * Set the handler called to reclaim pages of a tag over quota, NULL for
+     * none.
+     * @retval 0 The operation was successful.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_set_reclaim_handler(sgx_mm_reclaim_handler_t handler,
+                                   void* priv);
+
+    /*
+     * Get the bytes of EPC committed to regions of a tag.
+     * @param[in] tag Tag of the regions, less than SGX_EMA_NUM_TAGS.
+     * @param[out] committed Committed bytes.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid tag, or committed is NULL.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_get_usage(int tag, size_t* committed);
+
+    /*
+     * Handler called when the committed EPC crosses the high watermark of the
+     * budget, after the EMM has released the pages it caches itself. Same
+     * restrictions as sgx_mm_reclaim_handler_t.
+     * @param[in] excess Bytes to uncommit to get back to the low watermark.
+     * @param[in] priv The private data given at registration.
+     */
+    typedef void (*sgx_mm_pressure_handler_t)(size_t excess, void* priv);
+
+    /*
+     * Set a budget for the EPC committed to all regions, e.g., below the EPC
+     * size of the platform to stay clear of EPC paging. A commit taking the
+     * committed EPC above @high releases the pages cached by the EMM, i.e.,
+     * stack pages of returned thread pool bundles and committed space above
+     * the break of arenas, and calls the pressure handlers, until the
+     * committed EPC is back at @low. This happens once until the committed
+     * EPC has dropped below @low again. Commits above @limit reclaim again
+     * each time and fail with ENOMEM if that doesn't free enough pages,
+     * except for the EMM metadata. Faults on COMMIT_ON_DEMAND pages neither
+     * fail nor reclaim, their pages are counted and the next commit outside
+     * a fault reclaims for them.
+     * @param[in] limit Hard limit in bytes, 0 for no budget.
+     * @param[in] high High watermark in bytes, at most @limit.
+     * @param[in] low Low watermark in bytes, at most @high.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid limits.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_set_budget(size_t limit, size_t high, size_t low);
+
+    /*
+     * Register a handler called under EPC pressure, see sgx_mm_set_budget.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL handler is NULL.
+     * @retval EEXIST The handler is registered with the same priv.
+     * @retval ENOMEM Too many handlers.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_register_pressure_handler(sgx_mm_pressure_handler_t handler,
+                                         void* priv);
+
+    /*
+     * Unregister a handler registered with sgx_mm_register_pressure_handler.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL The handler is not registered with priv.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_unregister_pressure_handler(sgx_mm_pressure_handler_t handler,
+                                           void* priv);
+
+    /*
+     * Get the bytes of EPC committed to all regions.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL committed is NULL.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_get_committed(size_t* committed);
+
+    /*
+     * Working set sampling. Each round revokes access to a random subset of
+     * the committed pages in a range and counts the pages accessed again
+     * before the next round, giving an estimate of the share of committed
+     * pages in use.
+     */
+    typedef struct _sgx_mm_sampler_config
+    {
+        size_t rate;        // per mille of the committed pages sampled in a
+                            // round, 1 to 1000
+        size_t max_faults;  // accesses to sampled pages after which a round
+                            // ends early to bound the overhead, the pages
+                            // left count as accessed, 0 for no limit
+        size_t chunk;       // contiguous pages sampled together, 0 or 1
+                            // for single pages; larger chunks make idle
+                            // trims larger
+    } sgx_mm_sampler_config;
+
+    typedef struct _sgx_mm_ws_info
+    {
+        size_t committed;  // bytes committed in the range
+        size_t hot;        // estimated bytes in use, smoothed over rounds
+        size_t cold;       // estimated bytes not in use
+        size_t sampled;    // bytes sampled in the last complete round
+        size_t accessed;   // bytes of those accessed during the round
+        size_t rounds;     // complete rounds
+        size_t trimmed;    // bytes uncommitted as idle, see
+                           // SGX_EMA_IDLE_TRIM
+    } sgx_mm_ws_info;
+
+    typedef struct _sgx_mm_sampler sgx_mm_sampler;
+
+    /*
+     * Create a sampler for the committed pages in a range, e.g., a region
+     * allocated with sgx_mm_alloc. Only REG pages with some permissions in
+     * regions without a custom page fault handler are sampled. Access is
+     * revoked and restored with the same requests to the untrusted runtime
+     * as sgx_mm_modify_permissions. Sampled pages are given back their
+     * permissions before the range is uncommitted, deallocated, or its
+     * permissions or type change. Pages with SGX_EMA_PROT_READ_WRITE in
+     * regions allocated with SGX_EMA_IDLE_TRIM that are not accessed during
+     * a round are uncommitted at its end, in one request per run of idle
+     * pages, instead of being given back their permissions. Idle pages in
+     * the range of a compressed store or a pager are evicted to it instead,
+     * see sgx_mm_zstore_create and sgx_mm_pager_create. Pages the EMM uses
+     * itself, i.e., its metadata, the pools of compressed stores and the
+     * staging pages of pagers and providers, are never sampled.
+     * @param[in] addr Page aligned start of the range.
+     * @param[in] length Size of the range, multiple of page size.
+     * @param[in] config Sampling rate and overhead budget.
+     * @param[out] out_sampler Pointer to store the new sampler.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid range or config.
+     * @retval EEXIST The range overlaps the range of another sampler.
+     * @retval ENOMEM Out of memory.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_sampler_create(void* addr, size_t length,
+                              const sgx_mm_sampler_config* config,
+                              sgx_mm_sampler** out_sampler);
+
+    /*
+     * End the current round and start the next one. The runtime calls this
+     * periodically, the period sets what counts as in use.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL sampler is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_sampler_tick(sgx_mm_sampler* sampler);
+
+    /*
+     * Get the working set estimate of a sampler.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL sampler or info is NULL.
+     * @retval EFAULT Failure to acquire the EMM lock.
+     */
+    int sgx_mm_sampler_query(sgx_mm_sampler* sampler, sgx_mm_ws_info* info);
+
+    /*
+     * Restore access to the sampled pages and destroy a sampler.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL sampler is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_sampler_destroy(sgx_mm_sampler* sampler);
+
+    /*
+     * Configuration of a compressed page store, sizes in bytes.
+     */
+    typedef struct _sgx_mm_zstore_config
+    {
+        size_t pool_size;  // address space reserved for compressed pages,
+                           // multiple of page size, at least two pages
+        size_t max_size;   // pages compressing to more bytes stay
+                           // committed, 0 for half a page
+    } sgx_mm_zstore_config;
+
+    typedef struct _sgx_mm_zstore_info
+    {
+        size_t stored;      // bytes of pages held compressed
+        size_t compressed;  // bytes of the pool they take
+        size_t committed;   // bytes of the pool committed
+    } sgx_mm_zstore_info;
+
+    typedef struct _sgx_mm_zstore sgx_mm_zstore;
+
+    /*
+     * Create a store for the cold pages of a range. Pages evicted to the
+     * store are compressed into a pool, a SGX_EMA_COMMIT_ON_DEMAND region
+     * whose pages are committed as needed, and trimmed. Their next access
+     * decompresses them and commits them again with EACCEPTCOPY, with the
+     * permissions the pages have then. Only readable regular pages of
+     * SGX_EMA_COMMIT_ON_DEMAND regions without a fault handler are stored,
+     * never those of regions the EMM uses itself, e.g., the pools of
+     * stores, which may lie in the range.
+     * Stored pages are dropped when uncommitted or deallocated, and
+     * committed again by sgx_mm_commit. A sampler with a range in the store
+     * evicts the pages it finds idle, see sgx_mm_sampler_create.
+     * @param[in] addr Page aligned start of the range.
+     * @param[in] length Size of the range, multiple of page size.
+     * @param[in] config Size of the pool and compression threshold.
+     * @param[out] out_store Pointer to store the new store.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters, or the range overlaps another
+     * store.
+     * @retval ENOMEM Out of memory.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_zstore_create(void* addr, size_t length,
+                             const sgx_mm_zstore_config* config,
+                             sgx_mm_zstore** out_store);
+
+    /*
+     * Compress the committed pages in a range into a store and trim them,
+     * one request per run of stored pages. The pages are made read-only
+     * with sgx_mm_modify_permissions requests before they are compressed,
+     * and pages left committed get their permissions back, so a write by
+     * another thread during the eviction faults and waits for it instead of
+     * being lost.
+     * @param[in] addr Page aligned start of the range, within the store.
+     * @param[in] length Size of the range, multiple of page size.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters.
+     * @retval ENOMEM The pool is full, pages before the first one that did
+     * not fit were evicted.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_zstore_evict(sgx_mm_zstore* store, void* addr, size_t length);
+
+    /*
+     * Get the usage of a store.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL store or info is NULL.
+     */
+    int sgx_mm_zstore_query(sgx_mm_zstore* store, sgx_mm_zstore_info* info);
+
+    /*
+     * Commit the stored pages again and destroy a store and its pool.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL store is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_zstore_destroy(sgx_mm_zstore* store);
+
+    typedef struct _sgx_mm_pager_config
+    {
+        size_t prefetch;  // paged out pages following a faulting page that
+                          // are paged in with it
+    } sgx_mm_pager_config;
+
+    typedef struct _sgx_mm_pager_info
+    {
+        size_t evicted;     // bytes paged out now
+        size_t restored;    // bytes paged in on faults so far
+        size_t prefetched;  // bytes paged in ahead of faults so far
+    } sgx_mm_pager_info;
+
+    typedef struct _sgx_mm_pager sgx_mm_pager;
+
+    /*
+     * Allocate a SGX_EMA_COMMIT_ON_DEMAND region whose pages can be paged
+     * out to untrusted memory. Paged out pages are sealed, encrypted and
+     * authenticated by sgx_mm_seal_page, into a backing store allocated with
+     * sgx_mm_backing_alloc_ocall, and trimmed; the enclave keeps the nonce
+     * and MAC of each page, so stale or moved copies are rejected. Their
+     * next access unseals them into a staging page and commits them again
+     * with EACCEPTCOPY, along with up to config->prefetch paged out pages
+     * after them. Only readable regular pages of the region without a fault
+     * handler are paged out. Paged out pages are dropped when uncommitted,
+     * and paged in by sgx_mm_commit. A sampler with a range in the region
+     * pages out the pages it finds idle, see sgx_mm_sampler_create.
+     * @param[in] length Size of the region, multiple of page size.
+     * @param[in] config Paging parameters.
+     * @param[out] out_pager Pointer to store the new pager.
+     * @param[out] out_addr Pointer to store the start address of the region.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters.
+     * @retval ENOMEM Out of memory or address space.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_pager_create(size_t length, const sgx_mm_pager_config* config,
+                            sgx_mm_pager** out_pager, void** out_addr);
+
+    /*
+     * Page out the committed pages of a range of a pager's region, trimming
+     * them with one request per run of pages. The pages are made read-only
+     * before they are sealed, as in sgx_mm_zstore_evict.
+     * @param[in] addr Page aligned start of the range, within the region.
+     * @param[in] length Size of the range, multiple of page size.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_pager_evict(sgx_mm_pager* pager, void* addr, size_t length);
+
+    /*
+     * Get the paging activity of a pager.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL pager or info is NULL.
+     */
+    int sgx_mm_pager_query(sgx_mm_pager* pager, sgx_mm_pager_info* info);
+
+    /*
+     * Deallocate the region of a pager and free its backing store.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL pager is NULL.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_pager_destroy(sgx_mm_pager* pager);
+
+    /*
+     * Fill pages of a provided region, see sgx_mm_provider_create. Called
+     * without the EMM lock held, one call at a time per provider. It must
+     * not access its own region nor destroy its provider.
+     * @param[in] offset Offset in the region of the first page to fill.
+     * @param[out] buf Page aligned buffer within the enclave to fill.
+     * @param[in] length Bytes to fill, multiple of page size.
+     * @param[in] priv The private data given in the configuration.
+     * @retval 0 The pages were filled.
+     * @retval Other The pages could not be provided.
+     */
+    typedef int (*sgx_mm_page_provider_t)(size_t offset, void* buf,
+                                          size_t length, void* priv);
+
+    typedef struct _sgx_mm_provider_config
+    {
+        sgx_mm_page_provider_t provider;
+        void* priv;    // passed to the provider
+        size_t fetch;  // most pages filled by one call, 0 or 1 for one
+    } sgx_mm_provider_config;
+
+    typedef struct _sgx_mm_provider_info
+    {
+        size_t fetched;  // bytes provided so far
+        size_t calls;    // calls to the provider so far
+    } sgx_mm_provider_info;
+
+    typedef struct _sgx_mm_provider sgx_mm_provider;
+
+    /*
+     * Allocate a SGX_EMA_COMMIT_ON_DEMAND region whose pages are filled by
+     * a provider, e.g., decrypting chunks of a sealed file. On the first
+     * access to a page, the provider fills it and up to config->fetch - 1
+     * pages after it that are not committed in a staging buffer, and they
+     * are committed with EACCEPTCOPY and permissions @prot. If @prot
+     * includes SGX_EMA_PROT_WRITE, sgx_mm_commit fetches the pages of a
+     * range ahead of use. Uncommitted pages are
+     * fetched again on their next access, so pages never written can be
+     * released with sgx_mm_uncommit. If the provider fails, the #PF handler
+     * leaves the fault to the next handler and sgx_mm_commit returns
+     * EFAULT. The region must only be deallocated with
+     * sgx_mm_provider_destroy.
+     * @param[in] length Size of the region, multiple of page size.
+     * @param[in] prot SGX_EMA_PROT_READ, optionally ORed with
+     * SGX_EMA_PROT_WRITE or SGX_EMA_PROT_EXEC.
+     * @param[in] config The provider and the most pages it fills at once.
+     * @param[out] out_provider Pointer to store the new provider.
+     * @param[out] out_addr Pointer to store the start address of the region.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL Invalid parameters.
+     * See sgx_mm_alloc for other return values.
+     */
+    int sgx_mm_provider_create(size_t length, int prot,
+                               const sgx_mm_provider_config* config,
+                               sgx_mm_provider** out_provider,
+                               void** out_addr);
+
+    /*
+     * Get the activity of a provider.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL provider or info is NULL.
+     */
+    int sgx_mm_provider_query(sgx_mm_provider* provider,
+                              sgx_mm_provider_info* info);
+
+    /*
+     * Deallocate the region of a provider and its staging buffer.
+     * @retval 0 The operation was successful.
+     * @retval EINVAL provider is NULL.
+     * @retval EBUSY Another thread is in a call to the provider.
+     * @retval EFAULT All other errors.
+     */
+    int sgx_mm_provider_destroy(sgx_mm_provider* provider);
+
 /* Return value used by the EMM #PF handler to indicate
  *  to the dispatcher that it should continue searching for the next handler.
  */
@@ -129,6 +129,24 @@ extern "C"
     int sgx_mm_modify_ocall(uint64_t addr, size_t length,
                             int page_properties_from, int page_properties_to);
 
+    /*
+     * Call OS to change the type of pages that are PROT_NONE in the page
+     * tables to PT_TRIM, and make them readable in the page tables so that
+     * the enclave can EACCEPT them. The EACCEPT done is notified with
+     * sgx_mm_modify_ocall as for other trimmed pages. TCS pages are still
+     * trimmed with sgx_mm_modify_ocall. This is a new function every
+     * runtime must provide.
+     *
+     * @param[in] addr Start address of the pages.
+     * @param[in] length Length of the area. This must be a multiple of the
+     * page size.
+     * @param[in] page_type The current type of the pages,
+     * SGX_EMA_PAGE_TYPE_REG.
+     * @retval 0 The operation was successful.
+     * @retval EFAULT for all failures.
+     */
+    int sgx_mm_trim_ocall(uint64_t addr, size_t length, int page_type);
+
     /*
      * Define a mutex and init/lock/unlock/destroy functions.
      */
@@ -156,6 +174,80 @@ extern "C"
      */
     bool sgx_mm_is_within_enclave(const void* ptr, size_t size);
 
+    /*
+     * Check whether the given buffer is strictly outside the enclave.
+     *
+     * Check whether the buffer given by the **ptr** and **size** parameters is
+     * strictly outside the enclave's memory. If so, return true. If any
+     * portion of the buffer lies within the enclave's memory, return false.
+     *
+     * @param[in] ptr The pointer to the buffer.
+     * @param[in] size The size of the buffer.
+     *
+     * @retval true The buffer is strictly outside the enclave.
+     * @retval false At least some part of the buffer is within the enclave,
+     * or the arguments are invalid. For example, if **ptr** is null or
+     * **size** causes arithmetic operations to wrap.
+     *
+     */
+    bool sgx_mm_is_outside_enclave(const void* ptr, size_t size);
+
+    /*
+     * Allocate untrusted memory to back paged out enclave pages, see
+     * sgx_mm_pager_create.
+     *
+     * @param[in] length Size in bytes, multiple of page size.
+     * @param[out] out_addr Pointer to store the start address, outside the
+     * enclave and page aligned.
+     * @retval 0 The operation was successful.
+     * @retval ENOMEM Out of memory.
+     * @retval EFAULT for all other failures.
+     */
+    int sgx_mm_backing_alloc_ocall(size_t length, void** out_addr);
+
+    /*
+     * Free memory allocated by sgx_mm_backing_alloc_ocall.
+     *
+     * @param[in] addr Start address of the memory.
+     * @param[in] length Size given to sgx_mm_backing_alloc_ocall.
+     * @retval 0 The operation was successful.
+     * @retval EFAULT for all failures.
+     */
+    int sgx_mm_backing_free_ocall(void* addr, size_t length);
+
+#define SGX_MM_MAC_SIZE 16
+
+    /*
+     * Encrypt and authenticate a page to be paged out, e.g., with AES-GCM
+     * under a key private to this enclave instance. Both buffers are
+     * within the enclave.
+     *
+     * @param[in] nonce Value never passed twice for the same key.
+     * @param[in] addr Address of the page, to be authenticated with it.
+     * @param[in] src The page, SGX_PAGE_SIZE bytes.
+     * @param[out] dst Buffer of SGX_PAGE_SIZE bytes for the ciphertext.
+     * @param[out] mac Buffer of SGX_MM_MAC_SIZE bytes for the MAC.
+     * @retval 0 The operation was successful.
+     * @retval EFAULT for all failures.
+     */
+    int sgx_mm_seal_page(uint64_t nonce, uint64_t addr, const void* src,
+                         void* dst, uint8_t* mac);
+
+    /*
+     * Decrypt a page sealed by sgx_mm_seal_page and verify its MAC. Both
+     * buffers are within the enclave.
+     *
+     * @param[in] nonce The nonce the page was sealed with.
+     * @param[in] addr Address of the page.
+     * @param[in] src The ciphertext, SGX_PAGE_SIZE bytes.
+     * @param[out] dst Buffer of SGX_PAGE_SIZE bytes for the page.
+     * @param[in] mac The MAC returned by sgx_mm_seal_page.
+     * @retval 0 The operation was successful.
+     * @retval EFAULT The MAC does not match or other failures.
+     */
+    int sgx_mm_unseal_page(uint64_t nonce, uint64_t addr, const void* src,
+                           void* dst, const uint8_t* mac);
+
 #define SGX_EMA_SYSTEM SGX_EMA_ALLOC_FLAGS(0x80UL) /* EMA reserved by system \
                                                     */
 
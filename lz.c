@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2024 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * A sequence is a token byte, with the number of literals in the high
+ * nibble and the match length minus LZ_MIN_MATCH in the low one, followed
+ * by the literals, a 16 bit little endian offset back into the output and
+ * the match length. A nibble of 15 is extended by bytes added to it up to
+ * the first one below 255. The last sequence has literals only.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 10
+#define LZ_NIBBLE    15
+
+static uint32_t lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static bool lz_put_len(uint8_t* dst, size_t cap, size_t* op, size_t n)
+{
+    n -= LZ_NIBBLE;
+    for (;;)
+    {
+        if (*op >= cap) return false;
+        uint8_t b = n >= 255 ? 255 : (uint8_t)n;
+        dst[(*op)++] = b;
+        if (b < 255) return true;
+        n -= 255;
+    }
+}
+
+// Append a sequence of 'num_lit' literals and a match of 'match_len' bytes
+// at 'offset', no match if 'match_len' is 0
+static bool lz_emit(uint8_t* dst, size_t cap, size_t* op, const uint8_t* lit,
+                    size_t num_lit, size_t offset, size_t match_len)
+{
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if (*op >= cap) return false;
+    dst[(*op)++] = (uint8_t)(((num_lit < LZ_NIBBLE ? num_lit : LZ_NIBBLE)
+                              << 4) |
+                             (ml < LZ_NIBBLE ? ml : LZ_NIBBLE));
+    if (num_lit >= LZ_NIBBLE && !lz_put_len(dst, cap, op, num_lit))
+        return false;
+    if (num_lit > cap - *op) return false;
+    memcpy(dst + *op, lit, num_lit);
+    *op += num_lit;
+    if (!match_len) return true;
+
+    if (cap - *op < 2) return false;
+    dst[(*op)++] = (uint8_t)offset;
+    dst[(*op)++] = (uint8_t)(offset >> 8);
+    if (ml >= LZ_NIBBLE && !lz_put_len(dst, cap, op, ml)) return false;
+    return true;
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap)
+{
+    uint16_t table[1 << LZ_HASH_BITS];  // last position + 1 of each hash
+    size_t ip = 0, anchor = 0, op = 0;
+
+    if (len > LZ_MAX_INPUT) return 0;
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= len)
+    {
+        uint32_t v = lz_read32(src + ip);
+        uint32_t h = lz_hash(v);
+        size_t cand = table[h];
+        table[h] = (uint16_t)(ip + 1);
+        if (!cand || lz_read32(src + cand - 1) != v)
+        {
+            ip++;
+            continue;
+        }
+        cand--;
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len &&
+               src[cand + match_len] == src[ip + match_len])
+            match_len++;
+        if (!lz_emit(dst, cap, &op, src + anchor, ip - anchor, ip - cand,
+                     match_len))
+            return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+    if (!lz_emit(dst, cap, &op, src + anchor, len - anchor, 0, 0)) return 0;
+    return op;
+}
+
+static bool lz_get_len(const uint8_t* src, size_t len, size_t* ip, size_t* n)
+{
+    for (;;)
+    {
+        if (*ip >= len) return false;
+        uint8_t b = src[(*ip)++];
+        *n += b;
+        if (b < 255) return true;
+    }
+}
+
+bool lz_decompress(const uint8_t* src, size_t len, uint8_t* dst,
+                   size_t dst_len)
+{
+    size_t ip = 0, op = 0;
+
+    while (ip < len)
+    {
+        uint8_t token = src[ip++];
+        size_t num_lit = (size_t)(token >> 4);
+        if (num_lit == LZ_NIBBLE && !lz_get_len(src, len, &ip, &num_lit))
+            return false;
+        if (num_lit > len - ip || num_lit > dst_len - op) return false;
+        memcpy(dst + op, src + ip, num_lit);
+        ip += num_lit;
+        op += num_lit;
+        if (ip == len) break;
+
+        if (len - ip < 2) return false;
+        size_t offset = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = (size_t)(token & LZ_NIBBLE);
+        if (match_len == LZ_NIBBLE && !lz_get_len(src, len, &ip, &match_len))
+            return false;
+        match_len += LZ_MIN_MATCH;
+        if (!offset || offset > op || match_len > dst_len - op) return false;
+        // byte by byte, the match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op == dst_len;
+}
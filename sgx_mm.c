@@ -35,12 +35,14 @@
 #include <errno.h>
 #include <stdlib.h>
 
+#include "bit_array.h"
 #include "ema.h"
 #include "emalloc.h"
 #include "sgx_mm_rt_abstraction.h"
 
 extern ema_root_t g_user_ema_root;
 extern ema_root_t g_rts_ema_root;
+extern void mm_thread_pool_reclaim(size_t target);
 #define LEGAL_ALLOC_PAGE_TYPE                             \
     (SGX_EMA_PAGE_TYPE_REG | SGX_EMA_PAGE_TYPE_SS_FIRST | \
      SGX_EMA_PAGE_TYPE_SS_REST)
@@ -50,7 +52,8 @@ size_t mm_user_end = 0;
 
 int mm_alloc_internal(void* addr, size_t size, int flags,
                       sgx_enclave_fault_handler_t handler, void* priv,
-                      void** out_addr, ema_root_t* root)
+                      void** out_addr, sgx_mm_handle_t* out_handle,
+                      ema_root_t* root)
 {
     int status = -1;
     size_t tmp_addr = 0;
@@ -62,6 +65,10 @@ int mm_alloc_internal(void* addr, size_t size, int flags,
     if (!(alloc_flags &
           (SGX_EMA_RESERVE | SGX_EMA_COMMIT_NOW | SGX_EMA_COMMIT_ON_DEMAND)))
         return EINVAL;
+    // idle pages can only come back on demand
+    if ((alloc_flags & SGX_EMA_IDLE_TRIM) &&
+        !(alloc_flags & SGX_EMA_COMMIT_ON_DEMAND))
+        return EINVAL;
 
     uint64_t page_type = (uint64_t)flags & SGX_EMA_PAGE_TYPE_MASK;
     if ((uint64_t)(~LEGAL_ALLOC_PAGE_TYPE) & page_type) return EINVAL;
@@ -74,6 +81,11 @@ int mm_alloc_internal(void* addr, size_t size, int flags,
     if (align_flag == 0) align_flag = 12;
     if (align_flag < 12) return EINVAL;
 
+    int placement = (int)(((uint32_t)flags & SGX_EMA_PLACEMENT_MASK) >>
+                          SGX_EMA_PLACEMENT_SHIFT);
+    if (placement > SGX_EMA_PLACE_SEGREGATED) return EINVAL;
+    int tag = (int)(((uint32_t)flags & SGX_EMA_TAG_MASK) >> SGX_EMA_TAG_SHIFT);
+
     uint64_t align_mask = (uint64_t)(1ULL << align_flag) - 1ULL;
 
     tmp_addr = (size_t)addr;
@@ -90,6 +102,12 @@ int mm_alloc_internal(void* addr, size_t size, int flags,
         si_flags = SGX_EMA_PROT_NONE;
     }
 
+    if (alloc_flags & SGX_EMA_COMMIT_NOW)
+    {
+        status = ema_quota_check(tag, size >> SGX_PAGE_SHIFT);
+        if (status) goto unlock;
+    }
+
     if (tmp_addr)
     {
         bool fixed_alloc = (alloc_flags & SGX_EMA_FIXED);
@@ -136,8 +154,8 @@ int mm_alloc_internal(void* addr, size_t size, int flags,
     // At this point, ret == false means:
     // Either no address given or the given address can't be used
     if (!ret)
-        ret = find_free_region(root, size, (1ULL << align_flag), &tmp_addr,
-                               &next_ema);
+        ret = find_free_region(root, size, (1ULL << align_flag), placement,
+                               &tmp_addr, &next_ema);
     if (!ret)
     {
         status = ENOMEM;
@@ -158,6 +176,16 @@ int mm_alloc_internal(void* addr, size_t size, int flags,
     }
 alloc_action:
     assert(node);
+    ema_set_tag(node, tag);
+    if (out_handle)
+    {
+        *out_handle = ema_handle_new(node);
+        if (!*out_handle)
+        {
+            status = ENOMEM;
+            goto alloc_failed;
+        }
+    }
     status = ema_do_alloc(node);
     if (status != 0)
     {
@@ -183,10 +211,139 @@ int sgx_mm_alloc(void* addr, size_t size, int flags,
 {
     if (flags & SGX_EMA_SYSTEM) return EINVAL;
 
-    return mm_alloc_internal(addr, size, flags, handler, priv, out_addr,
+    return mm_alloc_internal(addr, size, flags, handler, priv, out_addr, NULL,
                              &g_user_ema_root);
 }
 
+int sgx_mm_set_placement(int placement)
+{
+    int ret = EFAULT;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_root_set_placement(&g_user_ema_root, placement);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_set_quota(int tag, size_t limit)
+{
+    int ret = EFAULT;
+    if (limit % SGX_PAGE_SIZE) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_set_quota(tag, limit >> SGX_PAGE_SHIFT);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_set_reclaim_handler(sgx_mm_reclaim_handler_t handler, void* priv)
+{
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    ema_set_reclaim_handler(handler, priv);
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_get_usage(int tag, size_t* committed)
+{
+    if (tag < 0 || tag >= SGX_EMA_NUM_TAGS || !committed) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    *committed = ema_tag_committed(tag) << SGX_PAGE_SHIFT;
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_set_budget(size_t limit, size_t high, size_t low)
+{
+    int ret = EFAULT;
+    if ((limit | high | low) % SGX_PAGE_SIZE) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_set_budget(limit >> SGX_PAGE_SHIFT, high >> SGX_PAGE_SHIFT,
+                         low >> SGX_PAGE_SHIFT);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_register_pressure_handler(sgx_mm_pressure_handler_t handler,
+                                     void* priv)
+{
+    int ret = EFAULT;
+    if (!handler) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_add_pressure_handler(handler, priv);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_unregister_pressure_handler(sgx_mm_pressure_handler_t handler,
+                                       void* priv)
+{
+    int ret = EFAULT;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_remove_pressure_handler(handler, priv);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_get_committed(size_t* committed)
+{
+    if (!committed) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    *committed = ema_committed() << SGX_PAGE_SHIFT;
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_alloc_handle(void* addr, size_t size, int flags,
+                        sgx_enclave_fault_handler_t handler, void* priv,
+                        void** out_addr, sgx_mm_handle_t* out_handle)
+{
+    if (flags & SGX_EMA_SYSTEM) return EINVAL;
+    if (!out_handle) return EINVAL;
+
+    return mm_alloc_internal(addr, size, flags, handler, priv, out_addr,
+                             out_handle, &g_user_ema_root);
+}
+
+// Fetch the pages of [start, end) in the regions of page providers that are
+// not committed and have at least the permissions 'prot' the operation
+// needs. The EMM lock, held by the caller, is released around each call to
+// a provider, so EMAs must be searched again afterwards; '*dropped' is set
+// if it was. Returns EFAULT if a provider failed.
+static int mm_populate(size_t start, size_t end, int prot, bool* dropped)
+{
+    ema_provider_call_t call;
+    int ret = 0;
+
+    while ((ret = ema_provider_prepare(start, end, prot, false, &call)) !=
+           ENOENT)
+    {
+        if (dropped) *dropped = true;
+        sgx_mm_mutex_unlock(mm_lock);
+        // on EAGAIN, let the thread in a call to the provider finish it
+        int result = ret ? 0 : ema_provider_call(&call);
+        if (sgx_mm_mutex_lock(mm_lock)) abort();
+        if (ret) continue;
+        ret = ema_provider_finish(&call, result, false);
+        if (ret) return ret == EIO ? EFAULT : ret;
+    }
+    return 0;
+}
+
+// Handle a #PF at 'addr', a page not committed, by fetching it and up to
+// 'fetch' - 1 pages after it from its provider, with the EMM lock released
+// around the call. Returns ENOENT, the lock kept, if the page is not in a
+// provider's region.
+static int mm_fault_provider(size_t addr)
+{
+    ema_provider_call_t call;
+    int ret = ema_provider_prepare(addr, addr + SGX_PAGE_SIZE,
+                                   SGX_EMA_PROT_NONE, true, &call);
+    if (ret) return ret;
+    sgx_mm_mutex_unlock(mm_lock);
+    int result = ema_provider_call(&call);
+    if (sgx_mm_mutex_lock(mm_lock)) abort();
+    return ema_provider_finish(&call, result, true);
+}
+
 int mm_commit_internal(void* addr, size_t size, ema_root_t* root)
 {
     int ret = EFAULT;
@@ -195,6 +352,8 @@ int mm_commit_internal(void* addr, size_t size, ema_root_t* root)
     ema_t *first = NULL, *last = NULL;
 
     if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = mm_populate(start, end, SGX_EMA_PROT_WRITE, NULL);
+    if (ret) goto unlock;
     ret = search_ema_range(root, start, end, &first, &last);
     if (ret < 0)
     {
@@ -213,6 +372,26 @@ int sgx_mm_commit(void* addr, size_t size)
     return mm_commit_internal(addr, size, &g_user_ema_root);
 }
 
+int sgx_mm_commit_handle(sgx_mm_handle_t handle, void* addr, size_t size)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t end = start + size;
+    ema_t *first = NULL, *last = NULL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = mm_populate(start, end, SGX_EMA_PROT_WRITE, NULL);
+    if (ret) goto unlock;
+    ret = ema_handle_range(&g_user_ema_root, handle, start, end, &first,
+                           &last);
+    if (ret) goto unlock;
+
+    ret = ema_do_commit_loop(first, last, start, end);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
 int mm_uncommit_internal(void* addr, size_t size, ema_root_t* root)
 {
     int ret = EFAULT;
@@ -239,6 +418,24 @@ int sgx_mm_uncommit(void* addr, size_t size)
     return mm_uncommit_internal(addr, size, &g_user_ema_root);
 }
 
+int sgx_mm_uncommit_handle(sgx_mm_handle_t handle, void* addr, size_t size)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t end = start + size;
+    ema_t *first = NULL, *last = NULL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_handle_range(&g_user_ema_root, handle, start, end, &first,
+                           &last);
+    if (ret) goto unlock;
+
+    ret = ema_do_uncommit_loop(first, last, start, end);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
 int mm_dealloc_internal(void* addr, size_t size, ema_root_t* root)
 {
     int ret = EFAULT;
@@ -265,6 +462,24 @@ int sgx_mm_dealloc(void* addr, size_t size)
     return mm_dealloc_internal(addr, size, &g_user_ema_root);
 }
 
+int sgx_mm_dealloc_handle(sgx_mm_handle_t handle, void* addr, size_t size)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t end = start + size;
+    ema_t *first = NULL, *last = NULL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_handle_range(&g_user_ema_root, handle, start, end, &first,
+                           &last);
+    if (ret) goto unlock;
+
+    ret = ema_do_dealloc_loop(first, last, start, end);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
 int mm_commit_data_internal(void* addr, size_t size, uint8_t* data, int prot,
                             ema_root_t* root)
 {
@@ -300,6 +515,134 @@ int sgx_mm_commit_data(void* addr, size_t size, uint8_t* data, int prot)
     return mm_commit_data_internal(addr, size, data, prot, &g_user_ema_root);
 }
 
+int sgx_mm_commit_stream(void* addr, size_t size, size_t chunk,
+                         sgx_mm_data_producer_t producer, void* priv, int prot)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t end = start + size;
+    size_t done = start, len = 0;
+    ema_t *first = NULL, *last = NULL;
+    void* ring = NULL;
+
+    if (size == 0) return EINVAL;
+    if (size % SGX_PAGE_SIZE != 0) return EINVAL;
+    if (start % SGX_PAGE_SIZE != 0) return EINVAL;
+    if (end < start) return EINVAL;
+    if (chunk % SGX_PAGE_SIZE != 0) return EINVAL;
+    if (((uint32_t)prot) & (uint32_t)(~SGX_EMA_PROT_MASK)) return EINVAL;
+    if (!producer) return EINVAL;
+    chunk = chunk ? MIN(chunk, size) : SGX_PAGE_SIZE;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    // the staging pages are allocated first so they can't end up between
+    // the nodes of the range
+    ret = mm_alloc_internal(NULL, chunk, SGX_EMA_COMMIT_NOW, NULL, NULL, &ring,
+                            NULL, &g_user_ema_root);
+    if (ret) goto unlock;
+    ret = search_ema_range(&g_user_ema_root, start, end, &first, &last);
+    if (ret < 0)
+    {
+        ret = EINVAL;
+        goto free_ring;
+    }
+    ret = ema_can_commit_stream(first, last, start, end);
+    if (ret) goto free_ring;
+
+    // Each chunk is copied in as soon as it is produced. The lock is not
+    // held while producing, so the chunk is searched and checked again.
+    for (; done < end; done += len)
+    {
+        len = MIN(chunk, end - done);
+        sgx_mm_mutex_unlock(mm_lock);
+        int r = producer(done - start, ring, len, priv);
+        if (sgx_mm_mutex_lock(mm_lock)) abort();
+        if (r)
+        {
+            ret = EFAULT;
+            break;
+        }
+        if (search_ema_range(&g_user_ema_root, done, done + len, &first,
+                             &last) < 0)
+        {
+            ret = EINVAL;
+            break;
+        }
+        ret = ema_do_commit_stream_chunk(first, last, done, done + len,
+                                         (size_t)ring, prot);
+        if (ret) break;
+    }
+
+    // the pages committed so far get 'prot', even if a chunk failed
+    if (done > start)
+    {
+        int r = EINVAL;
+        if (search_ema_range(&g_user_ema_root, start, done, &first, &last) >=
+            0)
+            r = ema_do_commit_stream_finish(first, last, start, done, prot);
+        if (!ret) ret = r;
+    }
+free_ring:
+    mm_dealloc_internal(ring, chunk, &g_user_ema_root);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int mm_alloc_data_internal(void* addr, size_t size, int flags, uint8_t* data,
+                           int prot, void** out_addr, ema_root_t* root)
+{
+    int ret = EFAULT;
+    void* tmp_addr = NULL;
+    ema_t* node = NULL;
+    uint64_t page_type = (uint64_t)flags & SGX_EMA_PAGE_TYPE_MASK;
+
+    if (size == 0) return EINVAL;
+    if (size % SGX_PAGE_SIZE != 0) return EINVAL;
+    if (((size_t)data) % SGX_PAGE_SIZE != 0) return EINVAL;
+    if (flags & SGX_EMA_RESERVE) return EINVAL;
+    if (page_type && page_type != SGX_EMA_PAGE_TYPE_REG) return EINVAL;
+    if (((uint32_t)prot) & (uint32_t)(~SGX_EMA_PROT_MASK)) return EINVAL;
+    if (prot == SGX_EMA_PROT_NONE) return EINVAL;
+    if ((prot & SGX_EMA_PROT_EXEC) && !(prot & SGX_EMA_PROT_READ))
+        return EINVAL;
+    if (!sgx_mm_is_within_enclave(data, size)) return EINVAL;
+
+    flags = (int)(((uint32_t)flags & (uint32_t)(~SGX_EMA_COMMIT_NOW)) |
+                  SGX_EMA_COMMIT_ON_DEMAND);
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_quota_check(
+        (int)(((uint32_t)flags & SGX_EMA_TAG_MASK) >> SGX_EMA_TAG_SHIFT),
+        size >> SGX_PAGE_SHIFT);
+    if (ret) goto unlock;
+    ret = mm_alloc_internal(addr, size, flags, NULL, NULL, &tmp_addr, NULL,
+                            root);
+    if (ret) goto unlock;
+
+    node = search_ema(root, (size_t)tmp_addr);
+    assert(node);
+    ret = ema_do_alloc_data(node, data, prot);
+    if (ret)
+    {
+        ema_do_dealloc(node, (size_t)tmp_addr, (size_t)tmp_addr + size);
+        goto unlock;
+    }
+    if (out_addr) *out_addr = tmp_addr;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_alloc_data(void* addr, size_t size, int flags, uint8_t* data,
+                      int prot, void** out_addr)
+{
+    if (flags & SGX_EMA_SYSTEM) return EINVAL;
+
+    return mm_alloc_data_internal(addr, size, flags, data, prot, out_addr,
+                                  &g_user_ema_root);
+}
+
 int mm_modify_type_internal(void* addr, size_t size, int type, ema_root_t* root)
 {
     // for this API, TCS is the only valid page type
@@ -308,8 +651,8 @@ int mm_modify_type_internal(void* addr, size_t size, int type, ema_root_t* root)
         return EPERM;
     }
 
-    // TCS occupies only one page
-    if (size != SGX_PAGE_SIZE)
+    // each TCS occupies one page, a range converts every page in it
+    if (size == 0 || size % SGX_PAGE_SIZE != 0)
     {
         return EINVAL;
     }
@@ -321,6 +664,8 @@ int mm_modify_type_internal(void* addr, size_t size, int type, ema_root_t* root)
     if (start % SGX_PAGE_SIZE != 0) return EINVAL;
 
     if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = mm_populate(start, end, SGX_EMA_PROT_READ_WRITE, NULL);
+    if (ret) goto unlock;
     ret = search_ema_range(root, start, end, &first, &last);
 
     if (ret < 0)
@@ -329,9 +674,7 @@ int mm_modify_type_internal(void* addr, size_t size, int type, ema_root_t* root)
         goto unlock;
     }
 
-    // one page only, covered by a single ema node
-    assert(ema_next(first) == last);
-    ret = ema_change_to_tcs(first, (size_t)addr);
+    ret = ema_change_to_tcs_loop(first, last, start, end);
 unlock:
     sgx_mm_mutex_unlock(mm_lock);
     return ret;
@@ -375,54 +718,1185 @@ int sgx_mm_modify_permissions(void* addr, size_t size, int prot)
     return mm_modify_permissions_internal(addr, size, prot, &g_user_ema_root);
 }
 
-int sgx_mm_enclave_pfhandler(const sgx_pfinfo* pfinfo)
+int sgx_mm_modify_permissions_handle(sgx_mm_handle_t handle, void* addr,
+                                     size_t size, int prot)
 {
-    int ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
-    size_t addr = TRIM_TO((pfinfo->maddr), SGX_PAGE_SIZE);
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t end = start + size;
+    ema_t *first = NULL, *last = NULL;
+
+    if (size == 0) return EINVAL;
+    if (size % SGX_PAGE_SIZE) return EINVAL;
+    if (start % SGX_PAGE_SIZE) return EINVAL;
+    if ((prot & SGX_EMA_PROT_EXEC) && !(prot & SGX_EMA_PROT_READ))
+        return EINVAL;
+
     if (sgx_mm_mutex_lock(mm_lock)) return ret;
-    ema_t* ema = search_ema(&g_user_ema_root, addr);
-    void* data = NULL;
-    sgx_enclave_fault_handler_t eh = NULL;
-    if (!ema)
-    {
-        ema = search_ema(&g_rts_ema_root, addr);
-        if (!ema) goto unlock;
-    }
-    eh = ema_fault_handler(ema, &data);
-    if (eh)
+    ret = ema_handle_range(&g_user_ema_root, handle, start, end, &first,
+                           &last);
+    if (ret) goto unlock;
+
+    ret = ema_modify_permissions_loop(first, last, start, end, prot);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int mm_resize_internal(void* addr, size_t old_size, size_t new_size,
+                       int flags, void** out_addr, ema_root_t* root)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t old_end = start + old_size;
+    size_t new_end = start + new_size;
+    ema_t *first = NULL, *last = NULL, *tail = NULL;
+    sgx_enclave_fault_handler_t handler = NULL;
+    void *priv = NULL, *new_addr = NULL;
+    uint32_t alloc_flags = 0;
+
+    if (old_size == 0 || new_size == 0) return EINVAL;
+    if ((start | old_size | new_size) % SGX_PAGE_SIZE) return EINVAL;
+    if (old_end < start || new_end < start) return EINVAL;
+    if ((uint32_t)flags & (uint32_t)(~SGX_MM_RESIZE_MAYMOVE)) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    if (new_size == old_size)
     {
-        // don't hold the lock as handlers can longjmp
-        sgx_mm_mutex_unlock(mm_lock);
-        return eh(pfinfo, data);
+        ret = search_ema_range(root, start, old_end, &first, &last) < 0
+                  ? EINVAL
+                  : 0;
+        goto done;
     }
-    if (ema_page_committed(ema, addr))
+    if (new_size < old_size)
     {
-        // Check for spurious #PF
-        if ((pfinfo->pfec.rw == 0 &&
-             0 == (get_ema_si_flags(ema) & SGX_EMA_PROT_READ)) ||
-            (pfinfo->pfec.rw == 1 &&
-             0 == (get_ema_si_flags(ema) & SGX_EMA_PROT_WRITE)))
+        // shrink by releasing the tail
+        ret = search_ema_range(root, new_end, old_end, &first, &last);
+        if (ret < 0)
         {
-            ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
+            ret = EINVAL;
+            goto unlock;
         }
-        else
-            ret = SGX_MM_EXCEPTION_CONTINUE_EXECUTION;
+        ret = ema_do_dealloc_loop(first, last, new_end, old_end);
+        goto done;
+    }
+
+    // grow in place if the region ends at old_end and the space above it is
+    // free or reserved
+    tail = search_ema(root, old_end - SGX_PAGE_SIZE);
+    if (!tail || search_ema(root, start) == NULL ||
+        search_ema(root, old_end) == tail)
+    {
+        ret = EINVAL;
         goto unlock;
     }
-    if (get_ema_alloc_flags(ema) & SGX_EMA_COMMIT_ON_DEMAND)
+    ret = ema_extend(root, tail, new_end);
+    if (ret != ENOMEM || !(flags & SGX_MM_RESIZE_MAYMOVE)) goto done;
+
+    // relocate: allocate with the same flags, copy, release the old range
+    alloc_flags = (get_ema_alloc_flags(tail) &
+                   (SGX_EMA_RESERVE | SGX_EMA_COMMIT_NOW |
+                    SGX_EMA_COMMIT_ON_DEMAND | SGX_EMA_IDLE_TRIM |
+                    SGX_EMA_GROWSDOWN | SGX_EMA_GROWSUP)) |
+                  (uint32_t)SGX_EMA_TAG(get_ema_tag(tail));
+    handler = ema_fault_handler(tail, &priv);
+    ret = mm_alloc_internal(NULL, new_size, (int)alloc_flags, handler, priv,
+                            &new_addr, NULL, root);
+    if (ret) goto unlock;
+
+    ret = mm_populate(start, old_end, SGX_EMA_PROT_READ, NULL);
+    if (!ret && search_ema_range(root, start, old_end, &first, &last) < 0)
+        ret = EINVAL;
+    if (!ret)
+        ret = ema_copy_range(root, first, last, start, old_end,
+                             (size_t)new_addr);
+    if (!ret && search_ema_range(root, start, old_end, &first, &last) < 0)
+        ret = EINVAL;
+    if (!ret) ret = ema_do_dealloc_loop(first, last, start, old_end);
+    if (ret)
     {
-        if ((pfinfo->pfec.rw == 0 &&
-             0 == (get_ema_si_flags(ema) & SGX_EMA_PROT_READ)) ||
-            (pfinfo->pfec.rw == 1 &&
-             0 == (get_ema_si_flags(ema) & SGX_EMA_PROT_WRITE)))
-        {
-            ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
-            goto unlock;
-        }
+        mm_dealloc_internal(new_addr, new_size, root);
+        goto unlock;
+    }
+    start = (size_t)new_addr;
+done:
+    if (!ret && out_addr) *out_addr = (void*)start;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
 
-        // Currently kernel support for GROWSUP/GROWSDOWN not yet available.
-        // Add support for those flags later
-        if (ema_do_commit(ema, addr, addr + SGX_PAGE_SIZE))
+int sgx_mm_resize(void* addr, size_t old_size, size_t new_size, int flags,
+                  void** out_addr)
+{
+    return mm_resize_internal(addr, old_size, new_size, flags, out_addr,
+                              &g_user_ema_root);
+}
+
+/*
+ * Batched operations, see sgx_mm_batch.
+ */
+typedef struct batch_entry_
+{
+    size_t start;  // sort key
+    size_t idx;    // index into the caller's ops array
+} batch_entry_t;
+
+static int batch_entry_cmp(const void* a, const void* b)
+{
+    const batch_entry_t* x = (const batch_entry_t*)a;
+    const batch_entry_t* y = (const batch_entry_t*)b;
+
+    if (x->start != y->start) return (x->start < y->start) ? -1 : 1;
+    if (x->idx != y->idx) return (x->idx < y->idx) ? -1 : 1;
+    return 0;
+}
+
+static bool batch_op_mergeable(int op)
+{
+    return op == SGX_MM_OP_COMMIT || op == SGX_MM_OP_UNCOMMIT ||
+           op == SGX_MM_OP_DEALLOC || op == SGX_MM_OP_MODIFY_PERMISSIONS;
+}
+
+static int batch_check_op(const sgx_mm_op* op)
+{
+    size_t start = (size_t)op->addr;
+
+    switch (op->op)
+    {
+    case SGX_MM_OP_ALLOC:
+        if (op->flags & SGX_EMA_SYSTEM) return EINVAL;
+        return 0;
+    case SGX_MM_OP_COMMIT_DATA:
+    case SGX_MM_OP_MODIFY_TYPE:
+        // checked by the internal functions
+        return 0;
+    case SGX_MM_OP_MODIFY_PERMISSIONS:
+        if ((op->flags & SGX_EMA_PROT_EXEC) && !(op->flags & SGX_EMA_PROT_READ))
+            return EINVAL;
+        // fall through
+    case SGX_MM_OP_COMMIT:
+    case SGX_MM_OP_UNCOMMIT:
+    case SGX_MM_OP_DEALLOC:
+        if (op->length == 0) return EINVAL;
+        if (op->length % SGX_PAGE_SIZE) return EINVAL;
+        if (start % SGX_PAGE_SIZE) return EINVAL;
+        if (start + op->length < start) return EINVAL;
+        return 0;
+    default:
+        return EINVAL;
+    }
+}
+
+// Perform a possibly merged range operation, continuing the search of the
+// user EMA list from '*hint'.
+static int batch_do_range(int op, int prot, size_t start, size_t end,
+                          ema_t** hint)
+{
+    ema_t *first = NULL, *last = NULL;
+    bool dropped = false;
+
+    if (op == SGX_MM_OP_COMMIT)
+    {
+        int ret = mm_populate(start, end, SGX_EMA_PROT_WRITE, &dropped);
+        if (ret) return ret;
+        // the EMAs may have changed while the lock was released
+        if (dropped) *hint = NULL;
+    }
+    if (search_ema_range_hint(&g_user_ema_root, hint, start, end, &first,
+                              &last) < 0)
+        return EINVAL;
+
+    switch (op)
+    {
+    case SGX_MM_OP_COMMIT:
+        return ema_do_commit_loop(first, last, start, end);
+    case SGX_MM_OP_UNCOMMIT:
+        return ema_do_uncommit_loop(first, last, start, end);
+    case SGX_MM_OP_DEALLOC:
+        return ema_do_dealloc_loop(first, last, start, end);
+    default:
+        assert(op == SGX_MM_OP_MODIFY_PERMISSIONS);
+        return ema_modify_permissions_loop(first, last, start, end, prot);
+    }
+}
+
+static int batch_do_other(const sgx_mm_op* op)
+{
+    switch (op->op)
+    {
+    case SGX_MM_OP_ALLOC:
+        return mm_alloc_internal(op->addr, op->length, op->flags, NULL, NULL,
+                                 op->out_addr, NULL, &g_user_ema_root);
+    case SGX_MM_OP_COMMIT_DATA:
+        return mm_commit_data_internal(op->addr, op->length, op->data,
+                                       op->flags, &g_user_ema_root);
+    default:
+        assert(op->op == SGX_MM_OP_MODIFY_TYPE);
+        return mm_modify_type_internal(op->addr, op->length, op->flags,
+                                       &g_user_ema_root);
+    }
+}
+
+static bool batch_op_no_addr(const sgx_mm_op* op)
+{
+    return op->op == SGX_MM_OP_ALLOC && !op->addr;
+}
+
+// Execute ops [begin, end), none an ALLOC without an address, sorted by
+// address in 'order'
+static void batch_do_group(const sgx_mm_op* ops, size_t begin, size_t end,
+                           int* results, batch_entry_t* order)
+{
+    size_t n = end - begin;
+    size_t i = 0, j = 0, k = 0;
+    ema_t* hint = NULL;
+
+    for (i = 0; i < n; i++)
+    {
+        order[i].start = (size_t)ops[begin + i].addr;
+        order[i].idx = begin + i;
+        results[begin + i] = batch_check_op(&ops[begin + i]);
+    }
+    qsort(order, n, sizeof(batch_entry_t), batch_entry_cmp);
+
+    // Ranges are visited in ascending order, so each search continues from
+    // where the previous one stopped instead of from the head of the list.
+    for (i = 0; i < n; i = j)
+    {
+        const sgx_mm_op* op = &ops[order[i].idx];
+        size_t start = (size_t)op->addr;
+        size_t last = start + op->length;
+
+        j = i + 1;
+        if (results[order[i].idx]) continue;
+
+        if (!batch_op_mergeable(op->op))
+        {
+            results[order[i].idx] = batch_do_other(op);
+            continue;
+        }
+
+        // merge following ops of the same kind on contiguous ranges
+        while (j < n)
+        {
+            const sgx_mm_op* next = &ops[order[j].idx];
+            if (results[order[j].idx] || next->op != op->op ||
+                (size_t)next->addr != last)
+                break;
+            if (op->op == SGX_MM_OP_MODIFY_PERMISSIONS &&
+                next->flags != op->flags)
+                break;
+            last += next->length;
+            j++;
+        }
+        int ret = batch_do_range(op->op, op->flags, start, last, &hint);
+        for (k = i; k < j; k++)
+            results[order[k].idx] = ret;
+    }
+}
+
+int sgx_mm_batch(const sgx_mm_op* ops, size_t n, int* results)
+{
+    int ret = 0;
+    size_t i = 0, j = 0;
+    batch_entry_t order[SGX_MM_BATCH_MAX];
+
+    if (!ops || !results || n == 0 || n > SGX_MM_BATCH_MAX) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    // An ALLOC without an address may store its address in a later op, so
+    // the ops after it are only read once it is done.
+    for (i = 0; i < n; i = j)
+    {
+        if (batch_op_no_addr(&ops[i]))
+        {
+            results[i] = batch_check_op(&ops[i]);
+            if (!results[i]) results[i] = batch_do_other(&ops[i]);
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < n && !batch_op_no_addr(&ops[j]); j++)
+            ;
+        batch_do_group(ops, i, j, results, order);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (results[i])
+        {
+            ret = results[i];
+            break;
+        }
+    }
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+/*
+ * Heap arenas, see sgx_mm_arena_create.
+ */
+struct _sgx_mm_arena
+{
+    sgx_mm_arena_config config;
+    sgx_mm_handle_t handle;
+    size_t base;
+    size_t brk;            // current break
+    size_t committed_end;  // end of the pages committed by the arena
+    size_t grow;           // size of the next growth of committed space
+    size_t over;           // shrinks in a row with too much committed space
+    struct _sgx_mm_arena* next;  // next in the list of all arenas
+};
+
+static sgx_mm_arena* arenas;  // all arenas, trimmed under EPC pressure
+
+static int arena_trim(sgx_mm_arena* arena)
+{
+    size_t end = arena->base + arena->config.max_size;
+    size_t keep_end = ROUND_TO(arena->brk, SGX_PAGE_SIZE);
+    int ret = 0;
+
+    keep_end = MIN(keep_end + arena->config.trim_keep, arena->committed_end);
+    // pages above the committed space may have been committed by #PFs
+    if (keep_end < end)
+    {
+        ret = sgx_mm_uncommit_handle(arena->handle, (void*)keep_end,
+                                     end - keep_end);
+        if (ret) return ret;
+    }
+    arena->committed_end = keep_end;
+    arena->grow = MAX(arena->grow / 2, arena->config.grow_min);
+    arena->over = 0;
+    return 0;
+}
+
+static int arena_grow(sgx_mm_arena* arena, size_t new_brk)
+{
+    size_t end = arena->base + arena->config.max_size;
+    size_t need = ROUND_TO(new_brk, SGX_PAGE_SIZE) - arena->committed_end;
+    size_t chunk = MIN(MAX(need, arena->grow), end - arena->committed_end);
+    int ret = sgx_mm_commit_handle(arena->handle, (void*)arena->committed_end,
+                                   chunk);
+    if (ret) return ret;
+
+    arena->committed_end += chunk;
+    arena->grow = MIN(arena->grow * 2, arena->config.grow_max);
+    return 0;
+}
+
+int sgx_mm_arena_create(const sgx_mm_arena_config* config,
+                        sgx_mm_arena** out_arena, void** out_base)
+{
+    int ret = EFAULT;
+    sgx_mm_arena* arena = NULL;
+    void* base = NULL;
+
+    if (!config || !out_arena) return EINVAL;
+    if (config->max_size == 0 || config->grow_min == 0) return EINVAL;
+    if ((config->max_size | config->grow_min | config->grow_max |
+         config->trim_keep) %
+        SGX_PAGE_SIZE)
+        return EINVAL;
+    if (config->grow_max && config->grow_max < config->grow_min)
+        return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    arena = (sgx_mm_arena*)emalloc(sizeof(sgx_mm_arena), EMALLOC_CAT_OTHER);
+    if (!arena)
+    {
+        ret = ENOMEM;
+        goto unlock;
+    }
+    arena->config = *config;
+    if (!arena->config.grow_max) arena->config.grow_max = config->grow_min;
+
+    ret = mm_alloc_internal(NULL, config->max_size, SGX_EMA_COMMIT_ON_DEMAND,
+                            NULL, NULL, &base, &arena->handle,
+                            &g_user_ema_root);
+    if (ret)
+    {
+        efree(arena);
+        goto unlock;
+    }
+    arena->base = arena->brk = arena->committed_end = (size_t)base;
+    arena->grow = config->grow_min;
+    arena->over = 0;
+    arena->next = arenas;
+    arenas = arena;
+    *out_arena = arena;
+    if (out_base) *out_base = base;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_arena_sbrk(sgx_mm_arena* arena, intptr_t increment,
+                      void** out_old_brk)
+{
+    int ret = EFAULT;
+    size_t new_brk = 0, excess = 0;
+
+    if (!arena) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+
+    new_brk = arena->brk + (size_t)increment;
+    if ((increment > 0 && new_brk - arena->base > arena->config.max_size) ||
+        (increment < 0 && (new_brk < arena->base || new_brk > arena->brk)))
+    {
+        ret = ENOMEM;
+        goto unlock;
+    }
+
+    if (new_brk > arena->committed_end)
+    {
+        ret = arena_grow(arena, new_brk);
+        if (ret) goto unlock;
+    }
+    if (out_old_brk) *out_old_brk = (void*)arena->brk;
+    arena->brk = new_brk;
+    ret = 0;
+    if (increment >= 0)
+    {
+        arena->over = 0;
+        goto unlock;
+    }
+
+    // trim only when the excess persists, churn around the break reuses the
+    // committed pages
+    excess = arena->committed_end - ROUND_TO(new_brk, SGX_PAGE_SIZE);
+    if (excess <= arena->config.trim_threshold)
+        arena->over = 0;
+    else if (++arena->over > arena->config.trim_delay)
+        ret = arena_trim(arena);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_arena_trim(sgx_mm_arena* arena)
+{
+    int ret = EFAULT;
+
+    if (!arena) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = arena_trim(arena);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_arena_destroy(sgx_mm_arena* arena)
+{
+    int ret = EFAULT;
+
+    if (!arena) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = sgx_mm_dealloc_handle(arena->handle, (void*)arena->base,
+                                arena->config.max_size);
+    if (!ret)
+    {
+        sgx_mm_arena** link = &arenas;
+        while (*link != arena)
+            link = &(*link)->next;
+        *link = arena->next;
+        efree(arena);
+    }
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+// Called by the budget check with the lock held when the committed pages
+// cross the high watermark. Releases the pages the EMM keeps committed for
+// reuse: stacks of idle thread bundles first, then the committed space of
+// arenas above the break, whose trims may have been deferred.
+void mm_reclaim_internal(size_t target)
+{
+    mm_thread_pool_reclaim(target);
+    for (sgx_mm_arena* arena = arenas; arena; arena = arena->next)
+    {
+        if (ema_committed() <= target) break;
+        arena_trim(arena);
+    }
+}
+
+/*
+ * Region pools, see sgx_mm_region_pool_create.
+ */
+struct _sgx_mm_region_pool
+{
+    sgx_mm_handle_t handle;
+    size_t base;
+    size_t slot_size;
+    size_t num_slots;
+    int flags;
+    bit_array* in_use;  // bit i set if slot i is allocated
+    size_t num_free;
+    size_t* free_slots;  // stack of free slot indexes, top at num_free - 1
+};
+
+int sgx_mm_region_pool_create(size_t slot_size, size_t num_slots, int flags,
+                              sgx_mm_region_pool** out_pool, void** out_base)
+{
+    int ret = EFAULT;
+    sgx_mm_region_pool* pool = NULL;
+    void* base = NULL;
+    size_t i = 0;
+
+    if (!out_pool || slot_size == 0 || num_slots == 0) return EINVAL;
+    if (slot_size % SGX_PAGE_SIZE) return EINVAL;
+    if ((uint32_t)flags & (uint32_t)(~SGX_MM_REGION_POOL_LAZY)) return EINVAL;
+    if (num_slots > SIZE_MAX / slot_size) return ENOMEM;
+    if (num_slots > SIZE_MAX / sizeof(size_t)) return ENOMEM;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    pool = (sgx_mm_region_pool*)emalloc(sizeof(sgx_mm_region_pool),
+                                        EMALLOC_CAT_OTHER);
+    if (!pool)
+    {
+        ret = ENOMEM;
+        goto unlock;
+    }
+    pool->in_use = bit_array_new_reset_other(num_slots);
+    pool->free_slots =
+        (size_t*)emalloc(num_slots * sizeof(size_t), EMALLOC_CAT_OTHER);
+    if (!pool->in_use || !pool->free_slots)
+    {
+        ret = ENOMEM;
+        goto fail;
+    }
+
+    ret = mm_alloc_internal(NULL, slot_size * num_slots,
+                            SGX_EMA_COMMIT_ON_DEMAND, NULL, NULL, &base,
+                            &pool->handle, &g_user_ema_root);
+    if (ret) goto fail;
+
+    pool->base = (size_t)base;
+    pool->slot_size = slot_size;
+    pool->num_slots = num_slots;
+    pool->flags = flags;
+    // hand out the lowest slots first
+    for (i = 0; i < num_slots; i++)
+        pool->free_slots[i] = num_slots - 1 - i;
+    pool->num_free = num_slots;
+    *out_pool = pool;
+    if (out_base) *out_base = base;
+    goto unlock;
+fail:
+    if (pool->in_use) bit_array_delete(pool->in_use);
+    if (pool->free_slots) efree(pool->free_slots);
+    efree(pool);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_region_pool_alloc(sgx_mm_region_pool* pool, void** out_addr)
+{
+    int ret = EFAULT;
+    size_t slot = 0, addr = 0;
+
+    if (!pool || !out_addr) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    if (pool->num_free == 0)
+    {
+        ret = ENOMEM;
+        goto unlock;
+    }
+    slot = pool->free_slots[pool->num_free - 1];
+    addr = pool->base + slot * pool->slot_size;
+    if (!(pool->flags & SGX_MM_REGION_POOL_LAZY))
+    {
+        ret = sgx_mm_commit_handle(pool->handle, (void*)addr, pool->slot_size);
+        if (ret) goto unlock;
+    }
+    pool->num_free--;
+    bit_array_set(pool->in_use, slot);
+    *out_addr = (void*)addr;
+    ret = 0;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_region_pool_free(sgx_mm_region_pool* pool, void* addr)
+{
+    int ret = EFAULT;
+    size_t offset = (size_t)addr - (pool ? pool->base : 0);
+    size_t slot = 0;
+
+    if (!pool) return EINVAL;
+    if ((size_t)addr < pool->base || offset % pool->slot_size) return EINVAL;
+    slot = offset / pool->slot_size;
+    if (slot >= pool->num_slots) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    if (!bit_array_test(pool->in_use, slot))
+    {
+        ret = EINVAL;
+        goto unlock;
+    }
+    // only committed pages of the slot are trimmed
+    ret = sgx_mm_uncommit_handle(pool->handle, addr, pool->slot_size);
+    if (ret) goto unlock;
+    bit_array_reset_range(pool->in_use, slot, 1);
+    pool->free_slots[pool->num_free++] = slot;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_region_pool_destroy(sgx_mm_region_pool* pool)
+{
+    int ret = EFAULT;
+
+    if (!pool) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = sgx_mm_dealloc_handle(pool->handle, (void*)pool->base,
+                                pool->slot_size * pool->num_slots);
+    if (ret) goto unlock;
+    bit_array_delete(pool->in_use);
+    efree(pool->free_slots);
+    efree(pool);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+/*
+ * Per-thread allocation windows, see sgx_mm_window_create.
+ */
+struct _sgx_mm_window
+{
+    size_t base;
+    size_t size;
+    bit_array* used;  // bit i set if page i of the window is allocated
+    size_t cursor;    // page where the next search for free pages starts
+};
+
+// Find 'pages' free pages in the window, starting at the cursor and
+// wrapping around once. Caller holds mm_lock.
+static bool window_find(sgx_mm_window* window, size_t pages, size_t* pos)
+{
+    size_t n = window->size >> SGX_PAGE_SHIFT;
+    size_t from = window->cursor < n ? window->cursor : 0;
+    size_t end = n;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t start = bit_array_next_clear(window->used, from, end);
+        while (start < end)
+        {
+            size_t run_end = bit_array_next_set(window->used, start, n);
+            if (run_end - start >= pages)
+            {
+                *pos = start;
+                return true;
+            }
+            start = bit_array_next_clear(window->used, run_end, end);
+        }
+        // second pass covers the pages below the cursor, and runs that
+        // cross it
+        end = MIN(from + pages, n);
+        from = 0;
+    }
+    return false;
+}
+
+// Double the window, or grow it by at least 'pages', if the address space
+// above it is free. Reserves of other callers next to the window are left
+// alone. Caller holds mm_lock.
+static int window_grow(sgx_mm_window* window, size_t pages)
+{
+    size_t grow = MAX(window->size, pages << SGX_PAGE_SHIFT);
+    size_t end = window->base + window->size;
+    void* addr = NULL;
+    ema_t* next_ema = NULL;
+    int ret = 0;
+
+    if (end + grow < end) return ENOMEM;
+    if (!find_free_region_at(&g_user_ema_root, end, grow, &next_ema))
+        return ENOMEM;
+    ret = mm_alloc_internal((void*)end, grow,
+                            SGX_EMA_RESERVE | SGX_EMA_FIXED, NULL, NULL,
+                            &addr, NULL, &g_user_ema_root);
+    if (ret) return ret;
+    ret = bit_array_resize(window->used,
+                           (window->size + grow) >> SGX_PAGE_SHIFT);
+    if (ret)
+    {
+        mm_dealloc_internal((void*)end, grow, &g_user_ema_root);
+        return ret;
+    }
+    window->size += grow;
+    return 0;
+}
+
+int sgx_mm_window_create(size_t size, sgx_mm_window** out_window)
+{
+    int ret = EFAULT;
+    sgx_mm_window* window = NULL;
+    void* base = NULL;
+
+    if (!out_window || size == 0 || size % SGX_PAGE_SIZE) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    window = (sgx_mm_window*)emalloc(sizeof(sgx_mm_window), EMALLOC_CAT_OTHER);
+    if (!window)
+    {
+        ret = ENOMEM;
+        goto unlock;
+    }
+    window->used = bit_array_new_reset_other(size >> SGX_PAGE_SHIFT);
+    if (!window->used)
+    {
+        efree(window);
+        ret = ENOMEM;
+        goto unlock;
+    }
+    ret = mm_alloc_internal(NULL, size, SGX_EMA_RESERVE, NULL, NULL, &base,
+                            NULL, &g_user_ema_root);
+    if (ret)
+    {
+        bit_array_delete(window->used);
+        efree(window);
+        goto unlock;
+    }
+    window->base = (size_t)base;
+    window->size = size;
+    window->cursor = 0;
+    *out_window = window;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_window_alloc(sgx_mm_window* window, size_t size, int flags,
+                        sgx_enclave_fault_handler_t handler, void* priv,
+                        void** out_addr)
+{
+    size_t pages = size >> SGX_PAGE_SHIFT;
+    size_t pos = 0, addr = 0;
+    uint32_t align = ((uint32_t)flags & SGX_EMA_ALIGNMENT_MASK) >>
+                     SGX_EMA_ALIGNMENT_SHIFT;
+    int ret = 0;
+
+    if (!window || !out_addr) return EINVAL;
+    if (size == 0 || size % SGX_PAGE_SIZE) return EINVAL;
+    if (flags & (SGX_EMA_FIXED | SGX_EMA_SYSTEM)) return EINVAL;
+    // larger alignments are left to the global allocator
+    if (align > SGX_PAGE_SHIFT) goto global;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    if (!window_find(window, pages, &pos))
+    {
+        if (window_grow(window, pages) || !window_find(window, pages, &pos))
+        {
+            sgx_mm_mutex_unlock(mm_lock);
+            goto global;
+        }
+    }
+    addr = window->base + (pos << SGX_PAGE_SHIFT);
+    ret = mm_alloc_internal((void*)addr, size,
+                            (int)((uint32_t)flags | SGX_EMA_FIXED), handler,
+                            priv, out_addr, NULL, &g_user_ema_root);
+    if (!ret)
+    {
+        bit_array_set_range(window->used, pos, pages);
+        window->cursor = pos + pages;
+    }
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+global:
+    return sgx_mm_alloc(NULL, size, flags, handler, priv, out_addr);
+}
+
+int sgx_mm_window_free(sgx_mm_window* window, void* addr, size_t size)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    size_t pos = 0;
+    void* tmp = NULL;
+
+    if (!window) return EINVAL;
+    if (size == 0 || size % SGX_PAGE_SIZE || start % SGX_PAGE_SIZE)
+        return EINVAL;
+    if (start < window->base || start + size < start ||
+        start + size > window->base + window->size)
+        return sgx_mm_dealloc(addr, size);
+
+    pos = (start - window->base) >> SGX_PAGE_SHIFT;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    if (!bit_array_test_range(window->used, pos, size >> SGX_PAGE_SHIFT))
+    {
+        ret = EINVAL;
+        goto unlock;
+    }
+
+    // give the range back to the window, not to the global allocator
+    ret = mm_dealloc_internal(addr, size, &g_user_ema_root);
+    if (!ret)
+        ret = mm_alloc_internal(addr, size, SGX_EMA_RESERVE | SGX_EMA_FIXED,
+                                NULL, NULL, &tmp, NULL, &g_user_ema_root);
+    if (!ret) bit_array_reset_range(window->used, pos, size >> SGX_PAGE_SHIFT);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_window_destroy(sgx_mm_window* window)
+{
+    int ret = EFAULT;
+
+    if (!window) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = mm_dealloc_internal((void*)window->base, window->size,
+                              &g_user_ema_root);
+    if (!ret)
+    {
+        bit_array_delete(window->used);
+        efree(window);
+    }
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_sampler_create(void* addr, size_t length,
+                          const sgx_mm_sampler_config* config,
+                          sgx_mm_sampler** out_sampler)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+
+    if (!config || !out_sampler || length == 0) return EINVAL;
+    if ((start | length) % SGX_PAGE_SIZE) return EINVAL;
+    if (start + length < start) return EINVAL;
+    if (config->rate == 0 || config->rate > 1000) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_sampler_create(start, length, config, out_sampler);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_sampler_tick(sgx_mm_sampler* sampler)
+{
+    int ret = EFAULT;
+
+    if (!sampler) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_sampler_tick(sampler);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_sampler_query(sgx_mm_sampler* sampler, sgx_mm_ws_info* info)
+{
+    if (!sampler || !info) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    ema_sampler_query(sampler, info);
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_sampler_destroy(sgx_mm_sampler* sampler)
+{
+    int ret = EFAULT;
+
+    if (!sampler) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_sampler_destroy(sampler);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_zstore_create(void* addr, size_t length,
+                         const sgx_mm_zstore_config* config,
+                         sgx_mm_zstore** out_store)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+    void* pool = NULL;
+
+    if (!config || !out_store || length == 0) return EINVAL;
+    if ((start | length | config->pool_size) % SGX_PAGE_SIZE) return EINVAL;
+    if (start + length < start) return EINVAL;
+    if (config->pool_size < 2 * SGX_PAGE_SIZE) return EINVAL;
+    if (config->max_size >= SGX_PAGE_SIZE) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = mm_alloc_internal(NULL, config->pool_size, SGX_EMA_COMMIT_ON_DEMAND,
+                            NULL, NULL, &pool, NULL, &g_user_ema_root);
+    if (ret) goto unlock;
+    ret = ema_zstore_create(start, length, (size_t)pool, config, out_store);
+    if (ret) mm_dealloc_internal(pool, config->pool_size, &g_user_ema_root);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_zstore_evict(sgx_mm_zstore* store, void* addr, size_t length)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+
+    if (!store || length == 0) return EINVAL;
+    if ((start | length) % SGX_PAGE_SIZE) return EINVAL;
+    if (start + length < start) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_zstore_evict(store, start, start + length);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_zstore_query(sgx_mm_zstore* store, sgx_mm_zstore_info* info)
+{
+    if (!store || !info) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    ema_zstore_query(store, info);
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_zstore_destroy(sgx_mm_zstore* store)
+{
+    int ret = EFAULT;
+    size_t pool = 0, pool_size = 0;
+
+    if (!store) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_zstore_destroy(store, &pool, &pool_size);
+    if (!ret)
+        ret = mm_dealloc_internal((void*)pool, pool_size, &g_user_ema_root);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+// Staging pages at the start of a pager's region, see ema.c
+#define PAGER_STAGING_SIZE (2 * SGX_PAGE_SIZE)
+
+int sgx_mm_pager_create(size_t length, const sgx_mm_pager_config* config,
+                        sgx_mm_pager** out_pager, void** out_addr)
+{
+    int ret = EFAULT;
+    void* backing = NULL;
+    void* region = NULL;
+
+    if (!config || !out_pager || !out_addr || length == 0) return EINVAL;
+    if (length % SGX_PAGE_SIZE) return EINVAL;
+    if (length > SIZE_MAX - PAGER_STAGING_SIZE) return ENOMEM;
+
+    ret = sgx_mm_backing_alloc_ocall(length, &backing);
+    if (ret) return ret == ENOMEM ? ENOMEM : EFAULT;
+    if (((size_t)backing % SGX_PAGE_SIZE) ||
+        (size_t)backing + length < (size_t)backing ||
+        !sgx_mm_is_outside_enclave(backing, length))
+    {
+        ret = EFAULT;
+        goto free_backing;
+    }
+
+    if (sgx_mm_mutex_lock(mm_lock))
+    {
+        ret = EFAULT;
+        goto free_backing;
+    }
+    ret = mm_alloc_internal(NULL, length + PAGER_STAGING_SIZE,
+                            SGX_EMA_COMMIT_ON_DEMAND, NULL, NULL, &region,
+                            NULL, &g_user_ema_root);
+    if (ret) goto unlock;
+    ret = ema_pager_create((size_t)region, length + PAGER_STAGING_SIZE,
+                           config, backing, out_pager);
+    if (ret)
+    {
+        mm_dealloc_internal(region, length + PAGER_STAGING_SIZE,
+                            &g_user_ema_root);
+        goto unlock;
+    }
+    *out_addr = (uint8_t*)region + PAGER_STAGING_SIZE;
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+free_backing:
+    if (ret) sgx_mm_backing_free_ocall(backing, length);
+    return ret;
+}
+
+int sgx_mm_pager_evict(sgx_mm_pager* pager, void* addr, size_t length)
+{
+    int ret = EFAULT;
+    size_t start = (size_t)addr;
+
+    if (!pager || length == 0) return EINVAL;
+    if ((start | length) % SGX_PAGE_SIZE) return EINVAL;
+    if (start + length < start) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_pager_evict(pager, start, start + length);
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_pager_query(sgx_mm_pager* pager, sgx_mm_pager_info* info)
+{
+    if (!pager || !info) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    ema_pager_query(pager, info);
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_pager_destroy(sgx_mm_pager* pager)
+{
+    int ret = EFAULT;
+    size_t region = 0, size = 0;
+    void* backing = NULL;
+
+    if (!pager) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ema_pager_destroy(pager, &region, &size, &backing);
+    ret = mm_dealloc_internal((void*)region, size, &g_user_ema_root);
+    sgx_mm_mutex_unlock(mm_lock);
+    if (sgx_mm_backing_free_ocall(backing, size - PAGER_STAGING_SIZE))
+        ret = EFAULT;
+    return ret;
+}
+
+int sgx_mm_provider_create(size_t length, int prot,
+                           const sgx_mm_provider_config* config,
+                           sgx_mm_provider** out_provider, void** out_addr)
+{
+    int ret = EFAULT;
+    void *region = NULL, *staging = NULL;
+    size_t fetch = 0;
+
+    if (!config || !config->provider || !out_provider || !out_addr)
+        return EINVAL;
+    if (length == 0 || length % SGX_PAGE_SIZE) return EINVAL;
+    if (!(prot & SGX_EMA_PROT_READ) || (prot & ~SGX_EMA_PROT_MASK))
+        return EINVAL;
+    fetch = config->fetch ? config->fetch : 1;
+    if (fetch > length / SGX_PAGE_SIZE) return EINVAL;
+
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = mm_alloc_internal(NULL, fetch * SGX_PAGE_SIZE, SGX_EMA_COMMIT_NOW,
+                            NULL, NULL, &staging, NULL, &g_user_ema_root);
+    if (ret) goto unlock;
+    ret = mm_alloc_internal(NULL, length, SGX_EMA_COMMIT_ON_DEMAND, NULL,
+                            NULL, &region, NULL, &g_user_ema_root);
+    if (ret) goto free_staging;
+    ret = ema_provider_create((size_t)region, length, prot, (size_t)staging,
+                              config, out_provider);
+    if (ret)
+    {
+        mm_dealloc_internal(region, length, &g_user_ema_root);
+        goto free_staging;
+    }
+    *out_addr = region;
+    goto unlock;
+free_staging:
+    mm_dealloc_internal(staging, fetch * SGX_PAGE_SIZE, &g_user_ema_root);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_provider_query(sgx_mm_provider* provider,
+                          sgx_mm_provider_info* info)
+{
+    if (!provider || !info) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return EFAULT;
+    ema_provider_query(provider, info);
+    sgx_mm_mutex_unlock(mm_lock);
+    return 0;
+}
+
+int sgx_mm_provider_destroy(sgx_mm_provider* provider)
+{
+    int ret = EFAULT;
+    size_t addr = 0, size = 0, staging = 0, staging_size = 0;
+
+    if (!provider) return EINVAL;
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ret = ema_provider_destroy(provider, &addr, &size, &staging,
+                               &staging_size);
+    if (ret) goto unlock;
+    ret = mm_dealloc_internal((void*)addr, size, &g_user_ema_root);
+    if (!ret)
+        ret = mm_dealloc_internal((void*)staging, staging_size,
+                                  &g_user_ema_root);
+unlock:
+    sgx_mm_mutex_unlock(mm_lock);
+    return ret;
+}
+
+int sgx_mm_enclave_pfhandler(const sgx_pfinfo* pfinfo)
+{
+    int ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
+    size_t addr = TRIM_TO((pfinfo->maddr), SGX_PAGE_SIZE);
+    if (sgx_mm_mutex_lock(mm_lock)) return ret;
+    ema_t* ema = search_ema(&g_user_ema_root, addr);
+    void* data = NULL;
+    sgx_enclave_fault_handler_t eh = NULL;
+    uint64_t si_flags = 0;
+    if (!ema)
+    {
+        ema = search_ema(&g_rts_ema_root, addr);
+        if (!ema) goto unlock;
+    }
+    if (ema_sampler_fault(addr))
+    {
+        ret = SGX_MM_EXCEPTION_CONTINUE_EXECUTION;
+        goto unlock;
+    }
+    eh = ema_fault_handler(ema, &data);
+    if (eh)
+    {
+        // don't hold the lock as handlers can longjmp
+        sgx_mm_mutex_unlock(mm_lock);
+        return eh(pfinfo, data);
+    }
+    // permissions of the faulting page, which may differ from the EMA's
+    si_flags = get_ema_page_si_flags(ema, addr);
+    if (ema_page_committed(ema, addr))
+    {
+        // Check for spurious #PF
+        if ((pfinfo->pfec.rw == 0 && 0 == (si_flags & SGX_EMA_PROT_READ)) ||
+            (pfinfo->pfec.rw == 1 && 0 == (si_flags & SGX_EMA_PROT_WRITE)))
+        {
+            ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
+        }
+        else
+            ret = SGX_MM_EXCEPTION_CONTINUE_EXECUTION;
+        goto unlock;
+    }
+    if (get_ema_alloc_flags(ema) & SGX_EMA_COMMIT_ON_DEMAND)
+    {
+        if ((pfinfo->pfec.rw == 0 && 0 == (si_flags & SGX_EMA_PROT_READ)) ||
+            (pfinfo->pfec.rw == 1 && 0 == (si_flags & SGX_EMA_PROT_WRITE)))
+        {
+            ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
+            goto unlock;
+        }
+
+        // Currently kernel support for GROWSUP/GROWSDOWN not yet available.
+        // Add support for those flags later
+        int r = ema_backing_fault(ema, addr);
+        // 'ema' may be gone once the lock was released for a provider
+        if (r == ENOENT) r = mm_fault_provider(addr);
+        if (r == ENOENT) r = ema_do_commit(ema, addr, addr + SGX_PAGE_SIZE);
+        if (r == EAGAIN)
+        {
+            // another thread is fetching the page, retry once it is done
+            ret = SGX_MM_EXCEPTION_CONTINUE_EXECUTION;
+            goto unlock;
+        }
+        if (r == ENOMEM || r == EIO)
+        {
+            // over the quota of the tag, or the provider failed, leave it
+            // to the next handler
+            ret = SGX_MM_EXCEPTION_CONTINUE_SEARCH;
+            goto unlock;
+        }
+        if (r)
         {
             sgx_mm_mutex_unlock(mm_lock);
             abort();